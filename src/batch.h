@@ -0,0 +1,310 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+
+#include "engine.h"
+#include "bytecode.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+#include <vector>
+
+// how a batched instruction finds operand i: register base + i * stride covers contiguous
+// (stride 1) and broadcast (stride 0) operands, anything irregular is gathered through
+// the operand words of the instruction stream
+enum BatchOperand
+{
+    BATCH_CONTIGUOUS = 0,
+    BATCH_BROADCAST,
+    BATCH_STRIDED,
+    BATCH_GATHER,
+};
+
+// a run of instructions with the same op (and exponent) at the same depth. they do not
+// depend on each other, so the whole run executes as one vector operation whose outputs
+// are the contiguous registers leaf_count + [begin, begin + lane_count).
+struct BatchGroup
+{
+    uint32_t op;
+    int begin;
+    int lane_count;
+    BatchOperand mode[2];
+    int base[2];
+    int stride[2];
+};
+
+// DyNet style autobatching of a compiled program: instructions are regrouped by depth, the
+// longest path from a leaf, so the isomorphic subgraphs of per sample code line up, every
+// sample contributing one lane to the same group. lanes keep program order, which lines
+// up the operands of consecutive groups too.
+struct BatchProgram
+{
+    BytecodeProgram program;
+    std::vector<BatchGroup> groups;
+};
+
+void batch_classify_operand(BatchGroup& group, const uint32_t* code, int slot)
+{
+    int n = group.lane_count;
+    uint32_t mask = slot == 0 ? BYTECODE_OPERAND_MASK : 0xffffffffu;
+    int first = (int)(code[2 * group.begin + slot] & mask);
+    int stride = n > 1 ? (int)(code[2 * (group.begin + 1) + slot] & mask) - first : 1;
+    group.base[slot] = first;
+    group.stride[slot] = stride;
+    for (int i = 2; i < n; i++)
+    {
+        if ((int)(code[2 * (group.begin + i) + slot] & mask) != first + i * stride)
+        {
+            group.mode[slot] = BatchOperand::BATCH_GATHER;
+            return;
+        }
+    }
+    if (stride == 1) group.mode[slot] = BatchOperand::BATCH_CONTIGUOUS;
+    else if (stride == 0) group.mode[slot] = BatchOperand::BATCH_BROADCAST;
+    else group.mode[slot] = BatchOperand::BATCH_STRIDED;
+}
+
+void batch_compile(BatchProgram& batch, BytecodeProgram& source)
+{
+    assert(!source.forward_kernel && !source.backward_kernel);
+    BytecodeProgram& program = batch.program;
+    int leaf_count = source.leaf_count;
+    int n = source.instruction_count;
+
+    std::vector<int> depth(leaf_count + n, 0);
+    std::vector<uint32_t> exponent_bits(n, 0);
+    for (int k = 0; k < n; k++)
+    {
+        uint32_t op = source.code[2 * k] >> BYTECODE_OP_SHIFT;
+        int a = (int)(source.code[2 * k] & BYTECODE_OPERAND_MASK);
+        int d = depth[a];
+        if (op == MathOperation::ADD || op == MathOperation::MULTIPLE) d = std::max(d, depth[source.code[2 * k + 1]]);
+        if (op == MathOperation::POW) memcpy(&exponent_bits[k], &source.constants[source.code[2 * k + 1]], sizeof(uint32_t));
+        depth[leaf_count + k] = d + 1;
+    }
+
+    // depth first keeps the stream topological, program order inside a group keeps lanes aligned
+    std::vector<int> order(n);
+    for (int k = 0; k < n; k++)
+    {
+        order[k] = k;
+    }
+    std::stable_sort(order.begin(), order.end(), [&](int x, int y) {
+        if (depth[leaf_count + x] != depth[leaf_count + y]) return depth[leaf_count + x] < depth[leaf_count + y];
+        uint32_t op_x = source.code[2 * x] >> BYTECODE_OP_SHIFT;
+        uint32_t op_y = source.code[2 * y] >> BYTECODE_OP_SHIFT;
+        if (op_x != op_y) return op_x < op_y;
+        return exponent_bits[x] < exponent_bits[y];
+    });
+
+    std::vector<int> register_map(leaf_count + n);
+    for (int r = 0; r < leaf_count; r++)
+    {
+        register_map[r] = r;
+    }
+    for (int i = 0; i < n; i++)
+    {
+        register_map[leaf_count + order[i]] = leaf_count + i;
+    }
+
+    program = source;
+    program.constants.clear();
+    for (int i = 0; i < n; i++)
+    {
+        int k = order[i];
+        uint32_t op = source.code[2 * k] >> BYTECODE_OP_SHIFT;
+        uint32_t a = (uint32_t)register_map[source.code[2 * k] & BYTECODE_OPERAND_MASK];
+        uint32_t b = 0;
+        if (op == MathOperation::ADD || op == MathOperation::MULTIPLE)
+        {
+            b = (uint32_t)register_map[source.code[2 * k + 1]];
+        }
+        else if (op == MathOperation::POW)
+        {
+            b = (uint32_t)program.constants.size();
+            program.constants.push_back(source.constants[source.code[2 * k + 1]]);
+        }
+        program.code[2 * i] = (op << BYTECODE_OP_SHIFT) | a;
+        program.code[2 * i + 1] = b;
+        program.nodes[i] = source.nodes[k];
+    }
+    for (int i = 0; i < program.register_of.size(); i++)
+    {
+        if (program.register_of[i] >= 0) program.register_of[i] = register_map[program.register_of[i]];
+    }
+    program.root_register = register_map[source.root_register];
+
+    batch.groups.clear();
+    for (int i = 0; i < n; )
+    {
+        int k = order[i];
+        int end = i + 1;
+        while (end < n && depth[leaf_count + order[end]] == depth[leaf_count + k]
+            && (source.code[2 * order[end]] >> BYTECODE_OP_SHIFT) == (source.code[2 * k] >> BYTECODE_OP_SHIFT)
+            && exponent_bits[order[end]] == exponent_bits[k])
+        {
+            end++;
+        }
+
+        BatchGroup group;
+        group.op = program.code[2 * i] >> BYTECODE_OP_SHIFT;
+        group.begin = i;
+        group.lane_count = end - i;
+        batch_classify_operand(group, program.code.data(), 0);
+        // the second word of a POW is its constant index, all lanes share the exponent
+        if (group.op == MathOperation::ADD || group.op == MathOperation::MULTIPLE)
+        {
+            batch_classify_operand(group, program.code.data(), 1);
+        }
+        else
+        {
+            group.mode[1] = BatchOperand::BATCH_BROADCAST;
+            group.base[1] = group.op == MathOperation::POW ? (int)program.code[2 * i + 1] : 0;
+            group.stride[1] = 0;
+        }
+        batch.groups.push_back(group);
+        i = end;
+    }
+}
+
+// calls fn with an index functor for each operand, one instantiation per operand layout
+template <typename F>
+void batch_with_operand(BatchGroup& group, const uint32_t* code, int slot, F fn)
+{
+    int base = group.base[slot];
+    int stride = group.stride[slot];
+    const uint32_t* words = code + 2 * group.begin + slot;
+    uint32_t mask = slot == 0 ? BYTECODE_OPERAND_MASK : 0xffffffffu;
+    switch(group.mode[slot])
+    {
+    case BatchOperand::BATCH_CONTIGUOUS: fn([base](int i) { return base + i; }); break;
+    case BatchOperand::BATCH_BROADCAST: fn([base](int i) { return base; }); break;
+    case BatchOperand::BATCH_STRIDED: fn([base, stride](int i) { return base + i * stride; }); break;
+    case BatchOperand::BATCH_GATHER: fn([words, mask](int i) { return (int)(words[2 * i] & mask); }); break;
+    }
+}
+
+template <typename A, typename B>
+void batch_forward_group(BatchGroup& group, float* data, float* out, const float* constants, A a, B b)
+{
+    int n = group.lane_count;
+    switch(group.op)
+    {
+    case MathOperation::ADD:
+        for (int i = 0; i < n; i++) out[i] = data[a(i)] + data[b(i)];
+        break;
+    case MathOperation::MULTIPLE:
+        for (int i = 0; i < n; i++) out[i] = data[a(i)] * data[b(i)];
+        break;
+    case MathOperation::POW:
+        {
+            float exponent = constants[group.base[1]];
+            for (int i = 0; i < n; i++) out[i] = powf(data[a(i)], exponent);
+        }
+        break;
+    case MathOperation::EXP:
+        for (int i = 0; i < n; i++) out[i] = expf(data[a(i)]);
+        break;
+    case MathOperation::TANH:
+        for (int i = 0; i < n; i++) out[i] = tanhf(data[a(i)]);
+        break;
+    case MathOperation::RELU:
+        for (int i = 0; i < n; i++) out[i] = data[a(i)] < 0 ? 0 : data[a(i)];
+        break;
+    default:
+        break;
+    }
+}
+
+// lanes push in program order, an operand shared by several lanes sums them in that order
+template <typename A, typename B>
+void batch_backward_group(BatchGroup& group, float* data, float* gradient, float* out, float* out_gradient, const float* constants, A a, B b)
+{
+    int n = group.lane_count;
+    switch(group.op)
+    {
+    case MathOperation::ADD:
+        for (int i = 0; i < n; i++)
+        {
+            gradient[a(i)] += 1.f * out_gradient[i];
+            gradient[b(i)] += 1.f * out_gradient[i];
+        }
+        break;
+    case MathOperation::MULTIPLE:
+        for (int i = 0; i < n; i++)
+        {
+            gradient[a(i)] += data[b(i)] * out_gradient[i];
+            gradient[b(i)] += data[a(i)] * out_gradient[i];
+        }
+        break;
+    case MathOperation::POW:
+        {
+            float exponent = constants[group.base[1]];
+            for (int i = 0; i < n; i++) gradient[a(i)] += exponent * powf(data[a(i)], exponent - 1.f) * out_gradient[i];
+        }
+        break;
+    case MathOperation::EXP:
+        for (int i = 0; i < n; i++) gradient[a(i)] += out[i] * out_gradient[i];
+        break;
+    case MathOperation::TANH:
+        for (int i = 0; i < n; i++) gradient[a(i)] += (1.f - powf(out[i], 2)) * out_gradient[i];
+        break;
+    case MathOperation::RELU:
+        for (int i = 0; i < n; i++) gradient[a(i)] += (data[a(i)] < 0 ? 0 : 1) * out_gradient[i];
+        break;
+    default:
+        break;
+    }
+}
+
+void batch_run_forward(BatchProgram& batch)
+{
+    BytecodeProgram& program = batch.program;
+    const uint32_t* code = program.code.data();
+    float* data = program.data.data();
+    for (int g = 0; g < batch.groups.size(); g++)
+    {
+        BatchGroup& group = batch.groups[g];
+        float* out = data + program.leaf_count + group.begin;
+        batch_with_operand(group, code, 0, [&](auto a) {
+            batch_with_operand(group, code, 1, [&](auto b) {
+                batch_forward_group(group, data, out, program.constants.data(), a, b);
+            });
+        });
+    }
+}
+
+void batch_run_backward(BatchProgram& batch)
+{
+    BytecodeProgram& program = batch.program;
+    const uint32_t* code = program.code.data();
+    float* data = program.data.data();
+    float* gradient = program.gradient.data();
+    for (int g = (int)batch.groups.size() - 1; g >= 0; g--)
+    {
+        BatchGroup& group = batch.groups[g];
+        int offset = program.leaf_count + group.begin;
+        batch_with_operand(group, code, 0, [&](auto a) {
+            batch_with_operand(group, code, 1, [&](auto b) {
+                batch_backward_group(group, data, gradient, data + offset, gradient + offset, program.constants.data(), a, b);
+            });
+        });
+    }
+}
+
+// drop ins for bytecode_forward / bytecode_backward on the batched program
+void batch_forward(BatchProgram& batch)
+{
+    bytecode_load_leaves(batch.program);
+    batch_run_forward(batch);
+    bytecode_store_root(batch.program);
+}
+
+void batch_backward(BatchProgram& batch)
+{
+    bytecode_load_gradients(batch.program);
+    batch_run_backward(batch);
+    bytecode_store_gradients(batch.program);
+}
+
+#endif
@@ -0,0 +1,309 @@
+#ifndef _BYTECODE_H_
+#define _BYTECODE_H_
+
+#include "engine.h"
+#include "graph.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+// computed goto is a gcc/clang extension. cl, which the makefile uses, has no equivalent
+// and builds the switch loops below (one indirect jump per instruction through the switch's
+// table instead of one per handler), so the threaded dispatch needs a gcc or clang build.
+#if defined(__GNUC__) || defined(__clang__)
+#define BYTECODE_COMPUTED_GOTO 1
+#else
+#define BYTECODE_COMPUTED_GOTO 0
+#endif
+
+// an instruction is two 32 bit words: the opcode in the top 4 bits of the first word
+// with operand register a below it, then operand register b (or the constant index
+// for POW). instruction k writes register leaf_count + k, so the result needs no slot.
+#define BYTECODE_OP_SHIFT 28
+#define BYTECODE_OPERAND_MASK 0x0fffffffu
+
+// native replacement for the interpreter loops, see codegen.h
+typedef void (*BytecodeKernel)(float* data, float* gradient);
+
+// a captured graph lowered to a dense instruction stream over dense register files.
+// leaves (inputs, parameters, constants) take registers [0, leaf_count), every other
+// node follows in pool order, which keeps the stream topologically sorted.
+struct BytecodeProgram
+{
+    int leaf_count = 0;
+    int instruction_count = 0;
+    int root = -1;
+    int root_register = -1;
+    std::vector<uint32_t> code;
+    std::vector<float> constants;
+    std::vector<int> leaves;            // pool index of every leaf register, -1 for a constant made by a pass
+    std::vector<int> nodes;             // pool index of every instruction's output
+    std::vector<int> register_of;       // pool index -> register, -1 outside the graph
+    std::vector<float> data;
+    std::vector<float> gradient;
+    BytecodeKernel forward_kernel = NULL;
+    BytecodeKernel backward_kernel = NULL;
+};
+
+void bytecode_compile(BytecodeProgram& program, Graph& graph)
+{
+    int count = (int)graph.reachable.size();
+    program.leaves.clear();
+    program.nodes.clear();
+    program.register_of.assign(count, -1);
+    for (int i = 0; i < count; i++)
+    {
+        if (!graph.reachable[i]) continue;
+        if (graph_producer_count(graph.adjacency, i) == 0) program.leaves.push_back(i);
+        else program.nodes.push_back(i);
+    }
+    // the interpreters only dispatch scalar ops, anything else compiles to the root as a leaf
+    for (int k = 0; k < program.nodes.size(); k++)
+    {
+        if (g_value_pool->values[program.nodes[k]].op < GRAPH_OP_COUNT) continue;
+        fprintf(stderr, "value %d has no bytecode op! compile failed!", program.nodes[k]);
+        program.leaves.assign(1, graph.root.idx);
+        program.nodes.clear();
+    }
+    program.leaf_count = (int)program.leaves.size();
+    program.instruction_count = (int)program.nodes.size();
+    assert(program.leaf_count + program.instruction_count <= (int)BYTECODE_OPERAND_MASK);
+
+    for (int r = 0; r < program.leaf_count; r++)
+    {
+        program.register_of[program.leaves[r]] = r;
+    }
+    for (int k = 0; k < program.instruction_count; k++)
+    {
+        program.register_of[program.nodes[k]] = program.leaf_count + k;
+    }
+
+    program.code.resize(2 * program.instruction_count);
+    program.constants.clear();
+    for (int k = 0; k < program.instruction_count; k++)
+    {
+        Value& value = g_value_pool->values[program.nodes[k]];
+        const int* producers = graph.adjacency.producers.data() + graph.adjacency.producer_offsets[program.nodes[k]];
+        uint32_t a = (uint32_t)program.register_of[producers[0]];
+        uint32_t b = 0;
+        if (value.op == MathOperation::ADD || value.op == MathOperation::MULTIPLE)
+        {
+            b = (uint32_t)program.register_of[producers[1]];
+        }
+        else if (value.op == MathOperation::POW)
+        {
+            b = (uint32_t)program.constants.size();
+            program.constants.push_back(value.exponent);
+        }
+        program.code[2 * k] = ((uint32_t)value.op << BYTECODE_OP_SHIFT) | a;
+        program.code[2 * k + 1] = b;
+    }
+
+    program.root = graph.root.idx;
+    program.root_register = program.register_of[graph.root.idx];
+    program.data.assign(program.leaf_count + program.instruction_count, 0.f);
+    program.gradient.assign(program.leaf_count + program.instruction_count, 0.f);
+}
+
+void bytecode_run_forward(BytecodeProgram& program)
+{
+    const uint32_t* code = program.code.data();
+    const float* constants = program.constants.data();
+    float* data = program.data.data();
+    float* out = data + program.leaf_count;
+    int n = program.instruction_count;
+    if (n == 0) return;
+    if (program.forward_kernel)
+    {
+        program.forward_kernel(data, program.gradient.data());
+        return;
+    }
+
+#define A (code[2 * k] & BYTECODE_OPERAND_MASK)
+#define B (code[2 * k + 1])
+#if BYTECODE_COMPUTED_GOTO
+    static void* dispatch[] = { &&op_none, &&op_add, &&op_mul, &&op_pow, &&op_exp, &&op_tanh, &&op_relu };
+#define NEXT() if (++k == n) return; goto *dispatch[code[2 * k] >> BYTECODE_OP_SHIFT]
+    int k = 0;
+    goto *dispatch[code[0] >> BYTECODE_OP_SHIFT];
+op_none:
+    NEXT();
+op_add:
+    out[k] = data[A] + data[B];
+    NEXT();
+op_mul:
+    out[k] = data[A] * data[B];
+    NEXT();
+op_pow:
+    out[k] = powf(data[A], constants[B]);
+    NEXT();
+op_exp:
+    out[k] = expf(data[A]);
+    NEXT();
+op_tanh:
+    out[k] = tanhf(data[A]);
+    NEXT();
+op_relu:
+    out[k] = data[A] < 0 ? 0 : data[A];
+    NEXT();
+#undef NEXT
+#else
+    for (int k = 0; k < n; k++)
+    {
+        switch(code[2 * k] >> BYTECODE_OP_SHIFT)
+        {
+        case MathOperation::ADD: out[k] = data[A] + data[B]; break;
+        case MathOperation::MULTIPLE: out[k] = data[A] * data[B]; break;
+        case MathOperation::POW: out[k] = powf(data[A], constants[B]); break;
+        case MathOperation::EXP: out[k] = expf(data[A]); break;
+        case MathOperation::TANH: out[k] = tanhf(data[A]); break;
+        case MathOperation::RELU: out[k] = data[A] < 0 ? 0 : data[A]; break;
+        default: break;
+        }
+    }
+#endif
+#undef A
+#undef B
+}
+
+// walks the stream backwards pushing into the operands, the same order as a tape backward
+void bytecode_run_backward(BytecodeProgram& program)
+{
+    const uint32_t* code = program.code.data();
+    const float* constants = program.constants.data();
+    float* data = program.data.data();
+    float* gradient = program.gradient.data();
+    float* out = data + program.leaf_count;
+    float* out_gradient = gradient + program.leaf_count;
+    int n = program.instruction_count;
+    if (n == 0) return;
+    if (program.backward_kernel)
+    {
+        program.backward_kernel(data, gradient);
+        return;
+    }
+
+#define A (code[2 * k] & BYTECODE_OPERAND_MASK)
+#define B (code[2 * k + 1])
+#if BYTECODE_COMPUTED_GOTO
+    static void* dispatch[] = { &&op_none, &&op_add, &&op_mul, &&op_pow, &&op_exp, &&op_tanh, &&op_relu };
+#define NEXT() if (--k < 0) return; goto *dispatch[code[2 * k] >> BYTECODE_OP_SHIFT]
+    int k = n - 1;
+    goto *dispatch[code[2 * k] >> BYTECODE_OP_SHIFT];
+op_none:
+    NEXT();
+op_add:
+    gradient[A] += 1.f * out_gradient[k];
+    gradient[B] += 1.f * out_gradient[k];
+    NEXT();
+op_mul:
+    gradient[A] += data[B] * out_gradient[k];
+    gradient[B] += data[A] * out_gradient[k];
+    NEXT();
+op_pow:
+    gradient[A] += constants[B] * powf(data[A], constants[B] - 1.f) * out_gradient[k];
+    NEXT();
+op_exp:
+    gradient[A] += out[k] * out_gradient[k];
+    NEXT();
+op_tanh:
+    gradient[A] += (1.f - powf(out[k], 2)) * out_gradient[k];
+    NEXT();
+op_relu:
+    gradient[A] += (data[A] < 0 ? 0 : 1) * out_gradient[k];
+    NEXT();
+#undef NEXT
+#else
+    for (int k = n - 1; k >= 0; k--)
+    {
+        switch(code[2 * k] >> BYTECODE_OP_SHIFT)
+        {
+        case MathOperation::ADD:
+            gradient[A] += 1.f * out_gradient[k];
+            gradient[B] += 1.f * out_gradient[k];
+            break;
+        case MathOperation::MULTIPLE:
+            gradient[A] += data[B] * out_gradient[k];
+            gradient[B] += data[A] * out_gradient[k];
+            break;
+        case MathOperation::POW: gradient[A] += constants[B] * powf(data[A], constants[B] - 1.f) * out_gradient[k]; break;
+        case MathOperation::EXP: gradient[A] += out[k] * out_gradient[k]; break;
+        case MathOperation::TANH: gradient[A] += (1.f - powf(out[k], 2)) * out_gradient[k]; break;
+        case MathOperation::RELU: gradient[A] += (data[A] < 0 ? 0 : 1) * out_gradient[k]; break;
+        default: break;
+        }
+    }
+#endif
+#undef A
+#undef B
+}
+
+// register file <-> pool traffic around a run, shared with other executors of a program
+void bytecode_load_leaves(BytecodeProgram& program)
+{
+    for (int r = 0; r < program.leaf_count; r++)
+    {
+        if (program.leaves[r] < 0) continue;
+        program.data[r] = g_value_pool->values[program.leaves[r]].data;
+    }
+}
+
+void bytecode_store_root(BytecodeProgram& program)
+{
+    g_value_pool->values[program.root].data = program.data[program.root_register];
+}
+
+void bytecode_load_gradients(BytecodeProgram& program)
+{
+    for (int r = 0; r < program.leaf_count; r++)
+    {
+        program.gradient[r] = program.leaves[r] < 0 ? 0.f : g_value_pool->values[program.leaves[r]].gradient;
+    }
+    for (int r = program.leaf_count; r < program.gradient.size(); r++)
+    {
+        program.gradient[r] = 0.f;
+    }
+    program.gradient[program.root_register] = 1.f;
+}
+
+void bytecode_store_gradients(BytecodeProgram& program)
+{
+    for (int r = 0; r < program.leaf_count; r++)
+    {
+        if (program.leaves[r] < 0) continue;
+        g_value_pool->values[program.leaves[r]].gradient = program.gradient[r];
+    }
+}
+
+// drop in for graph_forward: reads the leaves from the pool, runs, writes the root back.
+// other results stay in the registers, see bytecode_data.
+void bytecode_forward(BytecodeProgram& program)
+{
+    bytecode_load_leaves(program);
+    bytecode_run_forward(program);
+    bytecode_store_root(program);
+}
+
+// drop in for graph_backward: leaf gradients keep accumulating on top of what the pool
+// holds, exactly like backward() does, and are written back to the pool afterwards
+void bytecode_backward(BytecodeProgram& program)
+{
+    bytecode_load_gradients(program);
+    bytecode_run_backward(program);
+    bytecode_store_gradients(program);
+}
+
+float bytecode_data(BytecodeProgram& program, ValueHandle h)
+{
+    assert(h.idx >= 0 && h.idx < program.register_of.size() && program.register_of[h.idx] >= 0);
+    return program.data[program.register_of[h.idx]];
+}
+
+float bytecode_gradient(BytecodeProgram& program, ValueHandle h)
+{
+    assert(h.idx >= 0 && h.idx < program.register_of.size() && program.register_of[h.idx] >= 0);
+    return program.gradient[program.register_of[h.idx]];
+}
+
+#endif
@@ -0,0 +1,307 @@
+#ifndef _CODEGEN_H_
+#define _CODEGEN_H_
+
+#include "engine.h"
+#include "bytecode.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+// %s is the source file, %s the library. contraction stays off so the kernels round
+// exactly like the interpreter and the tape.
+#if defined(_WIN32)
+#ifndef CODEGEN_COMPILE_COMMAND
+#define CODEGEN_COMPILE_COMMAND "cl /nologo /O2 /fp:precise /LD \"%s\" /Fe\"%s\" > NUL"
+#endif
+#define CODEGEN_LIBRARY_SUFFIX ".dll"
+#else
+#ifndef CODEGEN_COMPILE_COMMAND
+#define CODEGEN_COMPILE_COMMAND "c++ -O2 -ffp-contract=off -shared -fPIC \"%s\" -o \"%s\""
+#endif
+#define CODEGEN_LIBRARY_SUFFIX ".so"
+#endif
+
+// a register is either a literal known at generation time or a local in the kernel
+struct CodegenRegister
+{
+    bool constant = false;
+    float value = 0.f;
+};
+
+// hex float literal, exact for every finite float
+std::string codegen_literal(float value)
+{
+    char buffer[64];
+    snprintf(buffer, sizeof(buffer), "(%af)", (double)value);
+    return buffer;
+}
+
+std::string codegen_operand(std::vector<CodegenRegister>& registers, uint32_t r)
+{
+    if (registers[r].constant) return codegen_literal(registers[r].value);
+    return "v" + std::to_string(r);
+}
+
+// register file state after constant folding. leaves outside variables are frozen at
+// their current pool value, nodes whose operands are all frozen are folded with them.
+void codegen_fold(BytecodeProgram& program, std::vector<ValueHandle>& variables, std::vector<CodegenRegister>& registers)
+{
+    registers.assign(program.leaf_count + program.instruction_count, CodegenRegister{});
+    std::vector<bool> variable(program.leaf_count, false);
+    for (int i = 0; i < variables.size(); i++)
+    {
+        int idx = variables[i].idx;
+        if (idx < program.register_of.size() && program.register_of[idx] >= 0 && program.register_of[idx] < program.leaf_count)
+        {
+            variable[program.register_of[idx]] = true;
+        }
+    }
+
+    // bring every register up to date with the pool, folded values are read from there
+    program.forward_kernel = NULL;
+    bytecode_forward(program);
+
+    for (int r = 0; r < program.leaf_count; r++)
+    {
+        registers[r].constant = !variable[r] && isfinite(program.data[r]);
+        registers[r].value = program.data[r];
+    }
+    for (int k = 0; k < program.instruction_count; k++)
+    {
+        uint32_t op = program.code[2 * k] >> BYTECODE_OP_SHIFT;
+        uint32_t a = program.code[2 * k] & BYTECODE_OPERAND_MASK;
+        uint32_t b = program.code[2 * k + 1];
+        bool binary = op == MathOperation::ADD || op == MathOperation::MULTIPLE;
+        int r = program.leaf_count + k;
+        registers[r].constant = registers[a].constant && (!binary || registers[b].constant) && isfinite(program.data[r]);
+        registers[r].value = program.data[r];
+    }
+}
+
+std::string codegen_expression(BytecodeProgram& program, std::vector<CodegenRegister>& registers, int k)
+{
+    uint32_t op = program.code[2 * k] >> BYTECODE_OP_SHIFT;
+    std::string a = codegen_operand(registers, program.code[2 * k] & BYTECODE_OPERAND_MASK);
+    uint32_t b = program.code[2 * k + 1];
+    switch(op)
+    {
+    case MathOperation::ADD: return a + " + " + codegen_operand(registers, b);
+    case MathOperation::MULTIPLE: return a + " * " + codegen_operand(registers, b);
+    case MathOperation::POW: return "powf(" + a + ", " + codegen_literal(program.constants[b]) + ")";
+    case MathOperation::EXP: return "expf(" + a + ")";
+    case MathOperation::TANH: return "tanhf(" + a + ")";
+    case MathOperation::RELU: return a + " < 0 ? 0 : " + a;
+    default: return a;
+    }
+}
+
+// straight line forward over the live registers, shared by both kernels
+void codegen_emit_forward_body(std::string& source, BytecodeProgram& program, std::vector<CodegenRegister>& registers)
+{
+    for (int r = 0; r < program.leaf_count; r++)
+    {
+        if (registers[r].constant) continue;
+        source += "    const float v" + std::to_string(r) + " = data[" + std::to_string(r) + "];\n";
+    }
+    for (int k = 0; k < program.instruction_count; k++)
+    {
+        int r = program.leaf_count + k;
+        if (registers[r].constant) continue;
+        source += "    const float v" + std::to_string(r) + " = " + codegen_expression(program, registers, k) + ";\n";
+    }
+}
+
+// one gradient push into register r. leaves accumulate straight into the gradient file,
+// nodes get a local that is declared on its first push.
+void codegen_emit_push(std::string& source, BytecodeProgram& program, std::vector<CodegenRegister>& registers,
+    std::vector<bool>& declared, uint32_t r, const std::string& term)
+{
+    if (registers[r].constant) return;
+    if (r < program.leaf_count)
+    {
+        source += "    gradient[" + std::to_string(r) + "] += " + term + ";\n";
+    }
+    else if (!declared[r])
+    {
+        source += "    float g" + std::to_string(r) + " = " + term + ";\n";
+        declared[r] = true;
+    }
+    else
+    {
+        source += "    g" + std::to_string(r) + " += " + term + ";\n";
+    }
+}
+
+// writes a translation unit exporting <name>_forward and <name>_backward with the
+// BytecodeKernel signature. variables are the leaves that may change between calls
+// (parameters, inputs), every other leaf is folded into the code. the kernels only
+// keep the contract of bytecode_forward / bytecode_backward: forward writes the root
+// register, backward reads the leaf registers and accumulates the leaf gradients,
+// intermediate registers are never materialized.
+bool codegen_emit(BytecodeProgram& program, std::vector<ValueHandle>& variables, const char* source_path, const char* name)
+{
+    std::vector<CodegenRegister> registers;
+    codegen_fold(program, variables, registers);
+
+    std::string source;
+    source += "// generated by codegen_emit, do not edit\n";
+    source += "#include <math.h>\n\n";
+    source += "#if defined(_WIN32)\n#define CODEGEN_EXPORT extern \"C\" __declspec(dllexport)\n";
+    source += "#else\n#define CODEGEN_EXPORT extern \"C\" __attribute__((visibility(\"default\")))\n#endif\n\n";
+
+    source += "CODEGEN_EXPORT void " + std::string(name) + "_forward(float* data, float* gradient)\n{\n";
+    codegen_emit_forward_body(source, program, registers);
+    source += "    data[" + std::to_string(program.root_register) + "] = " + codegen_operand(registers, program.root_register) + ";\n";
+    source += "}\n\n";
+
+    source += "CODEGEN_EXPORT void " + std::string(name) + "_backward(float* data, float* gradient)\n{\n";
+    codegen_emit_forward_body(source, program, registers);
+    std::vector<bool> declared(registers.size(), false);
+    if (!registers[program.root_register].constant)
+    {
+        source += "    float g" + std::to_string(program.root_register) + " = 1.f;\n";
+        declared[program.root_register] = true;
+    }
+    // reverse stream order, the same push order as bytecode_run_backward
+    for (int k = program.instruction_count - 1; k >= 0; k--)
+    {
+        int r = program.leaf_count + k;
+        if (registers[r].constant || !declared[r]) continue;
+        uint32_t op = program.code[2 * k] >> BYTECODE_OP_SHIFT;
+        uint32_t a = program.code[2 * k] & BYTECODE_OPERAND_MASK;
+        uint32_t b = program.code[2 * k + 1];
+        std::string g = "g" + std::to_string(r);
+        std::string va = codegen_operand(registers, a);
+        switch(op)
+        {
+        case MathOperation::ADD:
+            codegen_emit_push(source, program, registers, declared, a, "1.f * " + g);
+            codegen_emit_push(source, program, registers, declared, b, "1.f * " + g);
+            break;
+        case MathOperation::MULTIPLE:
+            codegen_emit_push(source, program, registers, declared, a, codegen_operand(registers, b) + " * " + g);
+            codegen_emit_push(source, program, registers, declared, b, va + " * " + g);
+            break;
+        case MathOperation::POW:
+            codegen_emit_push(source, program, registers, declared, a, codegen_literal(program.constants[b]) + " * powf(" + va + ", "
+                + codegen_literal(program.constants[b] - 1.f) + ") * " + g);
+            break;
+        case MathOperation::EXP:
+            codegen_emit_push(source, program, registers, declared, a, "v" + std::to_string(r) + " * " + g);
+            break;
+        case MathOperation::TANH:
+            codegen_emit_push(source, program, registers, declared, a, "(1.f - powf(v" + std::to_string(r) + ", 2)) * " + g);
+            break;
+        case MathOperation::RELU:
+            codegen_emit_push(source, program, registers, declared, a, "(" + va + " < 0 ? 0 : 1) * " + g);
+            break;
+        default:
+            break;
+        }
+    }
+    source += "}\n";
+
+    FILE* file = fopen(source_path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "codegen: can not write %s\n", source_path);
+        return false;
+    }
+    fwrite(source.data(), 1, source.size(), file);
+    fclose(file);
+    return true;
+}
+
+bool codegen_compile(const char* source_path, const char* library_path)
+{
+    char command[1024];
+    snprintf(command, sizeof(command), CODEGEN_COMPILE_COMMAND, source_path, library_path);
+    if (system(command) != 0)
+    {
+        fprintf(stderr, "codegen: compile failed: %s\n", command);
+        return false;
+    }
+    return true;
+}
+
+// hooks the kernels of a compiled library into the program, returns the library handle
+// or NULL. a unit linked statically can be hooked up by assigning the two kernels directly.
+void* codegen_load(BytecodeProgram& program, const char* library_path, const char* name)
+{
+    std::string forward = std::string(name) + "_forward";
+    std::string backward = std::string(name) + "_backward";
+#if defined(_WIN32)
+    HMODULE library = LoadLibraryA(library_path);
+    if (!library)
+    {
+        fprintf(stderr, "codegen: can not load %s\n", library_path);
+        return NULL;
+    }
+    BytecodeKernel forward_kernel = (BytecodeKernel)GetProcAddress(library, forward.c_str());
+    BytecodeKernel backward_kernel = (BytecodeKernel)GetProcAddress(library, backward.c_str());
+#else
+    // dlopen only treats the name as a path when it has a slash in it
+    std::string path = library_path;
+    if (path.find('/') == std::string::npos) path = "./" + path;
+    void* library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!library)
+    {
+        fprintf(stderr, "codegen: can not load %s: %s\n", library_path, dlerror());
+        return NULL;
+    }
+    BytecodeKernel forward_kernel = (BytecodeKernel)dlsym(library, forward.c_str());
+    BytecodeKernel backward_kernel = (BytecodeKernel)dlsym(library, backward.c_str());
+#endif
+    if (!forward_kernel || !backward_kernel)
+    {
+        fprintf(stderr, "codegen: %s has no kernels named %s\n", library_path, name);
+#if defined(_WIN32)
+        FreeLibrary(library);
+#else
+        dlclose(library);
+#endif
+        return NULL;
+    }
+    program.forward_kernel = forward_kernel;
+    program.backward_kernel = backward_kernel;
+    return (void*)library;
+}
+
+void codegen_unload(BytecodeProgram& program, void* library)
+{
+    program.forward_kernel = NULL;
+    program.backward_kernel = NULL;
+    if (!library) return;
+#if defined(_WIN32)
+    FreeLibrary((HMODULE)library);
+#else
+    dlclose(library);
+#endif
+}
+
+// emit, compile and load in one go, files are <path>.cc and <path>.so / .dll
+void* codegen_build(BytecodeProgram& program, std::vector<ValueHandle>& variables, const char* path, const char* name)
+{
+    std::string source_path = std::string(path) + ".cc";
+    std::string library_path = std::string(path) + CODEGEN_LIBRARY_SUFFIX;
+    if (!codegen_emit(program, variables, source_path.c_str(), name)) return NULL;
+    if (!codegen_compile(source_path.c_str(), library_path.c_str())) return NULL;
+    return codegen_load(program, library_path.c_str(), name);
+}
+
+#endif
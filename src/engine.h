@@ -16,6 +16,8 @@ enum MathOperation
     EXP,
     TANH,
     RELU,
+    // the node is a tensor, Value::tensor says which one and what computes it (tensor.h)
+    TENSOR,
 };
 
 struct ValueHandle
@@ -29,67 +31,112 @@ struct Value
     float gradient = 0.f;
     float exponent = 0.f;
     MathOperation op = MathOperation::NONE;
+    int tensor = -1;
     std::vector<ValueHandle> input;
 };
 
-#define TEMP_VALUE_POOL_START { int temp_value_count = g_value_pool.value_count;
-#define TEMP_VALUE_POOL_END g_value_pool.value_count = temp_value_count; }
+// tensor nodes are computed and differentiated outside the engine, tensor_init installs these
+typedef void (*TensorNodeFunction)(Value* out);
+TensorNodeFunction g_tensor_calc_data = NULL;
+TensorNodeFunction g_tensor_calc_gradient = NULL;
 
+// evaluates the pending values [begin, end) of the tape, graph_lazy_init installs a scheduled one
+typedef void (*PendingFunction)(int begin, int end);
+PendingFunction g_evaluate_pending = NULL;
+
+#define TEMP_VALUE_POOL_START { int temp_value_count = g_value_pool->value_count;
+#define TEMP_VALUE_POOL_END g_value_pool->value_count = temp_value_count; }
+
+// the pool is a fixed array, it does not grow: one tape (and every graph captured from it)
+// holds at most MAX_VALUE_NUMBER - 1 values
+#ifndef MAX_VALUE_NUMBER
 #define MAX_VALUE_NUMBER 1024
+#endif
+// in lazy mode operators only record their node, data of values at or past evaluated_count
+// is computed in one go over the pending part of the tape the first time one of them is
+// read through get_value, or by backward. eager (lazy = false) computes on the spot.
 struct ValuePool
 {
     int value_count = 0;
+    int peak_value_count = 0;
+    int evaluated_count = 0;
+    bool lazy = false;
     Value values[MAX_VALUE_NUMBER];
 };
-ValuePool g_value_pool = {};
+ValuePool g_main_value_pool = {};
+// values are created in and looked up from the calling thread's pool,
+// worker threads point this at their own pool (see train.h)
+thread_local ValuePool* g_value_pool = &g_main_value_pool;
 
 ValueHandle create_value(float data, MathOperation op = MathOperation::NONE)
 {
-    assert(g_value_pool.value_count < MAX_VALUE_NUMBER - 1);
-    if (g_value_pool.value_count == MAX_VALUE_NUMBER - 1)
+    assert(g_value_pool->value_count < MAX_VALUE_NUMBER - 1);
+    if (g_value_pool->value_count == MAX_VALUE_NUMBER - 1)
     {
         fprintf(stderr, "value pool reach maximum capacity %d! create value failed!", MAX_VALUE_NUMBER);
         return ValueHandle{ .idx = -1 };
     }
 
-    Value& value = g_value_pool.values[g_value_pool.value_count];
+    // a rewound pool may still claim values past its end as evaluated
+    if (g_value_pool->evaluated_count > g_value_pool->value_count)
+    {
+        g_value_pool->evaluated_count = g_value_pool->value_count;
+    }
+
+    Value& value = g_value_pool->values[g_value_pool->value_count];
     value.data = data;
     value.op = op;
     value.gradient = 0.f;
     value.exponent = 0.f;
+    value.tensor = -1;
     value.input.clear();
 
-    g_value_pool.value_count++;
+    g_value_pool->value_count++;
+    if (g_value_pool->value_count > g_value_pool->peak_value_count)
+    {
+        g_value_pool->peak_value_count = g_value_pool->value_count;
+    }
+    if (!g_value_pool->lazy)
+    {
+        g_value_pool->evaluated_count = g_value_pool->value_count;
+    }
 
-    return ValueHandle{ .idx = g_value_pool.value_count - 1 };
+    return ValueHandle{ .idx = g_value_pool->value_count - 1 };
 }
 
 bool valid_value(ValueHandle h)
 {
-    assert(h.idx >= 0 && h.idx < g_value_pool.value_count);
-    if (h.idx < 0 || h.idx >= g_value_pool.value_count)
+    assert(h.idx >= 0 && h.idx < g_value_pool->value_count);
+    if (h.idx < 0 || h.idx >= g_value_pool->value_count)
     {
         return false;
     }
     return true;
 }
 
+void evaluate_pending();
+
 Value* get_value(ValueHandle h)
 {
-    assert(h.idx >= 0 && h.idx < g_value_pool.value_count);
-    if (h.idx < 0 || h.idx >= g_value_pool.value_count)
+    assert(h.idx >= 0 && h.idx < g_value_pool->value_count);
+    if (h.idx < 0 || h.idx >= g_value_pool->value_count)
     {
         return NULL;
     }
-    return &g_value_pool.values[h.idx];
+    // a leaf holds its data from the start, reading or setting it leaves the tape pending
+    if (h.idx >= g_value_pool->evaluated_count && g_value_pool->values[h.idx].input.size() > 0)
+    {
+        evaluate_pending();
+    }
+    return &g_value_pool->values[h.idx];
 }
 
 std::vector<ValueHandle> topo_sort()
 {
     std::vector<ValueHandle> topo;
-    std::vector<bool> child_sorted(g_value_pool.value_count, false);
+    std::vector<bool> child_sorted(g_value_pool->value_count, false);
     std::unordered_set<int> visited;
-    for (int i = 0; i < g_value_pool.value_count; i++)
+    for (int i = 0; i < g_value_pool->value_count; i++)
     {
         if (visited.contains(i)) continue;
 
@@ -106,7 +153,7 @@ std::vector<ValueHandle> topo_sort()
 
             visited.insert(idx);
 
-            Value& value = g_value_pool.values[idx];
+            Value& value = g_value_pool->values[idx];
             for (int j = 0; j < value.input.size(); j++)
             {
                 ValueHandle child = value.input[j];
@@ -174,13 +221,110 @@ void calc_gradient(ValueHandle hout)
             a->gradient += (a->data < 0 ? 0 : 1) * out->gradient;
         }
         break;
+    case MathOperation::TENSOR:
+        g_tensor_calc_gradient(out);
+        break;
     default:
         break;
     }
 }
 
+// recomputes data from the current inputs, same math as the operators below,
+// used to replay a captured graph after its leaves changed
+void calc_data(ValueHandle hout)
+{
+    Value* out = get_value(hout);
+    switch(out->op)
+    {
+    case MathOperation::ADD:
+        out->data = get_value(out->input[0])->data + get_value(out->input[1])->data;
+        break;
+    case MathOperation::MULTIPLE:
+        out->data = get_value(out->input[0])->data * get_value(out->input[1])->data;
+        break;
+    case MathOperation::POW:
+        out->data = powf(get_value(out->input[0])->data, out->exponent);
+        break;
+    case MathOperation::EXP:
+        out->data = expf(get_value(out->input[0])->data);
+        break;
+    case MathOperation::TANH:
+        out->data = tanhf(get_value(out->input[0])->data);
+        break;
+    case MathOperation::RELU:
+        {
+            float a = get_value(out->input[0])->data;
+            out->data = a < 0 ? 0 : a;
+        }
+        break;
+    case MathOperation::TENSOR:
+        g_tensor_calc_data(out);
+        break;
+    default:
+        break;
+    }
+}
+
+// d out / d out->input[slot], the factor calc_gradient pushes into that input
+float local_gradient(Value* out, int slot)
+{
+    switch(out->op)
+    {
+    case MathOperation::ADD:
+        return 1.f;
+    case MathOperation::MULTIPLE:
+        return get_value(out->input[1 - slot])->data;
+    case MathOperation::POW:
+        return out->exponent * powf(get_value(out->input[0])->data, out->exponent - 1.f);
+    case MathOperation::EXP:
+        return out->data;
+    case MathOperation::TANH:
+        return 1.f - powf(out->data, 2);
+    case MathOperation::RELU:
+        return get_value(out->input[0])->data < 0 ? 0.f : 1.f;
+    default:
+        break;
+    }
+    return 0.f;
+}
+
+// computes the values [begin, end) in tape order, inputs always come first
+void evaluate_segment(int begin, int end)
+{
+    for (int i = begin; i < end; i++)
+    {
+        if (g_value_pool->values[i].input.size() > 0) calc_data(ValueHandle{ .idx = i });
+    }
+}
+
+// computes every pending value, through the installed scheduler when there is one
+void evaluate_pending()
+{
+    int begin = g_value_pool->evaluated_count;
+    int end = g_value_pool->value_count;
+    g_value_pool->evaluated_count = end;
+    if (begin >= end) return;
+    if (g_evaluate_pending) g_evaluate_pending(begin, end);
+    else evaluate_segment(begin, end);
+}
+
+// switching back to eager evaluates whatever is still pending
+void set_lazy_evaluation(bool lazy)
+{
+    if (!lazy) evaluate_pending();
+    g_value_pool->lazy = lazy;
+}
+
+// operators create their node with its inputs and then call this, the data is
+// computed right away in eager mode and left to evaluate_pending in lazy mode
+void record_value(ValueHandle hout)
+{
+    if (!g_value_pool->lazy) calc_data(hout);
+}
+
 void backward(ValueHandle hroot)
 {
+    evaluate_pending();
     std::vector<ValueHandle> topo = topo_sort();
 
     Value* root = get_value(hroot);
@@ -196,12 +340,11 @@ void backward(ValueHandle hroot)
 
 ValueHandle operator+(ValueHandle ha, ValueHandle hb)
 {
-    Value* a = get_value(ha);
-    Value* b = get_value(hb);
-    ValueHandle ho = create_value(a->data + b->data, MathOperation::ADD);
-    Value* out = get_value(ho);
+    ValueHandle ho = create_value(0.f, MathOperation::ADD);
+    Value* out = &g_value_pool->values[ho.idx];
     out->input.push_back(ha);
     out->input.push_back(hb);
+    record_value(ho);
     return ho;
 }
 
@@ -218,12 +361,11 @@ ValueHandle operator+(float s, ValueHandle ha)
 
 ValueHandle operator*(ValueHandle ha, ValueHandle hb)
 {
-    Value* a = get_value(ha);
-    Value* b = get_value(hb);
-    ValueHandle ho = create_value(a->data * b->data, MathOperation::MULTIPLE);
-    Value* out = get_value(ho);
+    ValueHandle ho = create_value(0.f, MathOperation::MULTIPLE);
+    Value* out = &g_value_pool->values[ho.idx];
     out->input.push_back(ha);
     out->input.push_back(hb);
+    record_value(ho);
     return ho;
 }
 
@@ -260,11 +402,11 @@ ValueHandle operator-(float s, ValueHandle ha)
 
 ValueHandle pow(ValueHandle ha, float s)
 {
-    Value* a = get_value(ha);
-    ValueHandle ho = create_value(powf(a->data, s), MathOperation::POW);
-    Value* out = get_value(ho);
+    ValueHandle ho = create_value(0.f, MathOperation::POW);
+    Value* out = &g_value_pool->values[ho.idx];
     out->exponent = s;
     out->input.push_back(ha);
+    record_value(ho);
     return ho;
 }
 
@@ -285,29 +427,28 @@ ValueHandle operator/(float s, ValueHandle ha)
 
 ValueHandle exp(ValueHandle ha)
 {
-    Value* a = get_value(ha);
-    ValueHandle ho = create_value(expf(a->data), MathOperation::EXP);
-    Value* out = get_value(ho);
+    ValueHandle ho = create_value(0.f, MathOperation::EXP);
+    Value* out = &g_value_pool->values[ho.idx];
     out->input.push_back(ha);
+    record_value(ho);
     return ho;
 }
 
 ValueHandle tanh(ValueHandle ha)
 {
-    Value* a = get_value(ha);
-    ValueHandle ho = create_value(tanhf(a->data), MathOperation::TANH);
-    Value* out = get_value(ho);
+    ValueHandle ho = create_value(0.f, MathOperation::TANH);
+    Value* out = &g_value_pool->values[ho.idx];
     out->input.push_back(ha);
+    record_value(ho);
     return ho;
 }
 
 ValueHandle relu(ValueHandle ha)
 {
-    Value* a = get_value(ha);
-    float data = a->data < 0 ? 0 : a->data;
-    ValueHandle ho = create_value(data, MathOperation::RELU);
-    Value* out = get_value(ho);
+    ValueHandle ho = create_value(0.f, MathOperation::RELU);
+    Value* out = &g_value_pool->values[ho.idx];
     out->input.push_back(ha);
+    record_value(ho);
     return ho;
 }
 
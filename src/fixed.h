@@ -0,0 +1,225 @@
+#ifndef _FIXED_H_
+#define _FIXED_H_
+
+#include "nn.h"
+
+#include <array>
+#include <math.h>
+#include <vector>
+
+// one dense tanh layer with its shape baked in. parameters[j] is laid out like
+// Neuron::parameters, In weights followed by the bias, so it maps 1:1 onto a dynamic layer.
+// forward keeps its input and output around for backward, an instance is single threaded.
+template <int In, int Out>
+struct FixedLayer
+{
+    typedef std::array<float, In> Input;
+    typedef std::array<float, Out> Output;
+    std::array<std::array<float, In + 1>, Out> parameters = {};
+    std::array<std::array<float, In + 1>, Out> gradient = {};
+    std::array<float, In> input = {};
+    std::array<float, Out> output = {};
+    std::array<float, In> input_gradient = {};
+};
+
+template <int In, int Out>
+void fixed_layer_forward(FixedLayer<In, Out>& layer, const typename FixedLayer<In, Out>::Input& input)
+{
+    layer.input = input;
+    for (int j = 0; j < Out; j++)
+    {
+        // same summation order as run_neuron, so results match the dynamic mlp bit for bit
+        float sum = layer.parameters[j][In];
+        for (int i = 0; i < In; i++)
+        {
+            sum = sum + layer.parameters[j][i] * input[i];
+        }
+        layer.output[j] = tanhf(sum);
+    }
+}
+
+// accumulates the parameter gradients and leaves d loss / d input in input_gradient
+template <int In, int Out>
+void fixed_layer_backward(FixedLayer<In, Out>& layer, const typename FixedLayer<In, Out>::Output& output_gradient)
+{
+    layer.input_gradient = {};
+    // the tape reaches the last neuron first, walking backwards keeps input gradients identical
+    for (int j = Out - 1; j >= 0; j--)
+    {
+        float sum_gradient = (1.f - powf(layer.output[j], 2)) * output_gradient[j];
+        for (int i = In - 1; i >= 0; i--)
+        {
+            layer.gradient[j][i] += layer.input[i] * sum_gradient;
+            layer.input_gradient[i] += layer.parameters[j][i] * sum_gradient;
+        }
+        layer.gradient[j][In] += sum_gradient;
+    }
+}
+
+// mlp with every size known at compile time, FixedMLP<3, 4, 4, 1> is the fixed twin of
+// mlp_init(mlp, 3, {4, 4, 1}). no pools, no handles, no heap.
+template <int In, int... Sizes>
+struct FixedMLP;
+
+template <int In, int Out>
+struct FixedMLP<In, Out>
+{
+    typedef std::array<float, In> Input;
+    typedef std::array<float, Out> Output;
+    static constexpr int input_count = In;
+    static constexpr int output_count = Out;
+    static constexpr int layer_count = 1;
+    static constexpr int parameter_count = (In + 1) * Out;
+    FixedLayer<In, Out> layer;
+};
+
+template <int In, int Out, int Next, int... Rest>
+struct FixedMLP<In, Out, Next, Rest...>
+{
+    typedef std::array<float, In> Input;
+    typedef typename FixedMLP<Out, Next, Rest...>::Output Output;
+    static constexpr int input_count = In;
+    static constexpr int output_count = FixedMLP<Out, Next, Rest...>::output_count;
+    static constexpr int layer_count = 1 + FixedMLP<Out, Next, Rest...>::layer_count;
+    static constexpr int parameter_count = (In + 1) * Out + FixedMLP<Out, Next, Rest...>::parameter_count;
+    FixedLayer<In, Out> layer;
+    FixedMLP<Out, Next, Rest...> next;
+};
+
+template <int In, int Out>
+const typename FixedMLP<In, Out>::Output& fixed_mlp_forward(FixedMLP<In, Out>& mlp, const typename FixedMLP<In, Out>::Input& input)
+{
+    fixed_layer_forward(mlp.layer, input);
+    return mlp.layer.output;
+}
+
+template <int In, int Out, int Next, int... Rest>
+const typename FixedMLP<In, Out, Next, Rest...>::Output& fixed_mlp_forward(FixedMLP<In, Out, Next, Rest...>& mlp,
+    const typename FixedMLP<In, Out, Next, Rest...>::Input& input)
+{
+    fixed_layer_forward(mlp.layer, input);
+    return fixed_mlp_forward(mlp.next, mlp.layer.output);
+}
+
+// output_gradient is d loss / d output of the last forward, gradients accumulate
+// until fixed_mlp_zero_grad just like on the tape
+template <int In, int Out>
+void fixed_mlp_backward(FixedMLP<In, Out>& mlp, const typename FixedMLP<In, Out>::Output& output_gradient)
+{
+    fixed_layer_backward(mlp.layer, output_gradient);
+}
+
+template <int In, int Out, int Next, int... Rest>
+void fixed_mlp_backward(FixedMLP<In, Out, Next, Rest...>& mlp, const typename FixedMLP<In, Out, Next, Rest...>::Output& output_gradient)
+{
+    fixed_mlp_backward(mlp.next, output_gradient);
+    fixed_layer_backward(mlp.layer, mlp.next.layer.input_gradient);
+}
+
+// visits every layer front to back
+template <int In, int Out, typename F>
+void fixed_mlp_for_each_layer(FixedMLP<In, Out>& mlp, F f)
+{
+    f(mlp.layer);
+}
+
+template <int In, int Out, int Next, int... Rest, typename F>
+void fixed_mlp_for_each_layer(FixedMLP<In, Out, Next, Rest...>& mlp, F f)
+{
+    f(mlp.layer);
+    fixed_mlp_for_each_layer(mlp.next, f);
+}
+
+template <int... Sizes>
+void fixed_mlp_zero_grad(FixedMLP<Sizes...>& mlp)
+{
+    fixed_mlp_for_each_layer(mlp, [](auto& layer) { layer.gradient = {}; });
+}
+
+template <int... Sizes>
+void fixed_mlp_sgd_step(FixedMLP<Sizes...>& mlp, float learning_rate)
+{
+    fixed_mlp_for_each_layer(mlp, [learning_rate](auto& layer) {
+        for (int j = 0; j < layer.parameters.size(); j++)
+        {
+            for (int i = 0; i < layer.parameters[j].size(); i++)
+            {
+                layer.parameters[j][i] -= learning_rate * layer.gradient[j][i];
+            }
+        }
+    });
+}
+
+// the same shape vector mlp_shape returns for the dynamic twin
+template <int... Sizes>
+std::vector<int> fixed_mlp_shape(FixedMLP<Sizes...>& mlp)
+{
+    return { Sizes... };
+}
+
+// parameters in mlp_parameter_data order, neuron by neuron
+template <int... Sizes>
+std::vector<float> fixed_mlp_parameters(FixedMLP<Sizes...>& mlp)
+{
+    std::vector<float> parameters;
+    parameters.reserve(FixedMLP<Sizes...>::parameter_count);
+    fixed_mlp_for_each_layer(mlp, [&parameters](auto& layer) {
+        for (int j = 0; j < layer.parameters.size(); j++)
+        {
+            parameters.insert(parameters.end(), layer.parameters[j].begin(), layer.parameters[j].end());
+        }
+    });
+    return parameters;
+}
+
+template <int... Sizes>
+void fixed_mlp_set_parameters(FixedMLP<Sizes...>& mlp, std::vector<float>& parameters)
+{
+    assert(parameters.size() == FixedMLP<Sizes...>::parameter_count);
+    int k = 0;
+    fixed_mlp_for_each_layer(mlp, [&parameters, &k](auto& layer) {
+        for (int j = 0; j < layer.parameters.size(); j++)
+        {
+            for (int i = 0; i < layer.parameters[j].size(); i++)
+            {
+                layer.parameters[j][i] = parameters[k++];
+            }
+        }
+    });
+}
+
+// copies the weights of a dynamic mlp of the same shape, neuron or tensor layers
+template <int... Sizes>
+bool fixed_mlp_from_mlp(FixedMLP<Sizes...>& fixed, MLP& mlp)
+{
+    if (mlp_shape(mlp) != fixed_mlp_shape(fixed)) return false;
+    std::vector<float> parameters = mlp_parameter_data(mlp);
+    fixed_mlp_set_parameters(fixed, parameters);
+    return true;
+}
+
+// same file format as mlp_save / mlp_load, files move freely between the two
+template <int... Sizes>
+bool fixed_mlp_save(FixedMLP<Sizes...>& mlp, const char* path)
+{
+    std::vector<int> shape = fixed_mlp_shape(mlp);
+    std::vector<float> parameters = fixed_mlp_parameters(mlp);
+    return mlp_write_parameters(path, shape, parameters);
+}
+
+template <int... Sizes>
+bool fixed_mlp_load(FixedMLP<Sizes...>& mlp, const char* path)
+{
+    std::vector<int> shape = fixed_mlp_shape(mlp);
+    std::vector<float> parameters;
+    if (!mlp_read_parameters(path, shape, parameters)) return false;
+    if (parameters.size() != FixedMLP<Sizes...>::parameter_count)
+    {
+        fprintf(stderr, "%s holds %d parameters, expected %d!", path, (int)parameters.size(), FixedMLP<Sizes...>::parameter_count);
+        return false;
+    }
+    fixed_mlp_set_parameters(mlp, parameters);
+    return true;
+}
+
+#endif
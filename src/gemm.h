@@ -0,0 +1,404 @@
+#ifndef _GEMM_H_
+#define _GEMM_H_
+
+#include "parallel.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define GEMM_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#else
+#define GEMM_X86 0
+#endif
+
+// gcc and clang only emit vector extensions inside functions that ask for them, msvc always can
+#if GEMM_X86 && !defined(_MSC_VER)
+#define GEMM_TARGET(isa) __attribute__((target(isa)))
+#else
+#define GEMM_TARGET(isa)
+#endif
+
+// goto style blocking: a KC deep slice of B, up to NC columns wide, is packed once and
+// stays in L3, the rows of A are packed into MC row blocks that stay in L2 while one
+// NR wide micro panel of B sits in L1. MC is rounded down to the kernel's MR.
+#define GEMM_KC 256
+#define GEMM_MC 144
+#define GEMM_NC 3072
+// columns of C per parallel task, and the flop count below which a pool is not worth it
+#define GEMM_TASK_COLUMNS 256
+#define GEMM_PARALLEL_FLOPS (1 << 22)
+#define GEMM_MAX_TILE (12 * 32)
+
+enum GemmIsa
+{
+    GEMM_SCALAR = 0,
+    GEMM_SSE2,
+    GEMM_AVX2,
+    GEMM_AVX512,
+};
+
+// computes one MR x NR tile of C from k packed columns of A (MR values each) and k packed
+// rows of B (NR values each), written row major into tile
+typedef void (*GemmMicrokernel)(int k, const float* a, const float* b, float* tile);
+
+struct GemmKernel
+{
+    GemmIsa isa;
+    const char* name;
+    int mr;
+    int nr;
+    GemmMicrokernel run;
+};
+
+void gemm_kernel_scalar(int k, const float* a, const float* b, float* tile)
+{
+    float c[4][4] = {};
+    for (int p = 0; p < k; p++)
+    {
+        for (int i = 0; i < 4; i++)
+        {
+            for (int j = 0; j < 4; j++)
+            {
+                c[i][j] += a[i] * b[j];
+            }
+        }
+        a += 4;
+        b += 4;
+    }
+    memcpy(tile, c, sizeof(c));
+}
+
+#if GEMM_X86
+// 4 x 8, two xmm accumulators per row
+GEMM_TARGET("sse2")
+void gemm_kernel_sse2(int k, const float* a, const float* b, float* tile)
+{
+    __m128 c00 = _mm_setzero_ps(), c01 = _mm_setzero_ps(), c10 = _mm_setzero_ps(), c11 = _mm_setzero_ps();
+    __m128 c20 = _mm_setzero_ps(), c21 = _mm_setzero_ps(), c30 = _mm_setzero_ps(), c31 = _mm_setzero_ps();
+    for (int p = 0; p < k; p++)
+    {
+        __m128 b0 = _mm_load_ps(b);
+        __m128 b1 = _mm_load_ps(b + 4);
+#define GEMM_ROW(i) { __m128 ai = _mm_set1_ps(a[i]); c##i##0 = _mm_add_ps(c##i##0, _mm_mul_ps(ai, b0)); c##i##1 = _mm_add_ps(c##i##1, _mm_mul_ps(ai, b1)); }
+        GEMM_ROW(0) GEMM_ROW(1) GEMM_ROW(2) GEMM_ROW(3)
+#undef GEMM_ROW
+        a += 4;
+        b += 8;
+    }
+#define GEMM_STORE(i) _mm_storeu_ps(tile + i * 8, c##i##0); _mm_storeu_ps(tile + i * 8 + 4, c##i##1);
+    GEMM_STORE(0) GEMM_STORE(1) GEMM_STORE(2) GEMM_STORE(3)
+#undef GEMM_STORE
+}
+
+// 6 x 16, twelve ymm accumulators, one fma per accumulator and k step
+GEMM_TARGET("avx2,fma")
+void gemm_kernel_avx2(int k, const float* a, const float* b, float* tile)
+{
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps(), c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps(), c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps(), c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    for (int p = 0; p < k; p++)
+    {
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+#define GEMM_ROW(i) { __m256 ai = _mm256_broadcast_ss(a + i); c##i##0 = _mm256_fmadd_ps(ai, b0, c##i##0); c##i##1 = _mm256_fmadd_ps(ai, b1, c##i##1); }
+        GEMM_ROW(0) GEMM_ROW(1) GEMM_ROW(2) GEMM_ROW(3) GEMM_ROW(4) GEMM_ROW(5)
+#undef GEMM_ROW
+        a += 6;
+        b += 16;
+    }
+#define GEMM_STORE(i) _mm256_storeu_ps(tile + i * 16, c##i##0); _mm256_storeu_ps(tile + i * 16 + 8, c##i##1);
+    GEMM_STORE(0) GEMM_STORE(1) GEMM_STORE(2) GEMM_STORE(3) GEMM_STORE(4) GEMM_STORE(5)
+#undef GEMM_STORE
+}
+
+// 12 x 32, twenty four zmm accumulators
+GEMM_TARGET("avx512f")
+void gemm_kernel_avx512(int k, const float* a, const float* b, float* tile)
+{
+    __m512 c00 = _mm512_setzero_ps(), c01 = _mm512_setzero_ps(), c10 = _mm512_setzero_ps(), c11 = _mm512_setzero_ps();
+    __m512 c20 = _mm512_setzero_ps(), c21 = _mm512_setzero_ps(), c30 = _mm512_setzero_ps(), c31 = _mm512_setzero_ps();
+    __m512 c40 = _mm512_setzero_ps(), c41 = _mm512_setzero_ps(), c50 = _mm512_setzero_ps(), c51 = _mm512_setzero_ps();
+    __m512 c60 = _mm512_setzero_ps(), c61 = _mm512_setzero_ps(), c70 = _mm512_setzero_ps(), c71 = _mm512_setzero_ps();
+    __m512 c80 = _mm512_setzero_ps(), c81 = _mm512_setzero_ps(), c90 = _mm512_setzero_ps(), c91 = _mm512_setzero_ps();
+    __m512 c100 = _mm512_setzero_ps(), c101 = _mm512_setzero_ps(), c110 = _mm512_setzero_ps(), c111 = _mm512_setzero_ps();
+    for (int p = 0; p < k; p++)
+    {
+        __m512 b0 = _mm512_load_ps(b);
+        __m512 b1 = _mm512_load_ps(b + 16);
+#define GEMM_ROW(i) { __m512 ai = _mm512_set1_ps(a[i]); c##i##0 = _mm512_fmadd_ps(ai, b0, c##i##0); c##i##1 = _mm512_fmadd_ps(ai, b1, c##i##1); }
+        GEMM_ROW(0) GEMM_ROW(1) GEMM_ROW(2) GEMM_ROW(3) GEMM_ROW(4) GEMM_ROW(5)
+        GEMM_ROW(6) GEMM_ROW(7) GEMM_ROW(8) GEMM_ROW(9) GEMM_ROW(10) GEMM_ROW(11)
+#undef GEMM_ROW
+        a += 12;
+        b += 32;
+    }
+#define GEMM_STORE(i) _mm512_storeu_ps(tile + i * 32, c##i##0); _mm512_storeu_ps(tile + i * 32 + 16, c##i##1);
+    GEMM_STORE(0) GEMM_STORE(1) GEMM_STORE(2) GEMM_STORE(3) GEMM_STORE(4) GEMM_STORE(5)
+    GEMM_STORE(6) GEMM_STORE(7) GEMM_STORE(8) GEMM_STORE(9) GEMM_STORE(10) GEMM_STORE(11)
+#undef GEMM_STORE
+}
+#endif
+
+// indexed by GemmIsa
+GemmKernel g_gemm_kernels[] = {
+    { GemmIsa::GEMM_SCALAR, "scalar", 4, 4, gemm_kernel_scalar },
+#if GEMM_X86
+    { GemmIsa::GEMM_SSE2, "sse2", 4, 8, gemm_kernel_sse2 },
+    { GemmIsa::GEMM_AVX2, "avx2+fma", 6, 16, gemm_kernel_avx2 },
+    { GemmIsa::GEMM_AVX512, "avx512", 12, 32, gemm_kernel_avx512 },
+#endif
+};
+GemmKernel* g_gemm_kernel = NULL;
+
+#if GEMM_X86
+void gemm_cpuid(int leaf, int subleaf, uint32_t* info)
+{
+#if defined(_MSC_VER)
+    int regs[4];
+    __cpuidex(regs, leaf, subleaf);
+    for (int i = 0; i < 4; i++) info[i] = (uint32_t)regs[i];
+#else
+    __cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+// which register states the os saves on a context switch
+uint64_t gemm_xgetbv()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    uint32_t eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return ((uint64_t)edx << 32) | eax;
+#endif
+}
+#endif
+
+// the widest kernel this cpu and os can run
+GemmIsa gemm_detect_isa()
+{
+#if GEMM_X86
+    uint32_t info[4];
+    gemm_cpuid(0, 0, info);
+    uint32_t max_leaf = info[0];
+    gemm_cpuid(1, 0, info);
+    bool sse2 = (info[3] >> 26) & 1;
+    bool osxsave = (info[2] >> 27) & 1;
+    bool avx = (info[2] >> 28) & 1;
+    bool fma = (info[2] >> 12) & 1;
+    bool avx2 = false;
+    bool avx512 = false;
+    if (max_leaf >= 7)
+    {
+        gemm_cpuid(7, 0, info);
+        avx2 = (info[1] >> 5) & 1;
+        avx512 = (info[1] >> 16) & 1;
+    }
+    uint64_t xcr0 = osxsave ? gemm_xgetbv() : 0;
+    bool ymm_state = (xcr0 & 0x6) == 0x6;
+    bool zmm_state = (xcr0 & 0xe6) == 0xe6;
+    if (avx512 && zmm_state) return GemmIsa::GEMM_AVX512;
+    if (avx && avx2 && fma && ymm_state) return GemmIsa::GEMM_AVX2;
+    if (sse2) return GemmIsa::GEMM_SSE2;
+#endif
+    return GemmIsa::GEMM_SCALAR;
+}
+
+// switches to the kernel for isa, or the widest supported one below it, and returns
+// the isa now in use
+GemmIsa gemm_select_isa(GemmIsa isa)
+{
+    GemmIsa supported = gemm_detect_isa();
+    if (isa > supported) isa = supported;
+    g_gemm_kernel = &g_gemm_kernels[isa];
+    return isa;
+}
+
+GemmKernel& gemm_kernel()
+{
+    if (!g_gemm_kernel) gemm_select_isa(gemm_detect_isa());
+    return *g_gemm_kernel;
+}
+
+// rows [0, m) of A over k columns as micro panels of mr rows: column by column, mr values
+// each, rows past m are zero
+void gemm_pack_a(int m, int k, const float* a, int rs, int cs, int mr, float* packed)
+{
+    for (int i0 = 0; i0 < m; i0 += mr)
+    {
+        int rows = m - i0 < mr ? m - i0 : mr;
+        for (int p = 0; p < k; p++)
+        {
+            const float* column = a + i0 * rs + p * cs;
+            for (int i = 0; i < rows; i++)
+            {
+                packed[i] = column[i * rs];
+            }
+            for (int i = rows; i < mr; i++)
+            {
+                packed[i] = 0.f;
+            }
+            packed += mr;
+        }
+    }
+}
+
+// columns [0, n) of B over k rows as micro panels of nr columns, the mirror of gemm_pack_a
+void gemm_pack_b(int n, int k, const float* b, int rs, int cs, int nr, float* packed)
+{
+    for (int j0 = 0; j0 < n; j0 += nr)
+    {
+        int columns = n - j0 < nr ? n - j0 : nr;
+        for (int p = 0; p < k; p++)
+        {
+            const float* row = b + p * rs + j0 * cs;
+            for (int j = 0; j < columns; j++)
+            {
+                packed[j] = row[j * cs];
+            }
+            for (int j = columns; j < nr; j++)
+            {
+                packed[j] = 0.f;
+            }
+            packed += nr;
+        }
+    }
+}
+
+// grow only, 64 byte aligned packing buffers of the calling thread
+struct GemmScratch
+{
+    std::vector<float> a;
+    std::vector<float> b;
+};
+thread_local GemmScratch g_gemm_scratch;
+
+float* gemm_scratch(std::vector<float>& buffer, size_t count)
+{
+    if (buffer.size() < count + 16) buffer.resize(count + 16);
+    uintptr_t p = (uintptr_t)buffer.data();
+    return (float*)((p + 63) & ~(uintptr_t)63);
+}
+
+// runs fn(begin, end) over [0, count) in chunk sized pieces, on the pool when there is one
+template <typename F>
+void gemm_parallel_for(ThreadPool* pool, int count, int chunk, F fn)
+{
+    int task_count = (count + chunk - 1) / chunk;
+    if (!pool || task_count < 2)
+    {
+        fn(0, count);
+        return;
+    }
+    thread_pool_run(*pool, task_count, [&](int task, int worker) {
+        int begin = task * chunk;
+        fn(begin, begin + chunk < count ? begin + chunk : count);
+    });
+}
+
+// C = A * B, or C += A * B with accumulate. every operand is addressed through element
+// strides, A(i, p) = a[i * a_rs + p * a_cs], B(p, j) = b[p * b_rs + j * b_cs],
+// C(i, j) = c[i * c_rs + j * c_cs], so transposed and other strided views go in as they
+// are: dW = X^T * dY is gemm(in, out, batch, x, 1, in, dy, out, 1, dw, out, 1, true).
+// the pool, when given, splits packing and the row block x column chunk grid of C.
+void gemm(int m, int n, int k, const float* a, int a_rs, int a_cs, const float* b, int b_rs, int b_cs,
+    float* c, int c_rs, int c_cs, bool accumulate, ThreadPool* pool = NULL)
+{
+    if (m <= 0 || n <= 0) return;
+    if (k <= 0)
+    {
+        for (int i = 0; i < m && !accumulate; i++)
+        {
+            for (int j = 0; j < n; j++)
+            {
+                c[i * c_rs + j * c_cs] = 0.f;
+            }
+        }
+        return;
+    }
+
+    GemmKernel& kernel = gemm_kernel();
+    int mr = kernel.mr;
+    int nr = kernel.nr;
+    int mc = GEMM_MC / mr * mr;
+    int nc = GEMM_NC / nr * nr;
+    int task_columns = GEMM_TASK_COLUMNS / nr * nr;
+    // a C with stride 0 (a broadcast gradient) adds several tiles into one element
+    if (c_rs == 0 || c_cs == 0 || 2.0 * m * n * k < GEMM_PARALLEL_FLOPS) pool = NULL;
+
+    int a_panels = (m + mr - 1) / mr;
+    float* packed_a = gemm_scratch(g_gemm_scratch.a, (size_t)a_panels * mr * GEMM_KC);
+    float* packed_b = gemm_scratch(g_gemm_scratch.b, (size_t)GEMM_KC * ((nc < n ? nc : n) + nr));
+    int row_blocks = (m + mc - 1) / mc;
+
+    for (int jc = 0; jc < n; jc += nc)
+    {
+        int n_block = n - jc < nc ? n - jc : nc;
+        int b_panels = (n_block + nr - 1) / nr;
+        int column_chunks = (n_block + task_columns - 1) / task_columns;
+        for (int pc = 0; pc < k; pc += GEMM_KC)
+        {
+            int k_block = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+            bool add = accumulate || pc > 0;
+
+            gemm_parallel_for(pool, b_panels, 8, [&](int begin, int end) {
+                int columns = (end * nr < n_block ? end * nr : n_block) - begin * nr;
+                gemm_pack_b(columns, k_block, b + pc * b_rs + (jc + begin * nr) * b_cs, b_rs, b_cs, nr, packed_b + (size_t)begin * nr * k_block);
+            });
+            gemm_parallel_for(pool, a_panels, 8, [&](int begin, int end) {
+                int rows = (end * mr < m ? end * mr : m) - begin * mr;
+                gemm_pack_a(rows, k_block, a + begin * mr * a_rs + pc * a_cs, a_rs, a_cs, mr, packed_a + (size_t)begin * mr * k_block);
+            });
+
+            // one task is a row block of MC rows against a chunk of columns, the B micro
+            // panel stays in L1 while the row block streams through L2
+            gemm_parallel_for(pool, row_blocks * column_chunks, 1, [&](int begin, int end) {
+                alignas(64) float tile[GEMM_MAX_TILE];
+                for (int t = begin; t < end; t++)
+                {
+                    int ic = t / column_chunks * mc;
+                    int j_begin = t % column_chunks * task_columns;
+                    int j_end = j_begin + task_columns < n_block ? j_begin + task_columns : n_block;
+                    int i_end = ic + mc < m ? ic + mc : m;
+                    for (int jr = j_begin; jr < j_end; jr += nr)
+                    {
+                        const float* pb = packed_b + (size_t)(jr / nr) * nr * k_block;
+                        int columns = n_block - jr < nr ? n_block - jr : nr;
+                        for (int ir = ic; ir < i_end; ir += mr)
+                        {
+                            kernel.run(k_block, packed_a + (size_t)(ir / mr) * mr * k_block, pb, tile);
+                            int rows = m - ir < mr ? m - ir : mr;
+                            float* out = c + ir * c_rs + (jc + jr) * c_cs;
+                            for (int i = 0; i < rows; i++)
+                            {
+                                const float* t_row = tile + i * nr;
+                                float* c_row = out + i * c_rs;
+                                if (add)
+                                {
+                                    for (int j = 0; j < columns; j++) c_row[j * c_cs] += t_row[j];
+                                }
+                                else
+                                {
+                                    for (int j = 0; j < columns; j++) c_row[j * c_cs] = t_row[j];
+                                }
+                            }
+                        }
+                    }
+                }
+            });
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,1081 @@
+#ifndef _GRAPH_H_
+#define _GRAPH_H_
+
+#include "engine.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdio.h>
+#include <vector>
+
+#define GRAPH_BACKWARD_CHUNK 256
+// nodes per dependency counted task, and the graph size below which replay stays inline
+#define GRAPH_TASK_CHUNK 512
+#define GRAPH_INLINE_THRESHOLD 4096
+#define GRAPH_OP_COUNT (MathOperation::RELU + 1)
+
+struct GraphEdge
+{
+    int node; // consumer pool index
+    int slot; // which input of the consumer
+};
+
+// coarse tasks over a captured graph. order lists node pool indices task by task,
+// a task becomes ready once every task it depends on has finished.
+struct GraphTask
+{
+    int begin;
+    int end;
+    int dependency_count = 0;
+    std::vector<int> successors;
+};
+
+struct GraphSchedule
+{
+    std::vector<int> order;
+    std::vector<GraphTask> tasks;
+};
+
+// compressed sparse row adjacency of a captured graph, indexed by pool index. the inputs of
+// node i are producers[producer_offsets[i] .. producer_offsets[i + 1]) in slot order, its
+// consumers sit in consumers[consumer_offsets[i] ..] from the highest pool index down.
+// unreachable nodes have empty rows. built once at capture, every pass over the graph
+// walks these flat arrays instead of the per value input vectors.
+struct GraphAdjacency
+{
+    std::vector<int> producer_offsets;
+    std::vector<int> producers;
+    std::vector<int> consumer_offsets;
+    std::vector<GraphEdge> consumers;
+};
+
+// the part of the value pool reachable from a root, captured once so it can be
+// replayed. values are created after their inputs, so pool order is topological
+// and every per node array here is indexed by pool index in [0, root.idx].
+struct Graph
+{
+    ValueHandle root;
+    std::vector<bool> reachable;
+    GraphAdjacency adjacency;
+    // backward levels: level 0 is the root, a node sits one level below its deepest consumer,
+    // so every node of a level only depends on gradients of earlier levels
+    std::vector<int> level;
+    std::vector<int> level_offsets;
+    std::vector<int> level_nodes;
+    GraphSchedule forward_schedule;
+    GraphSchedule backward_schedule;
+    // every backward level split by op: bucket (level, op) holds the nodes in
+    // bucket_nodes[bucket_offsets[level * GRAPH_OP_COUNT + op] ...] with their
+    // operands alongside in bucket_inputs (two per node, -1 when unary)
+    std::vector<int> bucket_offsets;
+    std::vector<int> bucket_nodes;
+    std::vector<int> bucket_inputs;
+};
+
+// runs fn(begin, end, worker) over [0, count) in chunks on the pool, or inline in one go without a pool
+void graph_parallel_for(ThreadPool* pool, int count, int chunk, std::function<void(int begin, int end, int worker)> fn)
+{
+    if (count <= 0) return;
+    if (pool == NULL)
+    {
+        fn(0, count, 0);
+        return;
+    }
+    int chunk_count = (count + chunk - 1) / chunk;
+    thread_pool_run(*pool, chunk_count, [&](int c, int worker) {
+        int begin = c * chunk;
+        int end = begin + chunk < count ? begin + chunk : count;
+        fn(begin, end, worker);
+    });
+}
+
+// inclusive prefix sum of values in place, in two passes over chunks: every chunk sums
+// itself, the chunk totals are scanned serially, then every chunk scans from its offset
+void graph_prefix_sum(ThreadPool* pool, std::vector<int>& values, int chunk)
+{
+    int count = (int)values.size();
+    std::vector<int> totals((count + chunk - 1) / chunk + 1, 0);
+    graph_parallel_for(pool, count, chunk, [&](int begin, int end, int worker) {
+        int sum = 0;
+        for (int i = begin; i < end; i++)
+        {
+            sum += values[i];
+        }
+        totals[begin / chunk + 1] = sum;
+    });
+    for (int c = 0; c + 1 < totals.size(); c++)
+    {
+        totals[c + 1] += totals[c];
+    }
+    graph_parallel_for(pool, count, chunk, [&](int begin, int end, int worker) {
+        int sum = totals[begin / chunk];
+        for (int i = begin; i < end; i++)
+        {
+            sum += values[i];
+            values[i] = sum;
+        }
+    });
+}
+
+// concatenates per chunk lists in chunk order into out, each list copied on the pool
+void graph_gather_chunks(ThreadPool* pool, std::vector<std::vector<int>>& lists, std::vector<int>& out)
+{
+    std::vector<int> offsets(lists.size() + 1, 0);
+    for (int c = 0; c < lists.size(); c++)
+    {
+        offsets[c + 1] = offsets[c] + (int)lists[c].size();
+    }
+    out.resize(offsets[lists.size()]);
+    graph_parallel_for(pool, (int)lists.size(), 1, [&](int begin, int end, int worker) {
+        for (int c = begin; c < end; c++)
+        {
+            std::copy(lists[c].begin(), lists[c].end(), out.begin() + offsets[c]);
+        }
+    });
+}
+
+int graph_producer_count(GraphAdjacency& adjacency, int idx)
+{
+    return adjacency.producer_offsets[idx + 1] - adjacency.producer_offsets[idx];
+}
+
+// nodes are the reachable pool indices in ascending order. rows are counted, offset by a
+// prefix sum and filled, over the pool when one is given. consumer rows are sorted after
+// the fill, so the layout does not depend on how the work was split.
+void graph_build_adjacency(Graph& graph, std::vector<int>& nodes, ThreadPool* pool)
+{
+    ValuePool* value_pool = g_value_pool;
+    GraphAdjacency& adjacency = graph.adjacency;
+    int count = (int)graph.reachable.size();
+    const int chunk = 4096;
+
+    adjacency.producer_offsets.assign(count + 1, 0);
+    adjacency.consumer_offsets.assign(count + 1, 0);
+    graph_parallel_for(pool, (int)nodes.size(), chunk, [&](int begin, int end, int worker) {
+        for (int k = begin; k < end; k++)
+        {
+            Value& value = value_pool->values[nodes[k]];
+            adjacency.producer_offsets[nodes[k] + 1] = (int)value.input.size();
+            for (int j = 0; j < value.input.size(); j++)
+            {
+                std::atomic_ref<int>(adjacency.consumer_offsets[value.input[j].idx + 1]).fetch_add(1);
+            }
+        }
+    });
+    graph_prefix_sum(pool, adjacency.producer_offsets, chunk);
+    graph_prefix_sum(pool, adjacency.consumer_offsets, chunk);
+
+    adjacency.producers.resize(adjacency.producer_offsets[count]);
+    adjacency.consumers.resize(adjacency.consumer_offsets[count]);
+    std::vector<int> cursor(adjacency.consumer_offsets.begin(), adjacency.consumer_offsets.end() - 1);
+    graph_parallel_for(pool, (int)nodes.size(), chunk, [&](int begin, int end, int worker) {
+        for (int k = begin; k < end; k++)
+        {
+            Value& value = value_pool->values[nodes[k]];
+            int* producers = adjacency.producers.data() + adjacency.producer_offsets[nodes[k]];
+            for (int j = 0; j < value.input.size(); j++)
+            {
+                int idx = value.input[j].idx;
+                producers[j] = idx;
+                int position = std::atomic_ref<int>(cursor[idx]).fetch_add(1);
+                adjacency.consumers[position] = GraphEdge{ .node = nodes[k], .slot = j };
+            }
+        }
+    });
+    graph_parallel_for(pool, (int)nodes.size(), chunk, [&](int begin, int end, int worker) {
+        for (int k = begin; k < end; k++)
+        {
+            GraphEdge* first = adjacency.consumers.data() + adjacency.consumer_offsets[nodes[k]];
+            GraphEdge* last = adjacency.consumers.data() + adjacency.consumer_offsets[nodes[k] + 1];
+            if (last - first < 2) continue;
+            std::sort(first, last, [](const GraphEdge& a, const GraphEdge& b) {
+                return a.node != b.node ? a.node > b.node : a.slot < b.slot;
+            });
+        }
+    });
+}
+
+// calc_data with the operands read through the adjacency, bit for bit the same result
+void graph_calc_data(GraphAdjacency& adjacency, Value* values, int idx)
+{
+    Value& out = values[idx];
+    const int* input = adjacency.producers.data() + adjacency.producer_offsets[idx];
+    switch(out.op)
+    {
+    case MathOperation::ADD:
+        out.data = values[input[0]].data + values[input[1]].data;
+        break;
+    case MathOperation::MULTIPLE:
+        out.data = values[input[0]].data * values[input[1]].data;
+        break;
+    case MathOperation::POW:
+        out.data = powf(values[input[0]].data, out.exponent);
+        break;
+    case MathOperation::EXP:
+        out.data = expf(values[input[0]].data);
+        break;
+    case MathOperation::TANH:
+        out.data = tanhf(values[input[0]].data);
+        break;
+    case MathOperation::RELU:
+        {
+            float a = values[input[0]].data;
+            out.data = a < 0 ? 0 : a;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// local_gradient with the operands read through the adjacency
+float graph_local_gradient(GraphAdjacency& adjacency, Value* values, int idx, int slot)
+{
+    Value& out = values[idx];
+    const int* input = adjacency.producers.data() + adjacency.producer_offsets[idx];
+    switch(out.op)
+    {
+    case MathOperation::ADD:
+        return 1.f;
+    case MathOperation::MULTIPLE:
+        return values[input[1 - slot]].data;
+    case MathOperation::POW:
+        return out.exponent * powf(values[input[0]].data, out.exponent - 1.f);
+    case MathOperation::EXP:
+        return out.data;
+    case MathOperation::TANH:
+        return 1.f - powf(out.data, 2);
+    case MathOperation::RELU:
+        return values[input[0]].data < 0 ? 0.f : 1.f;
+    default:
+        break;
+    }
+    return 0.f;
+}
+
+// schedule.order holds the nodes level by level as given by level_offsets. cuts every level
+// into tasks of at most GRAPH_TASK_CHUNK nodes and adds an edge from the task of each
+// dependency (inputs for forward, consumers for backward) to the task using it.
+void graph_build_tasks(Graph& graph, GraphSchedule& schedule, std::vector<int>& level_offsets, bool backward, ThreadPool* pool)
+{
+    GraphAdjacency& adjacency = graph.adjacency;
+    int count = (int)graph.reachable.size();
+    int level_count = (int)level_offsets.size() - 1;
+
+    schedule.tasks.clear();
+    for (int l = 0; l < level_count; l++)
+    {
+        for (int begin = level_offsets[l]; begin < level_offsets[l + 1]; begin += GRAPH_TASK_CHUNK)
+        {
+            GraphTask task;
+            task.begin = begin;
+            task.end = begin + GRAPH_TASK_CHUNK < level_offsets[l + 1] ? begin + GRAPH_TASK_CHUNK : level_offsets[l + 1];
+            schedule.tasks.push_back(task);
+        }
+    }
+    int task_count = (int)schedule.tasks.size();
+
+    std::vector<int> task_of(count, -1);
+    graph_parallel_for(pool, task_count, 64, [&](int begin, int end, int worker) {
+        for (int t = begin; t < end; t++)
+        {
+            for (int k = schedule.tasks[t].begin; k < schedule.tasks[t].end; k++)
+            {
+                task_of[schedule.order[k]] = t;
+            }
+        }
+    });
+
+    // every task collects its own predecessors, no task writes into another one
+    std::vector<std::vector<int>> predecessors(task_count);
+    graph_parallel_for(pool, task_count, 64, [&](int begin, int end, int worker) {
+        for (int t = begin; t < end; t++)
+        {
+            std::vector<int>& from = predecessors[t];
+            for (int k = schedule.tasks[t].begin; k < schedule.tasks[t].end; k++)
+            {
+                int idx = schedule.order[k];
+                if (backward)
+                {
+                    for (int c = adjacency.consumer_offsets[idx]; c < adjacency.consumer_offsets[idx + 1]; c++)
+                    {
+                        from.push_back(task_of[adjacency.consumers[c].node]);
+                    }
+                }
+                else
+                {
+                    for (int j = adjacency.producer_offsets[idx]; j < adjacency.producer_offsets[idx + 1]; j++)
+                    {
+                        int input_task = task_of[adjacency.producers[j]];
+                        if (input_task >= 0) from.push_back(input_task);
+                    }
+                }
+            }
+            std::sort(from.begin(), from.end());
+            from.erase(std::unique(from.begin(), from.end()), from.end());
+            schedule.tasks[t].dependency_count = (int)from.size();
+        }
+    });
+
+    for (int t = 0; t < task_count; t++)
+    {
+        for (int k = 0; k < predecessors[t].size(); k++)
+        {
+            schedule.tasks[predecessors[t][k]].successors.push_back(t);
+        }
+    }
+}
+
+void graph_build_schedule(Graph& graph, GraphSchedule& schedule, std::vector<int>& node_level, int level_count, bool backward)
+{
+    int count = (int)node_level.size();
+    std::vector<int> level_offsets(level_count + 1, 0);
+    for (int i = 0; i < count; i++)
+    {
+        if (node_level[i] >= 0) level_offsets[node_level[i] + 1]++;
+    }
+    for (int l = 0; l < level_count; l++)
+    {
+        level_offsets[l + 1] += level_offsets[l];
+    }
+    schedule.order.resize(level_offsets[level_count]);
+    std::vector<int> fill(level_offsets.begin(), level_offsets.end() - 1);
+    for (int i = 0; i < count; i++)
+    {
+        if (node_level[i] >= 0) schedule.order[fill[node_level[i]]++] = i;
+    }
+
+    graph_build_tasks(graph, schedule, level_offsets, backward, NULL);
+}
+
+// counting sort of every level by op. nodes are counted and placed through atomic cursors,
+// over the pool when one is given, then every bucket is sorted so it keeps ascending pool
+// order however the work was split
+void graph_build_buckets(Graph& graph, ThreadPool* pool)
+{
+    ValuePool* value_pool = g_value_pool;
+    int level_count = (int)graph.level_offsets.size() - 1;
+    int bucket_count = level_count * GRAPH_OP_COUNT;
+    int node_count = (int)graph.level_nodes.size();
+    const int chunk = 4096;
+
+    graph.bucket_offsets.assign(bucket_count + 1, 0);
+    graph_parallel_for(pool, node_count, chunk, [&](int begin, int end, int worker) {
+        for (int k = begin; k < end; k++)
+        {
+            int idx = graph.level_nodes[k];
+            int bucket = graph.level[idx] * GRAPH_OP_COUNT + value_pool->values[idx].op;
+            std::atomic_ref<int>(graph.bucket_offsets[bucket + 1]).fetch_add(1);
+        }
+    });
+    graph_prefix_sum(pool, graph.bucket_offsets, chunk);
+
+    graph.bucket_nodes.resize(node_count);
+    graph.bucket_inputs.resize(2 * node_count);
+    std::vector<int> cursor(graph.bucket_offsets.begin(), graph.bucket_offsets.end() - 1);
+    graph_parallel_for(pool, node_count, chunk, [&](int begin, int end, int worker) {
+        for (int k = begin; k < end; k++)
+        {
+            int idx = graph.level_nodes[k];
+            int bucket = graph.level[idx] * GRAPH_OP_COUNT + value_pool->values[idx].op;
+            graph.bucket_nodes[std::atomic_ref<int>(cursor[bucket]).fetch_add(1)] = idx;
+        }
+    });
+    graph_parallel_for(pool, bucket_count, 64, [&](int begin, int end, int worker) {
+        for (int b = begin; b < end; b++)
+        {
+            std::sort(graph.bucket_nodes.begin() + graph.bucket_offsets[b], graph.bucket_nodes.begin() + graph.bucket_offsets[b + 1]);
+            for (int slot = graph.bucket_offsets[b]; slot < graph.bucket_offsets[b + 1]; slot++)
+            {
+                int idx = graph.bucket_nodes[slot];
+                int producer_count = graph_producer_count(graph.adjacency, idx);
+                const int* producers = graph.adjacency.producers.data() + graph.adjacency.producer_offsets[idx];
+                graph.bucket_inputs[2 * slot] = producer_count > 0 ? producers[0] : -1;
+                graph.bucket_inputs[2 * slot + 1] = producer_count > 1 ? producers[1] : -1;
+            }
+        }
+    });
+}
+
+// captured graphs are scalar, tensor nodes only run on the tape
+bool graph_scalar_node(Value& value, int idx)
+{
+    if (value.op != MathOperation::TENSOR) return true;
+    fprintf(stderr, "value %d is a tensor node, captured graphs are scalar! capture failed!", idx);
+    return false;
+}
+
+// what a failed capture leaves behind: the root alone as a leaf, a graph every replay
+// accepts. forward keeps the root's last data and backward only seeds its gradient.
+void graph_capture_root(Graph& graph, ValueHandle hroot)
+{
+    int count = hroot.idx + 1;
+    graph = Graph();
+    graph.root = hroot;
+    graph.reachable.assign(count, false);
+    graph.reachable[hroot.idx] = true;
+    graph.adjacency.producer_offsets.assign(count + 1, 0);
+    graph.adjacency.consumer_offsets.assign(count + 1, 0);
+    graph.level.assign(count, -1);
+    graph.level[hroot.idx] = 0;
+    graph.level_offsets = { 0, 1 };
+    graph.level_nodes = { hroot.idx };
+    std::vector<int> forward_level(count, -1);
+    graph_build_schedule(graph, graph.forward_schedule, forward_level, 0, false);
+    graph_build_schedule(graph, graph.backward_schedule, graph.level, 1, true);
+    graph.bucket_offsets.assign(GRAPH_OP_COUNT + 1, 0);
+}
+
+// returns false, with the root alone captured, when the graph holds a tensor node
+bool graph_capture(Graph& graph, ValueHandle hroot)
+{
+    assert(valid_value(hroot));
+    int count = hroot.idx + 1;
+    graph.root = hroot;
+    graph.reachable.assign(count, false);
+    graph.level.assign(count, -1);
+
+    graph.reachable[hroot.idx] = true;
+    for (int i = count - 1; i >= 0; i--)
+    {
+        if (!graph.reachable[i]) continue;
+        Value& value = g_value_pool->values[i];
+        if (!graph_scalar_node(value, i))
+        {
+            graph_capture_root(graph, hroot);
+            return false;
+        }
+        for (int j = 0; j < value.input.size(); j++)
+        {
+            assert(value.input[j].idx < i);
+            graph.reachable[value.input[j].idx] = true;
+        }
+    }
+    std::vector<int> nodes;
+    for (int i = 0; i < count; i++)
+    {
+        if (graph.reachable[i]) nodes.push_back(i);
+    }
+    graph_build_adjacency(graph, nodes, NULL);
+    GraphAdjacency& adjacency = graph.adjacency;
+
+    graph.level[hroot.idx] = 0;
+    int level_count = 1;
+    for (int k = (int)nodes.size() - 1; k >= 0; k--)
+    {
+        int i = nodes[k];
+        for (int j = adjacency.producer_offsets[i]; j < adjacency.producer_offsets[i + 1]; j++)
+        {
+            int idx = adjacency.producers[j];
+            if (graph.level[i] + 1 > graph.level[idx])
+            {
+                graph.level[idx] = graph.level[i] + 1;
+                if (graph.level[idx] + 1 > level_count) level_count = graph.level[idx] + 1;
+            }
+        }
+    }
+
+    // bucket nodes by level, ascending pool index inside a level
+    graph.level_offsets.assign(level_count + 1, 0);
+    for (int i = 0; i < count; i++)
+    {
+        if (graph.reachable[i]) graph.level_offsets[graph.level[i] + 1]++;
+    }
+    for (int l = 0; l < level_count; l++)
+    {
+        graph.level_offsets[l + 1] += graph.level_offsets[l];
+    }
+    graph.level_nodes.resize(graph.level_offsets[level_count]);
+    std::vector<int> fill(graph.level_offsets.begin(), graph.level_offsets.end() - 1);
+    for (int i = 0; i < count; i++)
+    {
+        if (graph.reachable[i]) graph.level_nodes[fill[graph.level[i]]++] = i;
+    }
+
+    // forward levels count up from the leaves, leaves themselves are not recomputed
+    std::vector<int> forward_level(count, -1);
+    int forward_level_count = 0;
+    for (int k = 0; k < nodes.size(); k++)
+    {
+        int i = nodes[k];
+        if (graph_producer_count(adjacency, i) == 0) continue;
+        int l = 0;
+        for (int j = adjacency.producer_offsets[i]; j < adjacency.producer_offsets[i + 1]; j++)
+        {
+            int input_level = forward_level[adjacency.producers[j]] + 1;
+            if (input_level > l) l = input_level;
+        }
+        forward_level[i] = l;
+        if (l + 1 > forward_level_count) forward_level_count = l + 1;
+    }
+
+    graph_build_schedule(graph, graph.forward_schedule, forward_level, forward_level_count, false);
+    graph_build_schedule(graph, graph.backward_schedule, graph.level, level_count, true);
+    graph_build_buckets(graph, NULL);
+    return true;
+}
+
+// concatenates per worker buffers and sorts the result, so the frontier is the same set in
+// the same order whatever the threads did. every buffer is sorted on its own, then the
+// sorted runs are merged pairwise, a round at a time over the pool.
+void graph_gather_frontier(ThreadPool* pool, std::vector<std::vector<int>>& buffers, std::vector<int>& frontier)
+{
+    int run_count = (int)buffers.size();
+    std::vector<int> run_offsets(run_count + 1, 0);
+    for (int w = 0; w < run_count; w++)
+    {
+        run_offsets[w + 1] = run_offsets[w] + (int)buffers[w].size();
+    }
+    // small frontiers are not worth waking the workers for
+    if (run_offsets[run_count] < GRAPH_TASK_CHUNK) pool = NULL;
+
+    frontier.resize(run_offsets[run_count]);
+    graph_parallel_for(pool, run_count, 1, [&](int begin, int end, int worker) {
+        for (int w = begin; w < end; w++)
+        {
+            std::sort(buffers[w].begin(), buffers[w].end());
+            std::copy(buffers[w].begin(), buffers[w].end(), frontier.begin() + run_offsets[w]);
+            buffers[w].clear();
+        }
+    });
+    for (int width = 1; width < run_count; width *= 2)
+    {
+        graph_parallel_for(pool, (run_count + 2 * width - 1) / (2 * width), 1, [&](int begin, int end, int worker) {
+            for (int m = begin; m < end; m++)
+            {
+                int first = 2 * width * m;
+                int middle = std::min(first + width, run_count);
+                int last = std::min(first + 2 * width, run_count);
+                std::inplace_merge(frontier.begin() + run_offsets[first], frontier.begin() + run_offsets[middle], frontier.begin() + run_offsets[last]);
+            }
+        });
+    }
+}
+
+// same result as graph_capture, with every stage split over the pool for large graphs:
+// reachability is a frontier walk from the root, consumer lists are filled from atomic
+// counts and chunked prefix sums, and both level assignments are kahn style wavefronts that
+// release a node when its last dependency is processed. each level is sorted, so the output
+// is deterministic. a graph is bounded by the value pool it was recorded on, a fixed array
+// of MAX_VALUE_NUMBER values (65536 in main.cc), so it never reaches the millions of nodes
+// a growable pool could hold. every data parallel trainer worker copies that whole array.
+bool graph_capture_parallel(Graph& graph, ValueHandle hroot, ThreadPool& pool)
+{
+    assert(valid_value(hroot));
+    ValuePool* value_pool = g_value_pool;
+    int count = hroot.idx + 1;
+    int worker_count = thread_pool_worker_count(pool);
+    const int chunk = 4096;
+    std::vector<std::vector<int>> buffers(worker_count);
+    std::vector<int> frontier;
+
+    graph.root = hroot;
+    graph.reachable.assign(count, false);
+    graph.level.assign(count, -1);
+
+    // reachability, the lowest tensor node found rejects the capture
+    std::atomic<int> tensor_node = count;
+    std::vector<unsigned char> reached(count, 0);
+    reached[hroot.idx] = 1;
+    frontier.push_back(hroot.idx);
+    while (frontier.size() > 0)
+    {
+        graph_parallel_for(&pool, (int)frontier.size(), chunk, [&](int begin, int end, int worker) {
+            for (int k = begin; k < end; k++)
+            {
+                Value& value = value_pool->values[frontier[k]];
+                if (value.op == MathOperation::TENSOR)
+                {
+                    int expected = tensor_node.load();
+                    while (frontier[k] < expected && !tensor_node.compare_exchange_weak(expected, frontier[k])) {}
+                    continue;
+                }
+                for (int j = 0; j < value.input.size(); j++)
+                {
+                    std::atomic_ref<unsigned char> flag(reached[value.input[j].idx]);
+                    if (flag.exchange(1) == 0) buffers[worker].push_back(value.input[j].idx);
+                }
+            }
+        });
+        graph_gather_frontier(&pool, buffers, frontier);
+    }
+    if (tensor_node.load() < count)
+    {
+        graph_scalar_node(value_pool->values[tensor_node.load()], tensor_node.load());
+        graph_capture_root(graph, hroot);
+        return false;
+    }
+
+    // chunks start at multiples of 4096, so no two of them share a word of the reachable bits
+    std::vector<std::vector<int>> chunk_nodes((count + chunk - 1) / chunk);
+    graph_parallel_for(&pool, count, chunk, [&](int begin, int end, int worker) {
+        for (int i = begin; i < end; i++)
+        {
+            if (!reached[i]) continue;
+            graph.reachable[i] = true;
+            chunk_nodes[begin / chunk].push_back(i);
+        }
+    });
+    std::vector<int> nodes;
+    graph_gather_chunks(&pool, chunk_nodes, nodes);
+
+    graph_build_adjacency(graph, nodes, &pool);
+    GraphAdjacency& adjacency = graph.adjacency;
+    std::vector<int> pending(count);
+    graph_parallel_for(&pool, count, chunk, [&](int begin, int end, int worker) {
+        for (int i = begin; i < end; i++)
+        {
+            pending[i] = adjacency.consumer_offsets[i + 1] - adjacency.consumer_offsets[i];
+        }
+    });
+
+    // backward levels, a node is released once all of its consumers are done. the level
+    // of a node and its place in level_nodes are written by the worker that releases it on.
+    graph.level_offsets.assign(1, 0);
+    graph.level_nodes.clear();
+    graph.level_nodes.reserve(nodes.size());
+    frontier.assign(1, hroot.idx);
+    for (int l = 0; frontier.size() > 0; l++)
+    {
+        int base = (int)graph.level_nodes.size();
+        graph.level_nodes.resize(base + frontier.size());
+        graph.level_offsets.push_back((int)graph.level_nodes.size());
+
+        graph_parallel_for(&pool, (int)frontier.size(), chunk, [&](int begin, int end, int worker) {
+            for (int k = begin; k < end; k++)
+            {
+                graph.level[frontier[k]] = l;
+                graph.level_nodes[base + k] = frontier[k];
+                for (int j = adjacency.producer_offsets[frontier[k]]; j < adjacency.producer_offsets[frontier[k] + 1]; j++)
+                {
+                    int idx = adjacency.producers[j];
+                    if (std::atomic_ref<int>(pending[idx]).fetch_sub(1) == 1) buffers[worker].push_back(idx);
+                }
+            }
+        });
+        graph_gather_frontier(&pool, buffers, frontier);
+    }
+
+    // forward levels over the non leaf nodes, released once all non leaf inputs are done
+    std::vector<int> pending_input(count, 0);
+    std::vector<std::vector<int>> chunk_ready(((int)nodes.size() + chunk - 1) / chunk);
+    graph_parallel_for(&pool, (int)nodes.size(), chunk, [&](int begin, int end, int worker) {
+        for (int k = begin; k < end; k++)
+        {
+            if (graph_producer_count(adjacency, nodes[k]) == 0) continue;
+            int inputs = 0;
+            for (int j = adjacency.producer_offsets[nodes[k]]; j < adjacency.producer_offsets[nodes[k] + 1]; j++)
+            {
+                if (graph_producer_count(adjacency, adjacency.producers[j]) > 0) inputs++;
+            }
+            pending_input[nodes[k]] = inputs;
+            if (inputs == 0) chunk_ready[begin / chunk].push_back(nodes[k]);
+        }
+    });
+    graph_gather_chunks(&pool, chunk_ready, frontier);
+
+    std::vector<int> forward_offsets(1, 0);
+    std::vector<int>& forward_order = graph.forward_schedule.order;
+    forward_order.clear();
+    forward_order.reserve(nodes.size());
+    while (frontier.size() > 0)
+    {
+        int base = (int)forward_order.size();
+        forward_order.resize(base + frontier.size());
+        forward_offsets.push_back((int)forward_order.size());
+
+        graph_parallel_for(&pool, (int)frontier.size(), chunk, [&](int begin, int end, int worker) {
+            for (int k = begin; k < end; k++)
+            {
+                forward_order[base + k] = frontier[k];
+                for (int c = adjacency.consumer_offsets[frontier[k]]; c < adjacency.consumer_offsets[frontier[k] + 1]; c++)
+                {
+                    int idx = adjacency.consumers[c].node;
+                    if (std::atomic_ref<int>(pending_input[idx]).fetch_sub(1) == 1) buffers[worker].push_back(idx);
+                }
+            }
+        });
+        graph_gather_frontier(&pool, buffers, frontier);
+    }
+
+    graph.backward_schedule.order = graph.level_nodes;
+    graph_build_tasks(graph, graph.forward_schedule, forward_offsets, false, &pool);
+    graph_build_tasks(graph, graph.backward_schedule, graph.level_offsets, true, &pool);
+    graph_build_buckets(graph, &pool);
+    return true;
+}
+
+int graph_level_count(Graph& graph)
+{
+    return (int)graph.level_offsets.size() - 1;
+}
+
+// pulls a node's gradient from its consumers. consumers were recorded from the highest
+// pool index down, the same order a serial tape backward pushes them in, so the
+// result does not depend on how a level is split between threads.
+void graph_pull_gradient(Graph& graph, ValuePool* value_pool, int idx)
+{
+    GraphAdjacency& adjacency = graph.adjacency;
+    Value* values = value_pool->values;
+    float gradient = values[idx].gradient;
+    for (int k = adjacency.consumer_offsets[idx]; k < adjacency.consumer_offsets[idx + 1]; k++)
+    {
+        GraphEdge& edge = adjacency.consumers[k];
+        gradient += graph_local_gradient(adjacency, values, edge.node, edge.slot) * values[edge.node].gradient;
+    }
+    values[idx].gradient = gradient;
+}
+
+// level synchronous backward: every level is split in chunks over the thread pool,
+// nodes of one level never write to each other so no locking is needed
+void graph_backward_parallel(Graph& graph, ThreadPool& pool)
+{
+    ValuePool* value_pool = g_value_pool;
+    value_pool->values[graph.root.idx].gradient = 1.f;
+
+    for (int l = 1; l < graph_level_count(graph); l++)
+    {
+        int begin = graph.level_offsets[l];
+        int end = graph.level_offsets[l + 1];
+        int chunk_count = (end - begin + GRAPH_BACKWARD_CHUNK - 1) / GRAPH_BACKWARD_CHUNK;
+        thread_pool_run(pool, chunk_count, [&](int chunk, int worker) {
+            ValuePool* saved_value_pool = g_value_pool;
+            g_value_pool = value_pool;
+
+            int chunk_begin = begin + chunk * GRAPH_BACKWARD_CHUNK;
+            int chunk_end = chunk_begin + GRAPH_BACKWARD_CHUNK < end ? chunk_begin + GRAPH_BACKWARD_CHUNK : end;
+            for (int i = chunk_begin; i < chunk_end; i++)
+            {
+                graph_pull_gradient(graph, value_pool, graph.level_nodes[i]);
+            }
+
+            g_value_pool = saved_value_pool;
+        });
+    }
+}
+
+void graph_zero_grad(Graph& graph)
+{
+    for (int i = 0; i < graph.reachable.size(); i++)
+    {
+        if (graph.reachable[i]) g_value_pool->values[i].gradient = 0.f;
+    }
+}
+
+void graph_run_task(Graph& graph, GraphSchedule& schedule, ValuePool* value_pool, int t, bool backward)
+{
+    ValuePool* saved_value_pool = g_value_pool;
+    g_value_pool = value_pool;
+
+    GraphTask& task = schedule.tasks[t];
+    for (int k = task.begin; k < task.end; k++)
+    {
+        int idx = schedule.order[k];
+        if (backward)
+        {
+            graph_pull_gradient(graph, value_pool, idx);
+        }
+        else
+        {
+            graph_calc_data(graph.adjacency, value_pool->values, idx);
+        }
+    }
+
+    g_value_pool = saved_value_pool;
+}
+
+// runs the tasks of a schedule on the work stealing pool. a finished task releases its
+// successors onto its own worker's deque, so dependent chunks tend to stay on one core.
+// small graphs or a single worker run the tasks inline, in schedule order.
+void graph_run_schedule(Graph& graph, GraphSchedule& schedule, ThreadPool& pool, bool backward)
+{
+    ValuePool* value_pool = g_value_pool;
+    int task_count = (int)schedule.tasks.size();
+    if (thread_pool_worker_count(pool) == 1 || schedule.order.size() < GRAPH_INLINE_THRESHOLD)
+    {
+        for (int t = 0; t < task_count; t++)
+        {
+            graph_run_task(graph, schedule, value_pool, t, backward);
+        }
+        return;
+    }
+
+    std::vector<std::atomic<int>> dependency_count(task_count);
+    for (int t = 0; t < task_count; t++)
+    {
+        dependency_count[t].store(schedule.tasks[t].dependency_count);
+    }
+    std::atomic<int> remaining = task_count;
+
+    std::function<void(int t, int worker)> run = [&](int t, int worker) {
+        graph_run_task(graph, schedule, value_pool, t, backward);
+        std::vector<int>& successors = schedule.tasks[t].successors;
+        for (int s = 0; s < successors.size(); s++)
+        {
+            int next = successors[s];
+            if (dependency_count[next].fetch_sub(1) == 1)
+            {
+                thread_pool_push(pool, worker, [&run, next](int w) { run(next, w); });
+            }
+        }
+        remaining.fetch_sub(1);
+    };
+
+    int worker_count = thread_pool_worker_count(pool);
+    int ready = 0;
+    for (int t = 0; t < task_count; t++)
+    {
+        if (schedule.tasks[t].dependency_count != 0) continue;
+        thread_pool_push(pool, ready++ % worker_count, [&run, t](int w) { run(t, w); });
+    }
+    thread_pool_wait(pool, 0, remaining);
+}
+
+// replays the forward pass after leaves (inputs, parameters) changed
+void graph_forward(Graph& graph, ThreadPool& pool)
+{
+    graph_run_schedule(graph, graph.forward_schedule, pool, false);
+}
+
+// same gradients as graph_backward_parallel, without a barrier between levels
+void graph_backward(Graph& graph, ThreadPool& pool)
+{
+    g_value_pool->values[graph.root.idx].gradient = 1.f;
+    graph_run_schedule(graph, graph.backward_schedule, pool, true);
+}
+
+// serial backward that walks every level one op bucket at a time: each bucket is a single
+// branch free loop that gathers its operands into contiguous scratch, computes the local
+// gradients there (where the compiler can vectorize) and scatters them into the inputs.
+// levels keep the dependency order, the order of pushes inside a level differs from the
+// tape, so results match backward() up to rounding.
+void graph_backward_bucketed(Graph& graph)
+{
+    Value* values = g_value_pool->values;
+    values[graph.root.idx].gradient = 1.f;
+
+    int level_count = graph_level_count(graph);
+    int max_bucket = 0;
+    for (int b = 0; b < level_count * GRAPH_OP_COUNT; b++)
+    {
+        max_bucket = std::max(max_bucket, graph.bucket_offsets[b + 1] - graph.bucket_offsets[b]);
+    }
+    std::vector<float> scratch_a(max_bucket);
+    std::vector<float> scratch_b(max_bucket);
+    std::vector<float> scratch_g(max_bucket);
+    float* fa = scratch_a.data();
+    float* fb = scratch_b.data();
+    float* g = scratch_g.data();
+
+    for (int l = 0; l < level_count; l++)
+    {
+        for (int op = MathOperation::ADD; op < GRAPH_OP_COUNT; op++)
+        {
+            int begin = graph.bucket_offsets[l * GRAPH_OP_COUNT + op];
+            int n = graph.bucket_offsets[l * GRAPH_OP_COUNT + op + 1] - begin;
+            if (n == 0) continue;
+            const int* node = graph.bucket_nodes.data() + begin;
+            const int* input = graph.bucket_inputs.data() + 2 * begin;
+
+            for (int i = 0; i < n; i++)
+            {
+                g[i] = values[node[i]].gradient;
+            }
+            switch(op)
+            {
+            case MathOperation::ADD:
+                for (int i = 0; i < n; i++)
+                {
+                    values[input[2 * i]].gradient += 1.f * g[i];
+                    values[input[2 * i + 1]].gradient += 1.f * g[i];
+                }
+                break;
+            case MathOperation::MULTIPLE:
+                for (int i = 0; i < n; i++)
+                {
+                    fa[i] = values[input[2 * i]].data;
+                    fb[i] = values[input[2 * i + 1]].data;
+                }
+                for (int i = 0; i < n; i++)
+                {
+                    float a = fa[i];
+                    fa[i] = fb[i] * g[i];
+                    fb[i] = a * g[i];
+                }
+                for (int i = 0; i < n; i++)
+                {
+                    values[input[2 * i]].gradient += fa[i];
+                    values[input[2 * i + 1]].gradient += fb[i];
+                }
+                break;
+            case MathOperation::POW:
+                for (int i = 0; i < n; i++)
+                {
+                    float exponent = values[node[i]].exponent;
+                    fa[i] = exponent * powf(values[input[2 * i]].data, exponent - 1.f) * g[i];
+                }
+                for (int i = 0; i < n; i++)
+                {
+                    values[input[2 * i]].gradient += fa[i];
+                }
+                break;
+            case MathOperation::EXP:
+            case MathOperation::TANH:
+                for (int i = 0; i < n; i++)
+                {
+                    fa[i] = values[node[i]].data;
+                }
+                if (op == MathOperation::EXP)
+                {
+                    for (int i = 0; i < n; i++) fa[i] = fa[i] * g[i];
+                }
+                else
+                {
+                    for (int i = 0; i < n; i++) fa[i] = (1.f - fa[i] * fa[i]) * g[i];
+                }
+                for (int i = 0; i < n; i++)
+                {
+                    values[input[2 * i]].gradient += fa[i];
+                }
+                break;
+            case MathOperation::RELU:
+                for (int i = 0; i < n; i++)
+                {
+                    fa[i] = values[input[2 * i]].data;
+                }
+                for (int i = 0; i < n; i++)
+                {
+                    fa[i] = (fa[i] < 0.f ? 0.f : 1.f) * g[i];
+                }
+                for (int i = 0; i < n; i++)
+                {
+                    values[input[2 * i]].gradient += fa[i];
+                }
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+// lazy mode hands pending segments to this pool when it has more than one worker, and
+// sweeps them fused when asked to. per thread like the value pool, see graph_lazy_init.
+thread_local ThreadPool* g_graph_lazy_pool = NULL;
+thread_local bool g_graph_lazy_fuse = false;
+
+// captures the pending values [begin, end) of the tape for a forward replay. a segment has no
+// single root, every computed node in it is kept and values below begin, which are already
+// computed, are read like leaves. only the forward schedule is built. fails on tensor
+// nodes, those only run on the tape.
+bool graph_capture_segment(Graph& graph, int begin, int end, ThreadPool* pool)
+{
+    std::vector<int> nodes;
+    for (int i = begin; i < end; i++)
+    {
+        Value& value = g_value_pool->values[i];
+        if (value.op == MathOperation::TENSOR) return false;
+        if (value.input.size() > 0) nodes.push_back(i);
+    }
+    graph.root = ValueHandle{ .idx = end - 1 };
+    graph.reachable.assign(end, false);
+    for (int k = 0; k < nodes.size(); k++)
+    {
+        graph.reachable[nodes[k]] = true;
+    }
+    graph_build_adjacency(graph, nodes, pool);
+    GraphAdjacency& adjacency = graph.adjacency;
+
+    std::vector<int> forward_level(end, -1);
+    int forward_level_count = 0;
+    for (int k = 0; k < nodes.size(); k++)
+    {
+        int i = nodes[k];
+        int l = 0;
+        for (int j = adjacency.producer_offsets[i]; j < adjacency.producer_offsets[i + 1]; j++)
+        {
+            int input_level = forward_level[adjacency.producers[j]] + 1;
+            if (input_level > l) l = input_level;
+        }
+        forward_level[i] = l;
+        if (l + 1 > forward_level_count) forward_level_count = l + 1;
+    }
+    graph_build_schedule(graph, graph.forward_schedule, forward_level, forward_level_count, false);
+    return true;
+}
+
+// the fused sweep of [begin, end): a multiply whose product feeds the add recorded right
+// after it, the w * x + sum of a neuron, is contracted into one fmaf and pow(x, 2) is a
+// multiply. every node is still written, so reads and backward see a complete tape, but a
+// contracted sum rounds once and differs from eager in the last bits.
+void graph_evaluate_fused(int begin, int end)
+{
+    Value* values = g_value_pool->values;
+    for (int i = begin; i < end; i++)
+    {
+        Value& value = values[i];
+        if (value.input.size() == 0) continue;
+        if (value.op == MathOperation::MULTIPLE && i + 1 < end && values[i + 1].op == MathOperation::ADD)
+        {
+            Value& sum = values[i + 1];
+            int other = sum.input[0].idx == i ? 1 : sum.input[1].idx == i ? 0 : -1;
+            if (other >= 0)
+            {
+                float a = values[value.input[0].idx].data;
+                float b = values[value.input[1].idx].data;
+                value.data = a * b;
+                sum.data = fmaf(a, b, values[sum.input[other].idx].data);
+                i++;
+                continue;
+            }
+        }
+        if (value.op == MathOperation::POW && value.exponent == 2.f)
+        {
+            float a = values[value.input[0].idx].data;
+            value.data = a * a;
+            continue;
+        }
+        calc_data(ValueHandle{ .idx = i });
+    }
+}
+
+// evaluate_pending in lazy mode. with a pool of several workers the segment is captured and
+// replayed level by level as dependency counted tasks, the same arithmetic per node as the
+// tape sweep, so the data is bit for bit what eager mode computes. a single worker gains
+// nothing from the schedule, so it, short segments and tensor nodes take the sweep, fused
+// when that was asked for.
+void graph_evaluate_pending(int begin, int end)
+{
+    ThreadPool* pool = g_graph_lazy_pool;
+    if (pool != NULL && thread_pool_worker_count(*pool) > 1 && end - begin >= GRAPH_INLINE_THRESHOLD)
+    {
+        Graph graph;
+        if (graph_capture_segment(graph, begin, end, pool))
+        {
+            graph_forward(graph, *pool);
+            return;
+        }
+    }
+    if (g_graph_lazy_fuse) graph_evaluate_fused(begin, end);
+    else evaluate_segment(begin, end);
+}
+
+// installs the lazy scheduler for evaluate_pending. pool (may be NULL) and fuse apply to the
+// calling thread, the hook itself is process wide.
+void graph_lazy_init(ThreadPool* pool, bool fuse = false)
+{
+    g_evaluate_pending = graph_evaluate_pending;
+    g_graph_lazy_pool = pool;
+    g_graph_lazy_fuse = fuse;
+}
+
+// back to the plain tape sweep
+void graph_lazy_shutdown()
+{
+    g_evaluate_pending = NULL;
+    g_graph_lazy_pool = NULL;
+    g_graph_lazy_fuse = false;
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef _INCREMENTAL_H_
+#define _INCREMENTAL_H_
+
+#include "engine.h"
+#include "graph.h"
+
+#include <functional>
+#include <queue>
+#include <string.h>
+#include <vector>
+
+// keeps the values of a captured graph up to date after a few leaves changed. only the
+// downstream cone of the changed leaves is recomputed, in pool (= topological) order, and
+// a node whose value comes out bit for bit unchanged does not wake up its consumers.
+struct IncrementalEvaluator
+{
+    Graph* graph = NULL;
+    std::vector<bool> queued;
+    std::priority_queue<int, std::vector<int>, std::greater<int>> pending;
+    int recompute_count = 0;    // nodes recomputed by the last incremental_forward
+    int changed_count = 0;      // of those, how many actually changed
+};
+
+void incremental_init(IncrementalEvaluator& evaluator, Graph& graph)
+{
+    evaluator.graph = &graph;
+    evaluator.queued.assign(graph.reachable.size(), false);
+    evaluator.pending = {};
+}
+
+void incremental_wake_consumers(IncrementalEvaluator& evaluator, int idx)
+{
+    GraphAdjacency& adjacency = evaluator.graph->adjacency;
+    for (int k = adjacency.consumer_offsets[idx]; k < adjacency.consumer_offsets[idx + 1]; k++)
+    {
+        int consumer = adjacency.consumers[k].node;
+        if (evaluator.queued[consumer]) continue;
+        evaluator.queued[consumer] = true;
+        evaluator.pending.push(consumer);
+    }
+}
+
+// sets a leaf of the graph, its consumers get recomputed by the next incremental_forward
+void incremental_set(IncrementalEvaluator& evaluator, ValueHandle h, float data)
+{
+    assert(h.idx < evaluator.graph->reachable.size() && evaluator.graph->reachable[h.idx]);
+    Value* value = get_value(h);
+    assert(graph_producer_count(evaluator.graph->adjacency, h.idx) == 0);
+    if (memcmp(&value->data, &data, sizeof(float)) == 0) return;
+    value->data = data;
+    incremental_wake_consumers(evaluator, h.idx);
+}
+
+// brings every value of the graph back in line with its leaves, the same values a full
+// graph_forward would give
+void incremental_forward(IncrementalEvaluator& evaluator)
+{
+    evaluator.recompute_count = 0;
+    evaluator.changed_count = 0;
+    while (!evaluator.pending.empty())
+    {
+        int idx = evaluator.pending.top();
+        evaluator.pending.pop();
+        evaluator.queued[idx] = false;
+
+        Value& value = g_value_pool->values[idx];
+        float old_data = value.data;
+        graph_calc_data(evaluator.graph->adjacency, g_value_pool->values, idx);
+        evaluator.recompute_count++;
+        if (memcmp(&old_data, &value.data, sizeof(float)) == 0) continue;
+        evaluator.changed_count++;
+        incremental_wake_consumers(evaluator, idx);
+    }
+}
+
+#endif
@@ -1,7 +1,21 @@
+#define MAX_VALUE_NUMBER 65536
+
 #include "engine.h"
 #include "nn.h"
+#include "train.h"
+#include "graph.h"
+#include "bytecode.h"
+#include "codegen.h"
+#include "fixed.h"
+#include "passes.h"
+#include "batch.h"
+#include "incremental.h"
+#include "plan.h"
+#include "memory.h"
 
 #include <stdio.h>
+#include <chrono>
+#include <string.h>
 
 #include <graphviz/gvc.h>
 
@@ -356,18 +370,2138 @@ void mlp_test()
     TEMP_VALUE_POOL_END;
 }
 
-int main()
+void optimizer_test()
 {
-    engine_test_1();
-    fprintf(stdout, "\n\n");
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "optimizer_test: \n");
+
+    float input_data[4][3] = {
+        { 2.f, 3.f, -1.f },
+        { 3.f, -1.f, 0.5f },
+        { 0.5f, 1.f, 1.f },
+        { 1.f, 1.f, -1.f },
+    };
+    float expect_data[4] = { 1.f, -1.f, -1.f, 1.f };
+
+    const char* names[] = { "sgd", "momentum", "nesterov", "adam", "adamw", "adam (fused)" };
+    OptimizerType types[] = {
+        OptimizerType::SGD,
+        OptimizerType::MOMENTUM,
+        OptimizerType::NESTEROV,
+        OptimizerType::ADAM,
+        OptimizerType::ADAMW,
+        OptimizerType::ADAM,
+    };
+    float learning_rates[] = { 0.05f, 0.01f, 0.01f, 0.05f, 0.05f, 0.05f };
 
-    engine_test_2();
-    fprintf(stdout, "\n\n");
+    MLP mlp;
+    std::vector<int> layer = {4, 4, 1};
+    mlp_init(mlp, 3, layer);
 
-    engine_test_3();
-    fprintf(stdout, "\n\n");
+    // every optimizer starts from the same initial parameters
+    std::vector<ValueHandle> parameters = mlp_parameters(mlp);
+    std::vector<float> initial_data;
+    for (int i = 0; i < parameters.size(); i++)
+    {
+        initial_data.push_back(get_value(parameters[i])->data);
+    }
 
-    mlp_test();
+    for (int t = 0; t < 6; t++)
+    {
+        for (int i = 0; i < parameters.size(); i++)
+        {
+            get_value(parameters[i])->data = initial_data[i];
+        }
+
+        Optimizer optimizer;
+        optimizer_init(optimizer, types[t], parameters, learning_rates[t]);
+        if (types[t] == OptimizerType::ADAMW) optimizer.weight_decay = 0.01f;
+        // clipping needs the full gradient first, so the fused variant runs without it
+        if (t == 5) optimizer.fused_backward = true;
+        else optimizer.max_grad_norm = 10.f;
+
+        float loss_data = 0.f;
+        for (int g = 0; g < 50; g++)
+        {
+            TEMP_VALUE_POOL_START;
+
+            std::vector<ValueHandle> prediction_set;
+            std::vector<ValueHandle> expect_set;
+            for (int i = 0; i < 4; i++)
+            {
+                std::vector<ValueHandle> input;
+                for (int j = 0; j < 3; j++)
+                {
+                    input.push_back(create_value(input_data[i][j]));
+                }
+                std::vector<ValueHandle> prediction = mlp_forward(mlp, input);
+                assert(prediction.size() == 1);
+                prediction_set.push_back(prediction.back());
+                expect_set.push_back(create_value(expect_data[i]));
+            }
+
+            ValueHandle loss = mean_squared_error(expect_set, prediction_set);
+            loss_data = get_value(loss)->data;
+
+            optimizer_zero_grad(optimizer);
+            mlp_backward(mlp, loss, optimizer);
+
+            TEMP_VALUE_POOL_END;
+        }
+
+        fprintf(stdout, "%-12s final loss: %.5f\n", names[t], loss_data);
+    }
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void accumulate_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "accumulate_test: \n");
+
+    std::vector<std::vector<float>> input = {
+        { 2.f, 3.f, -1.f },
+        { 3.f, -1.f, 0.5f },
+        { 0.5f, 1.f, 1.f },
+        { 1.f, 1.f, -1.f },
+    };
+    std::vector<std::vector<float>> expect = { { 1.f }, { -1.f }, { -1.f }, { 1.f } };
+
+    MLP mlp;
+    std::vector<int> layer = {4, 4, 1};
+    mlp_init(mlp, 3, layer);
+    std::vector<ValueHandle> parameters = mlp_parameters(mlp);
+
+    int microbatch_sizes[] = { 4, 2, 1 };
+    std::vector<float> full_batch_gradient;
+    for (int t = 0; t < 3; t++)
+    {
+        mlp_zero_grad(mlp);
+        int base_count = g_value_pool->value_count;
+        g_value_pool->peak_value_count = base_count;
+
+        float loss = mlp_accumulate_gradient(mlp, input, expect, microbatch_sizes[t]);
+
+        float max_diff = 0.f;
+        for (int i = 0; i < parameters.size(); i++)
+        {
+            float gradient = get_value(parameters[i])->gradient;
+            if (t == 0) full_batch_gradient.push_back(gradient);
+            float diff = fabsf(gradient - full_batch_gradient[i]);
+            if (diff > max_diff) max_diff = diff;
+        }
+
+        fprintf(stdout, "microbatch %d, loss: %.5f, peak temp values: %d, max gradient diff: %g\n",
+            microbatch_sizes[t], loss, g_value_pool->peak_value_count - base_count, max_diff);
+        assert(max_diff < 1e-5f);
+    }
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+// the toy task of the training demos: three features in [-1, 1], labeled by the sign of x0 * x1 + x2
+void demo_dataset(int count, std::vector<std::vector<float>>& input, std::vector<std::vector<float>>& expect, std::mt19937& gen = g_gen)
+{
+    input.clear();
+    expect.clear();
+    for (int i = 0; i < count; i++)
+    {
+        float x0 = g_dis(gen);
+        float x1 = g_dis(gen);
+        float x2 = g_dis(gen);
+        input.push_back({ x0, x1, x2 });
+        expect.push_back({ x0 * x1 + x2 > 0.f ? 1.f : -1.f });
+    }
+}
+
+// an mlp over the three features of the toy task, returns its parameters
+std::vector<ValueHandle> demo_mlp(MLP& mlp, std::vector<int> layer)
+{
+    mlp_init(mlp, 3, layer);
+    return mlp_parameters(mlp);
+}
+
+// mean squared error of mlp over count fresh samples, built on the tape. inputs and
+// expects, when given, collect the leaves of every sample (three inputs per sample)
+ValueHandle demo_loss(MLP& mlp, int count, std::vector<ValueHandle>* inputs = NULL, std::vector<ValueHandle>* expects = NULL)
+{
+    std::vector<std::vector<float>> input;
+    std::vector<std::vector<float>> expect;
+    demo_dataset(count, input, expect);
+    std::vector<ValueHandle> prediction_set;
+    std::vector<ValueHandle> expect_set;
+    for (int i = 0; i < count; i++)
+    {
+        std::vector<ValueHandle> x = { create_value(input[i][0]), create_value(input[i][1]), create_value(input[i][2]) };
+        prediction_set.push_back(mlp_forward(mlp, x).back());
+        expect_set.push_back(create_value(expect[i][0]));
+        if (inputs) inputs->insert(inputs->end(), x.begin(), x.end());
+        if (expects) expects->push_back(expect_set.back());
+    }
+    return mean_squared_error(prediction_set, expect_set);
+}
+
+std::vector<float> demo_parameter_data(std::vector<ValueHandle>& parameters)
+{
+    std::vector<float> data;
+    for (int i = 0; i < parameters.size(); i++)
+    {
+        data.push_back(get_value(parameters[i])->data);
+    }
+    return data;
+}
+
+void demo_set_parameter_data(std::vector<ValueHandle>& parameters, std::vector<float>& data)
+{
+    for (int i = 0; i < parameters.size(); i++)
+    {
+        get_value(parameters[i])->data = data[i];
+    }
+}
+
+void parallel_trainer_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "parallel_trainer_test: \n");
+
+    std::vector<std::vector<float>> input;
+    std::vector<std::vector<float>> expect;
+    demo_dataset(256, input, expect);
+
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 4, 4, 1 });
+    std::vector<float> initial_data = demo_parameter_data(parameters);
+
+    int thread_counts[] = { 1, 2, 4 };
+    double base_ms = 0.0;
+    float base_loss = 0.f;
+    for (int t = 0; t < 3; t++)
+    {
+        demo_set_parameter_data(parameters, initial_data);
+
+        Optimizer optimizer;
+        optimizer_init(optimizer, OptimizerType::ADAM, parameters, 0.01f);
+
+        DataParallelTrainer trainer;
+        trainer_init(trainer, mlp, optimizer, thread_counts[t]);
+
+        float loss = 0.f;
+        auto start = std::chrono::steady_clock::now();
+        for (int g = 0; g < 20; g++)
+        {
+            loss = trainer_step(trainer, input, expect);
+        }
+        auto stop = std::chrono::steady_clock::now();
+
+        trainer_shutdown(trainer);
+
+        double ms = std::chrono::duration<double, std::milli>(stop - start).count() / 20.0;
+        if (t == 0) base_ms = ms;
+        if (t == 0) base_loss = loss;
+        // the shard reduction does not depend on the thread count, neither does the result
+        assert(memcmp(&loss, &base_loss, sizeof(float)) == 0);
+        fprintf(stdout, "threads %d, final loss: %.5f, %.3f ms/step, speedup %.2fx\n",
+            thread_counts[t], loss / input.size(), ms, base_ms / ms);
+    }
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void hogwild_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "hogwild_test: \n");
+
+    std::vector<std::vector<float>> input;
+    std::vector<std::vector<float>> expect;
+    demo_dataset(256, input, expect);
+
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 4, 4, 1 });
+    std::vector<float> initial_data = demo_parameter_data(parameters);
+
+    const int thread_count = 4;
+    const int epoch_count = 10;
+    const int minibatch_size = 16;
+    const float learning_rate = 0.01f;
+    float sync_loss[epoch_count];
+    float hogwild_loss[epoch_count];
+    double sync_seconds = 0.0;
+    double hogwild_seconds = 0.0;
+
+    // synchronous data parallel sgd, one reduction + step per minibatch
+    {
+        Optimizer optimizer;
+        optimizer_init(optimizer, OptimizerType::SGD, parameters, learning_rate);
+        DataParallelTrainer trainer;
+        trainer_init(trainer, mlp, optimizer, thread_count);
+        for (int e = 0; e < epoch_count; e++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (int b = 0; b < input.size(); b += minibatch_size)
+            {
+                std::vector<std::vector<float>> batch_input(input.begin() + b, input.begin() + b + minibatch_size);
+                std::vector<std::vector<float>> batch_expect(expect.begin() + b, expect.begin() + b + minibatch_size);
+                trainer_step(trainer, batch_input, batch_expect);
+            }
+            auto stop = std::chrono::steady_clock::now();
+            sync_seconds += std::chrono::duration<double>(stop - start).count();
+            sync_loss[e] = mlp_loss(mlp, input, expect) / input.size();
+        }
+        trainer_shutdown(trainer);
+    }
+
+    demo_set_parameter_data(parameters, initial_data);
+
+    // asynchronous sgd, one racy update per sample, no barrier inside the epoch
+    {
+        Optimizer optimizer;
+        optimizer_init(optimizer, OptimizerType::SGD, parameters, learning_rate);
+        DataParallelTrainer trainer;
+        trainer_init(trainer, mlp, optimizer, thread_count);
+        for (int e = 0; e < epoch_count; e++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            trainer_hogwild_epoch(trainer, input, expect, learning_rate);
+            auto stop = std::chrono::steady_clock::now();
+            hogwild_seconds += std::chrono::duration<double>(stop - start).count();
+            hogwild_loss[e] = mlp_loss(mlp, input, expect) / input.size();
+        }
+        trainer_shutdown(trainer);
+    }
+
+    for (int e = 0; e < epoch_count; e++)
+    {
+        fprintf(stdout, "epoch %d, sync loss: %.5f, hogwild loss: %.5f\n", e, sync_loss[e], hogwild_loss[e]);
+    }
+    double samples = (double)input.size() * epoch_count;
+    fprintf(stdout, "sync    %.0f samples/s per thread\n", samples / sync_seconds / thread_count);
+    fprintf(stdout, "hogwild %.0f samples/s per thread\n", samples / hogwild_seconds / thread_count);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void backward_parallel_test()
+{
+    TEMP_VALUE_POOL_START;
+
+    fprintf(stdout, "backward_parallel_test: \n");
+
+    int thread_count = (int)std::thread::hardware_concurrency();
+    if (thread_count < 1) thread_count = 1;
+    ThreadPool serial_pool;
+    thread_pool_init(serial_pool, 1);
+    ThreadPool pool;
+    thread_pool_init(pool, thread_count);
+    if (thread_count == 1)
+    {
+        fprintf(stdout, "one hardware thread, no speedup to measure, only the serial backward is timed\n");
+    }
+
+    const int input_count = 16;
+    int widths[] = { 16, 64, 256, 1024 };
+    for (int w = 0; w < 4; w++)
+    {
+        TEMP_VALUE_POOL_START;
+
+        // one tanh layer of the given width, loss is the sum of its outputs
+        std::vector<ValueHandle> x;
+        for (int i = 0; i < input_count; i++)
+        {
+            x.push_back(create_value(g_dis(g_gen)));
+        }
+        ValueHandle loss = create_value(0.f);
+        for (int j = 0; j < widths[w]; j++)
+        {
+            ValueHandle sum = create_value(g_dis(g_gen));
+            for (int i = 0; i < input_count; i++)
+            {
+                sum = sum + create_value(g_dis(g_gen)) * x[i];
+            }
+            loss = loss + tanh(sum);
+        }
+
+        auto capture_start = std::chrono::steady_clock::now();
+        Graph graph;
+        graph_capture(graph, loss);
+        auto capture_stop = std::chrono::steady_clock::now();
+        Graph parallel_graph;
+        graph_capture_parallel(parallel_graph, loss, pool);
+        auto parallel_capture_stop = std::chrono::steady_clock::now();
+        assert(parallel_graph.level_nodes == graph.level_nodes);
+        assert(parallel_graph.adjacency.producers == graph.adjacency.producers);
+        assert(parallel_graph.adjacency.consumer_offsets == graph.adjacency.consumer_offsets);
+        assert(parallel_graph.bucket_offsets == graph.bucket_offsets);
+        assert(parallel_graph.bucket_nodes == graph.bucket_nodes);
+        assert(parallel_graph.bucket_inputs == graph.bucket_inputs);
+
+        // level synchronous on 1 and n threads, then dependency counted tasks on n threads
+        double ms[3];
+        ThreadPool* pools[3] = { &serial_pool, &pool, &pool };
+        for (int p = 0; p < (thread_count > 1 ? 3 : 1); p++)
+        {
+            const int repeat = 20;
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < repeat; r++)
+            {
+                graph_zero_grad(graph);
+                if (p < 2) graph_backward_parallel(graph, *pools[p]);
+                else graph_backward(graph, *pools[p]);
+            }
+            auto stop = std::chrono::steady_clock::now();
+            ms[p] = std::chrono::duration<double, std::milli>(stop - start).count() / repeat;
+        }
+
+        if (thread_count > 1)
+        {
+            fprintf(stdout, "width %4d, nodes %5d, levels %4d, 1 thread %.3f ms, %d threads %.3f ms (%.2fx), tasks %.3f ms (%.2fx)\n",
+                widths[w], (int)graph.level_nodes.size(), graph_level_count(graph), ms[0],
+                thread_count, ms[1], ms[0] / ms[1], ms[2], ms[0] / ms[2]);
+        }
+        else
+        {
+            fprintf(stdout, "width %4d, nodes %5d, levels %4d, 1 thread %.3f ms\n",
+                widths[w], (int)graph.level_nodes.size(), graph_level_count(graph), ms[0]);
+        }
+        double capture_ms = std::chrono::duration<double, std::milli>(capture_stop - capture_start).count();
+        double parallel_capture_ms = std::chrono::duration<double, std::milli>(parallel_capture_stop - capture_stop).count();
+        if (thread_count > 1)
+        {
+            fprintf(stdout, "            capture serial %.3f ms, parallel on %d threads %.3f ms (%.2fx)\n",
+                capture_ms, thread_count, parallel_capture_ms, capture_ms / parallel_capture_ms);
+        }
+        else
+        {
+            fprintf(stdout, "            capture serial %.3f ms, parallel path inline %.3f ms\n", capture_ms, parallel_capture_ms);
+        }
+
+        TEMP_VALUE_POOL_END;
+    }
+
+    thread_pool_shutdown(pool);
+    thread_pool_shutdown(serial_pool);
+
+    TEMP_VALUE_POOL_END;
+}
+
+void graph_replay_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "graph_replay_test: \n");
+
+    ThreadPool pool;
+    thread_pool_init(pool, (int)std::thread::hardware_concurrency() > 0 ? (int)std::thread::hardware_concurrency() : 1);
+
+    MLP mlp;
+    demo_mlp(mlp, { 4, 4, 1 });
+
+    float input_data[4][3] = {
+        { 2.f, 3.f, -1.f },
+        { 3.f, -1.f, 0.5f },
+        { 0.5f, 1.f, 1.f },
+        { 1.f, 1.f, -1.f },
+    };
+    float expect_data[4] = { 1.f, -1.f, -1.f, 1.f };
+
+    // build the loss graph once, every iteration only replays it
+    std::vector<ValueHandle> prediction_set;
+    std::vector<ValueHandle> expect_set;
+    for (int i = 0; i < 4; i++)
+    {
+        std::vector<ValueHandle> input;
+        for (int j = 0; j < 3; j++)
+        {
+            input.push_back(create_value(input_data[i][j]));
+        }
+        prediction_set.push_back(mlp_forward(mlp, input).back());
+        expect_set.push_back(create_value(expect_data[i]));
+    }
+    ValueHandle loss = mean_squared_error(prediction_set, expect_set);
+
+    Graph graph;
+    graph_capture(graph, loss);
+
+    Optimizer optimizer;
+    optimizer_init(optimizer, OptimizerType::SGD, mlp_parameters(mlp), 0.05f);
+
+    for (int g = 0; g < 50; g++)
+    {
+        graph_forward(graph, pool);
+        if (g % 10 == 0) fprintf(stdout, "iteration %d, loss: %.5f\n", g, get_value(loss)->data);
+        graph_zero_grad(graph);
+        graph_backward(graph, pool);
+        optimizer_step(optimizer);
+    }
+    graph_forward(graph, pool);
+    fprintf(stdout, "final loss: %.5f\n", get_value(loss)->data);
+
+    thread_pool_shutdown(pool);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void bytecode_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "bytecode_test: \n");
+
+    ThreadPool serial_pool;
+    thread_pool_init(serial_pool, 1);
+
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 16, 16, 1 });
+
+    ValueHandle loss = demo_loss(mlp, 32);
+
+    Graph graph;
+    graph_capture(graph, loss);
+    BytecodeProgram program;
+    bytecode_compile(program, graph);
+    fprintf(stdout, "instructions %d, leaves %d, code %d bytes\n",
+        program.instruction_count, program.leaf_count, (int)(program.code.size() * sizeof(uint32_t)));
+
+    // the interpreter has to reproduce the tape bit for bit
+    graph_zero_grad(graph);
+    backward(loss);
+    std::vector<float> reference;
+    for (int i = 0; i < parameters.size(); i++)
+    {
+        reference.push_back(get_value(parameters[i])->gradient);
+    }
+    float reference_loss = get_value(loss)->data;
+    graph_zero_grad(graph);
+    bytecode_forward(program);
+    bytecode_backward(program);
+    std::vector<float> gradient;
+    for (int i = 0; i < parameters.size(); i++)
+    {
+        gradient.push_back(get_value(parameters[i])->gradient);
+    }
+    bool identical = memcmp(gradient.data(), reference.data(), gradient.size() * sizeof(float)) == 0;
+    fprintf(stdout, "loss %.5f / %.5f, gradients bit identical to backward: %s\n",
+        get_value(loss)->data, reference_loss, identical ? "yes" : "no");
+    assert(identical);
+
+    const int repeat = 200;
+    double ms[2];
+    for (int p = 0; p < 2; p++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeat; r++)
+        {
+            graph_zero_grad(graph);
+            if (p == 0)
+            {
+                graph_forward(graph, serial_pool);
+                graph_backward(graph, serial_pool);
+            }
+            else
+            {
+                bytecode_forward(program);
+                bytecode_backward(program);
+            }
+        }
+        auto stop = std::chrono::steady_clock::now();
+        ms[p] = std::chrono::duration<double, std::milli>(stop - start).count() / repeat;
+    }
+    fprintf(stdout, "graph replay %.3f ms, bytecode %.3f ms (%.2fx)\n", ms[0], ms[1], ms[0] / ms[1]);
+
+    Optimizer optimizer;
+    // the loss sums 32 samples, the step is sized for that sum
+    optimizer_init(optimizer, OptimizerType::SGD, parameters, 0.05f / 32);
+    float initial_loss = 0.f;
+    for (int g = 0; g < 50; g++)
+    {
+        graph_zero_grad(graph);
+        bytecode_forward(program);
+        if (g == 0) initial_loss = get_value(loss)->data;
+        if (g % 10 == 0) fprintf(stdout, "iteration %d, loss: %.5f\n", g, get_value(loss)->data);
+        bytecode_backward(program);
+        optimizer_step(optimizer);
+    }
+    bytecode_forward(program);
+    fprintf(stdout, "final loss: %.5f\n", get_value(loss)->data);
+    assert(get_value(loss)->data < initial_loss);
+
+    thread_pool_shutdown(serial_pool);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void codegen_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "codegen_test: \n");
+
+    MLP mlp;
+    demo_mlp(mlp, { 4, 4, 1 });
+
+    float input_data[4][3] = {
+        { 2.f, 3.f, -1.f },
+        { 3.f, -1.f, 0.5f },
+        { 0.5f, 1.f, 1.f },
+        { 1.f, 1.f, -1.f },
+    };
+    float expect_data[4] = { 1.f, -1.f, -1.f, 1.f };
+
+    // parameters and inputs stay variables, expectations and literals are folded
+    std::vector<ValueHandle> variables = mlp_parameters(mlp);
+    std::vector<ValueHandle> prediction_set;
+    std::vector<ValueHandle> expect_set;
+    for (int i = 0; i < 4; i++)
+    {
+        std::vector<ValueHandle> input;
+        for (int j = 0; j < 3; j++)
+        {
+            input.push_back(create_value(input_data[i][j]));
+            variables.push_back(input.back());
+        }
+        prediction_set.push_back(mlp_forward(mlp, input).back());
+        expect_set.push_back(create_value(expect_data[i]));
+    }
+    ValueHandle loss = mean_squared_error(prediction_set, expect_set);
+    std::vector<ValueHandle> parameters = mlp_parameters(mlp);
+
+    Graph graph;
+    graph_capture(graph, loss);
+    BytecodeProgram interpreted;
+    bytecode_compile(interpreted, graph);
+    BytecodeProgram compiled;
+    bytecode_compile(compiled, graph);
+
+    void* library = codegen_build(compiled, variables, "codegen_mlp", "codegen_mlp");
+    if (!library)
+    {
+        fprintf(stdout, "no toolchain, skipped\n");
+    }
+    else
+    {
+        // the interpreter is the reference, the kernels have to match it bit for bit
+        std::vector<float> reference;
+        graph_zero_grad(graph);
+        bytecode_forward(interpreted);
+        float reference_loss = get_value(loss)->data;
+        bytecode_backward(interpreted);
+        for (int i = 0; i < parameters.size(); i++)
+        {
+            reference.push_back(get_value(parameters[i])->gradient);
+        }
+        std::vector<float> gradient;
+        graph_zero_grad(graph);
+        bytecode_forward(compiled);
+        bytecode_backward(compiled);
+        for (int i = 0; i < parameters.size(); i++)
+        {
+            gradient.push_back(get_value(parameters[i])->gradient);
+        }
+        bool identical = memcmp(gradient.data(), reference.data(), gradient.size() * sizeof(float)) == 0;
+        fprintf(stdout, "loss %.5f / %.5f, gradients bit identical to the interpreter: %s\n",
+            get_value(loss)->data, reference_loss, identical ? "yes" : "no");
+        assert(identical);
+
+        const int repeat = 10000;
+        double us[2];
+        BytecodeProgram* programs[2] = { &interpreted, &compiled };
+        for (int p = 0; p < 2; p++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            for (int r = 0; r < repeat; r++)
+            {
+                graph_zero_grad(graph);
+                bytecode_forward(*programs[p]);
+                bytecode_backward(*programs[p]);
+            }
+            auto stop = std::chrono::steady_clock::now();
+            us[p] = std::chrono::duration<double, std::micro>(stop - start).count() / repeat;
+        }
+        fprintf(stdout, "bytecode %.3f us, compiled %.3f us (%.2fx)\n", us[0], us[1], us[0] / us[1]);
+
+        Optimizer optimizer;
+        optimizer_init(optimizer, OptimizerType::SGD, parameters, 0.05f);
+        for (int g = 0; g < 50; g++)
+        {
+            graph_zero_grad(graph);
+            bytecode_forward(compiled);
+            if (g % 10 == 0) fprintf(stdout, "iteration %d, loss: %.5f\n", g, get_value(loss)->data);
+            bytecode_backward(compiled);
+            optimizer_step(optimizer);
+        }
+        bytecode_forward(compiled);
+        fprintf(stdout, "final loss: %.5f\n", get_value(loss)->data);
+
+        codegen_unload(compiled, library);
+    }
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void fixed_mlp_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "fixed_mlp_test: \n");
+
+    std::vector<std::vector<float>> input = {
+        { 2.f, 3.f, -1.f },
+        { 3.f, -1.f, 0.5f },
+        { 0.5f, 1.f, 1.f },
+        { 1.f, 1.f, -1.f },
+    };
+    std::vector<std::vector<float>> expect = { { 1.f }, { -1.f }, { -1.f }, { 1.f } };
+
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 4, 4, 1 });
+
+    // weights travel through the parameter file
+    FixedMLP<3, 4, 4, 1> fixed;
+    bool loaded = mlp_save(mlp, "mlp_parameters.bin") && fixed_mlp_load(fixed, "mlp_parameters.bin");
+    fprintf(stdout, "%d parameters, loaded from the dynamic mlp: %s\n", FixedMLP<3, 4, 4, 1>::parameter_count, loaded ? "yes" : "no");
+
+    // squared error of one sample, forward and gradients have to match bit for bit
+    int forward_mismatch = 0;
+    int gradient_mismatch = 0;
+    for (int s = 0; s < input.size(); s++)
+    {
+        TEMP_VALUE_POOL_START;
+
+        std::vector<ValueHandle> x;
+        for (int j = 0; j < 3; j++)
+        {
+            x.push_back(create_value(input[s][j]));
+        }
+        ValueHandle prediction = mlp_forward(mlp, x).back();
+        ValueHandle loss = mean_squared_error({ prediction }, { create_value(expect[s][0]) });
+        mlp_zero_grad(mlp);
+        backward(loss);
+
+        const std::array<float, 1>& output = fixed_mlp_forward(fixed, { input[s][0], input[s][1], input[s][2] });
+        fixed_mlp_zero_grad(fixed);
+        fixed_mlp_backward(fixed, { 2.f * (output[0] - expect[s][0]) });
+
+        if (output[0] != get_value(prediction)->data) forward_mismatch++;
+        std::vector<float> gradient;
+        fixed_mlp_for_each_layer(fixed, [&gradient](auto& layer) {
+            for (int j = 0; j < layer.gradient.size(); j++)
+            {
+                gradient.insert(gradient.end(), layer.gradient[j].begin(), layer.gradient[j].end());
+            }
+        });
+        for (int i = 0; i < parameters.size(); i++)
+        {
+            if (gradient[i] != get_value(parameters[i])->gradient) gradient_mismatch++;
+        }
+
+        TEMP_VALUE_POOL_END;
+    }
+    fprintf(stdout, "forward mismatches %d, gradient mismatches %d\n", forward_mismatch, gradient_mismatch);
+    assert(loaded && forward_mismatch == 0 && gradient_mismatch == 0);
+
+    const int repeat = 100000;
+    double ns[2];
+    float checksum = 0.f;
+    for (int p = 0; p < 2; p++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeat; r++)
+        {
+            std::vector<float>& sample = input[r % input.size()];
+            if (p == 0)
+            {
+                TEMP_VALUE_POOL_START;
+                std::vector<ValueHandle> x = { create_value(sample[0]), create_value(sample[1]), create_value(sample[2]) };
+                checksum += get_value(mlp_forward(mlp, x).back())->data;
+                TEMP_VALUE_POOL_END;
+            }
+            else
+            {
+                checksum += fixed_mlp_forward(fixed, { sample[0], sample[1], sample[2] })[0];
+            }
+        }
+        auto stop = std::chrono::steady_clock::now();
+        ns[p] = std::chrono::duration<double, std::nano>(stop - start).count() / repeat;
+    }
+    fprintf(stdout, "forward latency dynamic %.1f ns, fixed %.1f ns (%.2fx), checksum %.3f\n", ns[0], ns[1], ns[0] / ns[1], checksum);
+
+    // train the fixed twin, then hand the weights back to the dynamic mlp
+    for (int g = 0; g < 50; g++)
+    {
+        fixed_mlp_zero_grad(fixed);
+        float loss = 0.f;
+        for (int s = 0; s < input.size(); s++)
+        {
+            const std::array<float, 1>& output = fixed_mlp_forward(fixed, { input[s][0], input[s][1], input[s][2] });
+            float error = output[0] - expect[s][0];
+            loss += error * error;
+            fixed_mlp_backward(fixed, { 2.f * error });
+        }
+        if (g % 10 == 0) fprintf(stdout, "iteration %d, loss: %.5f\n", g, loss);
+        fixed_mlp_sgd_step(fixed, 0.05f);
+    }
+    loaded = fixed_mlp_save(fixed, "mlp_parameters.bin") && mlp_load(mlp, "mlp_parameters.bin");
+    fprintf(stdout, "saved back: %s, dynamic mlp loss: %.5f\n", loaded ? "yes" : "no", mlp_loss(mlp, input, expect));
+
+    // a tensor mlp hands over the same neuron order, forward agrees up to the matmul's summation order
+    MLP tensor_mlp;
+    mlp_init_tensor(tensor_mlp, 3, { 4, 4, 1 });
+    FixedMLP<3, 4, 4, 1> tensor_fixed;
+    bool copied = fixed_mlp_from_mlp(tensor_fixed, tensor_mlp) && fixed_mlp_parameters(tensor_fixed) == mlp_parameter_data(tensor_mlp);
+    float max_diff = 0.f;
+    {
+        TEMP_VALUE_POOL_START;
+        std::vector<float> x;
+        for (int s = 0; s < input.size(); s++)
+        {
+            x.insert(x.end(), input[s].begin(), input[s].end());
+        }
+        Tensor* output = get_tensor(mlp_forward_tensor(tensor_mlp, create_tensor({ (int)input.size(), 3 }, x.data())));
+        for (int s = 0; s < input.size(); s++)
+        {
+            max_diff = fmaxf(max_diff, fabsf(output->data[s] - fixed_mlp_forward(tensor_fixed, { input[s][0], input[s][1], input[s][2] })[0]));
+        }
+        TEMP_VALUE_POOL_END;
+    }
+    fprintf(stdout, "copied from a tensor mlp: %s, max forward diff %g\n", copied ? "yes" : "no", max_diff);
+    assert(copied && max_diff < 1e-5f);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void passes_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "passes_test: \n");
+
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 16, 16, 1 });
+
+    // inputs are fixed for this graph, only the parameters stay variables. a scaled and
+    // shifted loss, the kind of literal arithmetic the passes clean up
+    ValueHandle loss = pow(demo_loss(mlp, 32) * 0.5f * 2.f + 0.f, 1.f);
+
+    Graph graph;
+    graph_capture(graph, loss);
+    BytecodeProgram reference;
+    bytecode_compile(reference, graph);
+
+    PassGraph pass_graph;
+    pass_capture(pass_graph, graph, parameters);
+    int node_count = (int)pass_graph.nodes.size();
+    PassManager manager;
+    pass_manager_init(manager, true);
+    bool verified = pass_manager_run(manager, pass_graph);
+    for (int p = 0; p < manager.passes.size(); p++)
+    {
+        fprintf(stdout, "%-32s rewrites %5d, nodes removed %5d\n", manager.passes[p].name,
+            manager.passes[p].rewrite_count, manager.passes[p].removed_count);
+    }
+    BytecodeProgram optimized;
+    pass_lower(pass_graph, optimized);
+    fprintf(stdout, "nodes %d -> %d, instructions %d -> %d, verified: %s\n", node_count, (int)pass_graph.nodes.size(),
+        reference.instruction_count, optimized.instruction_count, verified ? "yes" : "no");
+    assert(verified);
+
+    std::vector<float> reference_gradient;
+    graph_zero_grad(graph);
+    bytecode_forward(reference);
+    bytecode_backward(reference);
+    float reference_loss = get_value(loss)->data;
+    for (int i = 0; i < parameters.size(); i++)
+    {
+        reference_gradient.push_back(get_value(parameters[i])->gradient);
+    }
+    graph_zero_grad(graph);
+    bytecode_forward(optimized);
+    bytecode_backward(optimized);
+    float max_diff = 0.f;
+    for (int i = 0; i < parameters.size(); i++)
+    {
+        float diff = fabsf(get_value(parameters[i])->gradient - reference_gradient[i]);
+        if (diff > max_diff) max_diff = diff;
+    }
+    fprintf(stdout, "loss %.5f / %.5f, max gradient diff %g\n", get_value(loss)->data, reference_loss, max_diff);
+    assert(max_diff < 1e-4f);
+
+    const int repeat = 200;
+    double ms[2];
+    BytecodeProgram* programs[2] = { &reference, &optimized };
+    for (int p = 0; p < 2; p++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeat; r++)
+        {
+            graph_zero_grad(graph);
+            bytecode_forward(*programs[p]);
+            bytecode_backward(*programs[p]);
+        }
+        auto stop = std::chrono::steady_clock::now();
+        ms[p] = std::chrono::duration<double, std::milli>(stop - start).count() / repeat;
+    }
+    fprintf(stdout, "unoptimized %.3f ms, optimized %.3f ms (%.2fx)\n", ms[0], ms[1], ms[0] / ms[1]);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void cse_test()
+{
+    TEMP_VALUE_POOL_START;
+
+    fprintf(stdout, "cse_test: \n");
+
+    // engine_test_2's neuron written the careless way, exp(2 * n) spelled out twice
+    std::vector<ValueHandle> w = { create_value(-3.f), create_value(1.f) };
+    ValueHandle b = create_value(6.88137358702f);
+    std::vector<ValueHandle> variables = { w[0], w[1], b };
+    ValueHandle loss = create_value(0.f);
+    for (int i = 0; i < 256; i++)
+    {
+        ValueHandle x1 = create_value(g_dis(g_gen));
+        ValueHandle x2 = create_value(g_dis(g_gen));
+        ValueHandle n = x1 * w[0] + x2 * w[1] + b;
+        ValueHandle o = (exp(2 * n) - 1) / (exp(2 * n) + 1);
+        loss = loss + o * o;
+    }
+
+    Graph graph;
+    graph_capture(graph, loss);
+    BytecodeProgram reference;
+    bytecode_compile(reference, graph);
+
+    PassGraph pass_graph;
+    pass_capture(pass_graph, graph, variables);
+    int node_count = (int)pass_graph.nodes.size();
+    PassManager manager;
+    pass_manager_add(manager, "eliminate common subexpressions", pass_eliminate_common_subexpressions);
+    manager.verify = true;
+    bool verified = pass_manager_run(manager, pass_graph);
+    BytecodeProgram optimized;
+    pass_lower(pass_graph, optimized);
+    fprintf(stdout, "merged %d nodes, %d nodes removed, nodes %d -> %d, verified: %s\n",
+        manager.passes[0].rewrite_count, manager.passes[0].removed_count, node_count, (int)pass_graph.nodes.size(), verified ? "yes" : "no");
+    assert(verified);
+
+    float result[2][3];
+    BytecodeProgram* programs[2] = { &reference, &optimized };
+    double us[2];
+    for (int p = 0; p < 2; p++)
+    {
+        graph_zero_grad(graph);
+        bytecode_forward(*programs[p]);
+        bytecode_backward(*programs[p]);
+        for (int i = 0; i < 3; i++)
+        {
+            result[p][i] = get_value(variables[i])->gradient;
+        }
+
+        const int repeat = 1000;
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeat; r++)
+        {
+            graph_zero_grad(graph);
+            bytecode_forward(*programs[p]);
+            bytecode_backward(*programs[p]);
+        }
+        auto stop = std::chrono::steady_clock::now();
+        us[p] = std::chrono::duration<double, std::micro>(stop - start).count() / repeat;
+    }
+    fprintf(stdout, "w1 gradient %f / %f, w2 gradient %f / %f, b gradient %f / %f\n",
+        result[1][0], result[0][0], result[1][1], result[0][1], result[1][2], result[0][2]);
+    fprintf(stdout, "original %.2f us, merged %.2f us (%.2fx)\n", us[0], us[1], us[0] / us[1]);
+
+    TEMP_VALUE_POOL_END;
+}
+
+void batch_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "batch_test: \n");
+
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 16, 16, 1 });
+
+    // plain per sample code, nothing here knows about batching
+    ValueHandle loss = demo_loss(mlp, 64);
+
+    Graph graph;
+    graph_capture(graph, loss);
+    BytecodeProgram program;
+    bytecode_compile(program, graph);
+    BatchProgram batch;
+    batch_compile(batch, program);
+
+    int mode_count[4] = {};
+    for (int g = 0; g < batch.groups.size(); g++)
+    {
+        BatchGroup& group = batch.groups[g];
+        mode_count[group.mode[0]]++;
+        if (group.op == MathOperation::ADD || group.op == MathOperation::MULTIPLE) mode_count[group.mode[1]]++;
+    }
+    fprintf(stdout, "instructions %d, groups %d, %.1f lanes per group\n", program.instruction_count,
+        (int)batch.groups.size(), (float)program.instruction_count / batch.groups.size());
+    fprintf(stdout, "operands contiguous %d, broadcast %d, strided %d, gathered %d\n",
+        mode_count[BatchOperand::BATCH_CONTIGUOUS], mode_count[BatchOperand::BATCH_BROADCAST],
+        mode_count[BatchOperand::BATCH_STRIDED], mode_count[BatchOperand::BATCH_GATHER]);
+
+    std::vector<float> reference;
+    graph_zero_grad(graph);
+    bytecode_forward(program);
+    bytecode_backward(program);
+    float reference_loss = get_value(loss)->data;
+    for (int i = 0; i < parameters.size(); i++)
+    {
+        reference.push_back(get_value(parameters[i])->gradient);
+    }
+    graph_zero_grad(graph);
+    batch_forward(batch);
+    batch_backward(batch);
+    float max_diff = 0.f;
+    for (int i = 0; i < parameters.size(); i++)
+    {
+        float diff = fabsf(get_value(parameters[i])->gradient - reference[i]);
+        if (diff > max_diff) max_diff = diff;
+    }
+    fprintf(stdout, "loss %.5f / %.5f, max gradient diff %g\n", get_value(loss)->data, reference_loss, max_diff);
+    assert(max_diff < 1e-4f);
+
+    const int repeat = 200;
+    double ms[2];
+    for (int p = 0; p < 2; p++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeat; r++)
+        {
+            graph_zero_grad(graph);
+            if (p == 0)
+            {
+                bytecode_forward(program);
+                bytecode_backward(program);
+            }
+            else
+            {
+                batch_forward(batch);
+                batch_backward(batch);
+            }
+        }
+        auto stop = std::chrono::steady_clock::now();
+        ms[p] = std::chrono::duration<double, std::milli>(stop - start).count() / repeat;
+    }
+    fprintf(stdout, "bytecode %.3f ms, batched %.3f ms (%.2fx)\n", ms[0], ms[1], ms[0] / ms[1]);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void lazy_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "lazy_test: \n");
+
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 16, 16, 1 });
+
+    std::vector<std::vector<float>> input;
+    std::vector<std::vector<float>> expect;
+    demo_dataset(32, input, expect);
+    auto build = [&]() {
+        std::vector<ValueHandle> prediction_set;
+        std::vector<ValueHandle> expect_set;
+        for (int i = 0; i < input.size(); i++)
+        {
+            std::vector<ValueHandle> x = { create_value(input[i][0]), create_value(input[i][1]), create_value(input[i][2]) };
+            prediction_set.push_back(mlp_forward(mlp, x).back());
+            expect_set.push_back(create_value(expect[i][0]));
+        }
+        return mean_squared_error(prediction_set, expect_set);
+    };
+
+    int thread_count = (int)std::thread::hardware_concurrency();
+    if (thread_count < 1) thread_count = 1;
+    ThreadPool pool;
+    thread_pool_init(pool, thread_count);
+
+    // eager, lazy with the tape sweep and lazy on the level schedule have to agree bit for
+    // bit, only the moment and the order of computing differ. the fused sweep contracts
+    // multiply-adds and only has to agree up to rounding.
+    const char* names[] = { "eager", "lazy sweep", "lazy scheduled", "lazy fused" };
+    float loss_data[4];
+    std::vector<float> gradient[4];
+    double build_ms[4];
+    double evaluate_ms[4] = {};
+    for (int mode = 0; mode < 4; mode++)
+    {
+        TEMP_VALUE_POOL_START;
+
+        set_lazy_evaluation(mode > 0);
+        if (mode > 0) graph_lazy_init(mode == 2 ? &pool : NULL, mode == 3);
+        auto start = std::chrono::steady_clock::now();
+        ValueHandle loss = build();
+        auto built = std::chrono::steady_clock::now();
+        int pending = g_value_pool->value_count - g_value_pool->evaluated_count;
+        if (mode == 1)
+        {
+            fprintf(stdout, "lazy: %d values pending after building the graph\n", pending);
+        }
+        // a fresh leaf is read and written without evaluating the tape
+        get_value(create_value(0.f))->data = 1.f;
+        if (mode > 0) assert(g_value_pool->value_count - g_value_pool->evaluated_count == pending + 1);
+
+        auto evaluate_start = std::chrono::steady_clock::now();
+        loss_data[mode] = get_value(loss)->data;
+        auto evaluated = std::chrono::steady_clock::now();
+        build_ms[mode] = std::chrono::duration<double, std::milli>(built - start).count();
+        evaluate_ms[mode] = std::chrono::duration<double, std::milli>(evaluated - evaluate_start).count();
+
+        mlp_zero_grad(mlp);
+        backward(loss);
+        for (int i = 0; i < parameters.size(); i++)
+        {
+            gradient[mode].push_back(get_value(parameters[i])->gradient);
+        }
+        graph_lazy_shutdown();
+        set_lazy_evaluation(false);
+
+        TEMP_VALUE_POOL_END;
+    }
+    fprintf(stdout, "%-14s loss %.5f, build %.3f ms\n", names[0], loss_data[0], build_ms[0]);
+    if (thread_pool_worker_count(pool) == 1)
+    {
+        fprintf(stdout, "one worker, lazy scheduled takes the sweep\n");
+    }
+    for (int mode = 1; mode < 4; mode++)
+    {
+        bool identical = loss_data[0] == loss_data[mode]
+            && memcmp(gradient[0].data(), gradient[mode].data(), gradient[0].size() * sizeof(float)) == 0;
+        float max_diff = fabsf(loss_data[0] - loss_data[mode]) / fmaxf(1.f, fabsf(loss_data[0]));
+        for (int i = 0; i < gradient[0].size(); i++)
+        {
+            max_diff = fmaxf(max_diff, fabsf(gradient[0][i] - gradient[mode][i]) / fmaxf(1.f, fabsf(gradient[0][i])));
+        }
+        fprintf(stdout, "%-14s loss %.5f, build %.3f ms + evaluate %.3f ms, bit identical to eager: %s, max relative diff %g\n",
+            names[mode], loss_data[mode], build_ms[mode], evaluate_ms[mode], identical ? "yes" : "no", max_diff);
+        assert(mode == 3 ? max_diff < 1e-4f : identical);
+    }
+    thread_pool_shutdown(pool);
+
+    // a pending graph can be optimized and replayed as a whole before anything is computed
+    {
+        TEMP_VALUE_POOL_START;
+
+        set_lazy_evaluation(true);
+        ValueHandle loss = build();
+        Graph graph;
+        graph_capture(graph, loss);
+        PassGraph pass_graph;
+        pass_capture(pass_graph, graph, parameters);
+        PassManager manager;
+        pass_manager_init(manager);
+        pass_manager_run(manager, pass_graph);
+        BytecodeProgram program;
+        pass_lower(pass_graph, program);
+        bytecode_forward(program);
+        fprintf(stdout, "optimized replay of the pending graph: loss %.5f, %d values still pending\n",
+            bytecode_data(program, loss), g_value_pool->value_count - g_value_pool->evaluated_count);
+        set_lazy_evaluation(false);
+
+        TEMP_VALUE_POOL_END;
+    }
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void incremental_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "incremental_test: \n");
+
+    ThreadPool serial_pool;
+    thread_pool_init(serial_pool, 1);
+
+    MLP mlp;
+    demo_mlp(mlp, { 16, 16, 1 });
+
+    const int sample_count = 64;
+    std::vector<ValueHandle> inputs;
+    ValueHandle loss = demo_loss(mlp, sample_count, &inputs);
+
+    Graph graph;
+    graph_capture(graph, loss);
+    IncrementalEvaluator evaluator;
+    incremental_init(evaluator, graph);
+
+    // single feature updates, incremental against a full recompute of the same graph
+    const int repeat = 2000;
+    std::vector<int> samples;
+    std::vector<int> features;
+    std::vector<float> values;
+    std::vector<float> original;
+    for (int i = 0; i < inputs.size(); i++)
+    {
+        original.push_back(get_value(inputs[i])->data);
+    }
+    for (int r = 0; r < repeat; r++)
+    {
+        samples.push_back((int)(g_gen() % sample_count));
+        features.push_back((int)(g_gen() % 3));
+        values.push_back(g_dis(g_gen));
+    }
+
+    double us[2];
+    long long recompute_total = 0;
+    float final_loss[2];
+    for (int p = 0; p < 2; p++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeat; r++)
+        {
+            ValueHandle x = inputs[samples[r] * 3 + features[r]];
+            if (p == 0)
+            {
+                get_value(x)->data = values[r];
+                graph_forward(graph, serial_pool);
+            }
+            else
+            {
+                incremental_set(evaluator, x, values[r]);
+                incremental_forward(evaluator);
+                recompute_total += evaluator.recompute_count;
+            }
+        }
+        auto stop = std::chrono::steady_clock::now();
+        us[p] = std::chrono::duration<double, std::micro>(stop - start).count() / repeat;
+        final_loss[p] = get_value(loss)->data;
+
+        // rewind the inputs so both runs see the same sequence
+        for (int i = 0; i < inputs.size(); i++)
+        {
+            get_value(inputs[i])->data = original[i];
+        }
+        graph_forward(graph, serial_pool);
+    }
+    fprintf(stdout, "nodes %d, recomputed %.1f per update\n", (int)graph.level_nodes.size(), (double)recompute_total / repeat);
+    fprintf(stdout, "loss full %.5f, incremental %.5f, identical: %s\n", final_loss[0], final_loss[1], final_loss[0] == final_loss[1] ? "yes" : "no");
+    assert(final_loss[0] == final_loss[1]);
+    fprintf(stdout, "full recompute %.2f us, incremental %.2f us (%.2fx)\n", us[0], us[1], us[0] / us[1]);
+
+    // a feature whose every weight is zero changes nothing past the first multiplies
+    Layer* first = get_layer(mlp.layers[0]);
+    for (int j = 0; j < first->neurons.size(); j++)
+    {
+        get_value(get_neuron(first->neurons[j])->parameters[0])->data = 0.f;
+    }
+    graph_forward(graph, serial_pool);
+    incremental_set(evaluator, inputs[0], 0.5f);
+    incremental_forward(evaluator);
+    fprintf(stdout, "dead feature update: recomputed %d, changed %d\n", evaluator.recompute_count, evaluator.changed_count);
+
+    thread_pool_shutdown(serial_pool);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void bucketed_backward_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "bucketed_backward_test: \n");
+
+    ThreadPool serial_pool;
+    thread_pool_init(serial_pool, 1);
+
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 16, 16, 1 });
+
+    ValueHandle loss = demo_loss(mlp, 64);
+
+    Graph graph;
+    graph_capture(graph, loss);
+    int bucket_count = 0;
+    for (int b = 0; b + 1 < graph.bucket_offsets.size(); b++)
+    {
+        if (graph.bucket_offsets[b + 1] > graph.bucket_offsets[b]) bucket_count++;
+    }
+    fprintf(stdout, "nodes %d, levels %d, non empty buckets %d\n", (int)graph.level_nodes.size(), graph_level_count(graph), bucket_count);
+
+    std::vector<float> reference;
+    graph_zero_grad(graph);
+    backward(loss);
+    for (int i = 0; i < parameters.size(); i++)
+    {
+        reference.push_back(get_value(parameters[i])->gradient);
+    }
+
+    const char* names[] = { "tape", "node by node", "bucketed" };
+    const int repeat = 100;
+    for (int p = 0; p < 3; p++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeat; r++)
+        {
+            graph_zero_grad(graph);
+            if (p == 0) backward(loss);
+            else if (p == 1) graph_backward(graph, serial_pool);
+            else graph_backward_bucketed(graph);
+        }
+        auto stop = std::chrono::steady_clock::now();
+        float max_diff = 0.f;
+        for (int i = 0; i < parameters.size(); i++)
+        {
+            float diff = fabsf(get_value(parameters[i])->gradient - reference[i]);
+            if (diff > max_diff) max_diff = diff;
+        }
+        fprintf(stdout, "%-12s %.3f ms, max gradient diff %g\n", names[p],
+            std::chrono::duration<double, std::milli>(stop - start).count() / repeat, max_diff);
+        // node by node pulls in tape order, the buckets regroup the sums
+        assert(p < 2 ? max_diff == 0.f : max_diff < 1e-5f);
+    }
+
+    thread_pool_shutdown(serial_pool);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void adjacency_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "adjacency_test: \n");
+
+    ThreadPool serial_pool;
+    thread_pool_init(serial_pool, 1);
+
+    MLP mlp;
+    demo_mlp(mlp, { 16, 16, 1 });
+
+    ValueHandle loss = demo_loss(mlp, 64);
+
+    Graph graph;
+    graph_capture(graph, loss);
+    GraphAdjacency& adjacency = graph.adjacency;
+    for (int i = 0; i < graph.reachable.size(); i++)
+    {
+        if (!graph.reachable[i]) continue;
+        Value* value = get_value(ValueHandle{ .idx = i });
+        assert(graph_producer_count(adjacency, i) == value->input.size());
+        for (int j = 0; j < value->input.size(); j++)
+        {
+            assert(adjacency.producers[adjacency.producer_offsets[i] + j] == value->input[j].idx);
+        }
+    }
+    fprintf(stdout, "nodes %d, producer edges %d, consumer edges %d\n", (int)graph.level_nodes.size(),
+        (int)adjacency.producers.size(), (int)adjacency.consumers.size());
+
+    // forward replay through the per value input vectors against the flat rows
+    std::vector<int>& order = graph.forward_schedule.order;
+    const int repeat = 100;
+    auto start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeat; r++)
+    {
+        for (int k = 0; k < order.size(); k++)
+        {
+            calc_data(ValueHandle{ .idx = order[k] });
+        }
+    }
+    auto middle = std::chrono::steady_clock::now();
+    float loss_vectors = get_value(loss)->data;
+    get_value(loss)->data = 0.f;
+    for (int r = 0; r < repeat; r++)
+    {
+        graph_forward(graph, serial_pool);
+    }
+    auto stop = std::chrono::steady_clock::now();
+    float loss_rows = get_value(loss)->data;
+    double vector_ms = std::chrono::duration<double, std::milli>(middle - start).count() / repeat;
+    double row_ms = std::chrono::duration<double, std::milli>(stop - middle).count() / repeat;
+    fprintf(stdout, "forward via inputs %.3f ms, via adjacency %.3f ms (%.2fx), identical: %s\n", vector_ms, row_ms,
+        vector_ms / row_ms, memcmp(&loss_vectors, &loss_rows, sizeof(float)) == 0 ? "yes" : "no");
+    assert(memcmp(&loss_vectors, &loss_rows, sizeof(float)) == 0);
+
+    thread_pool_shutdown(serial_pool);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void plan_cache_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "plan_cache_test: \n");
+
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 8, 8, 1 });
+
+    PlanCache cache;
+    plan_cache_init(cache);
+    PlanCache small_cache;
+    plan_cache_init(small_cache, 2);
+
+    // train on two batch sizes and evaluate on a third, a fresh tape every step
+    const int batch_sizes[] = { 16, 32, 16, 32, 64 };
+    const int step_count = 30;
+    double rebuild_ms = 0.0;
+    double cached_ms = 0.0;
+    float max_error = 0.f;
+    for (int step = 0; step < step_count; step++)
+    {
+        TEMP_VALUE_POOL_START;
+
+        int batch_size = batch_sizes[step % 5];
+        std::vector<ValueHandle> variables = parameters;
+        ValueHandle loss = demo_loss(mlp, batch_size, &variables, &variables);
+        float tape_loss = get_value(loss)->data;
+
+        auto start = std::chrono::steady_clock::now();
+        {
+            ExecutionPlan plan;
+            plan_build(cache, plan, loss, variables);
+            bytecode_forward(plan.program);
+            bytecode_backward(plan.program);
+        }
+        auto middle = std::chrono::steady_clock::now();
+        ExecutionPlan* plan = plan_cache_get(cache, loss, variables);
+        bytecode_forward(plan->program);
+        bytecode_backward(plan->program);
+        auto stop = std::chrono::steady_clock::now();
+        plan_cache_get(small_cache, loss, variables);
+
+        rebuild_ms += std::chrono::duration<double, std::milli>(middle - start).count();
+        cached_ms += std::chrono::duration<double, std::milli>(stop - middle).count();
+        max_error = fmaxf(max_error, fabsf(get_value(loss)->data - tape_loss) / fmaxf(1.f, fabsf(tape_loss)));
+
+        TEMP_VALUE_POOL_END;
+    }
+
+    assert(cache.collision_count == 0);
+
+    // a plan whose key matches but whose structure does not is never replayed
+    {
+        TEMP_VALUE_POOL_START;
+
+        std::vector<ValueHandle> variables = parameters;
+        ValueHandle loss = demo_loss(mlp, 16, &variables, &variables);
+        ExecutionPlan* plan = plan_cache_get(small_cache, loss, variables);
+        plan->signature[plan->signature.size() / 2] ^= 1u;
+        int miss_count = small_cache.miss_count;
+        bool replaced = plan_cache_get(small_cache, loss, variables) != plan;
+        fprintf(stdout, "forged signature: collisions %d, rebuilt: %s\n", small_cache.collision_count, replaced ? "yes" : "no");
+        assert(small_cache.collision_count == 1 && small_cache.miss_count == miss_count + 1 && replaced);
+
+        TEMP_VALUE_POOL_END;
+    }
+
+    fprintf(stdout, "capacity %d: hits %d, misses %d, evictions %d\n", cache.capacity, cache.hit_count, cache.miss_count, cache.eviction_count);
+    fprintf(stdout, "capacity %d: hits %d, misses %d, evictions %d\n", small_cache.capacity, small_cache.hit_count, small_cache.miss_count, small_cache.eviction_count);
+    fprintf(stdout, "rebuild every step %.3f ms/step, cached plans %.3f ms/step (%.2fx), max loss error %g\n",
+        rebuild_ms / step_count, cached_ms / step_count, rebuild_ms / cached_ms, max_error);
+    assert(cache.miss_count == 3 && max_error < 1e-5f);
+
+    plan_cache_clear(cache);
+    plan_cache_clear(small_cache);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void memory_plan_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "memory_plan_test: \n");
+
+    // deep and narrow, few values are live at any point of the forward pass
+    MLP mlp;
+    std::vector<int> layer(11, 8);
+    layer.push_back(1);
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, layer);
+    evaluate_pending();
+    int persistent_count = g_value_pool->value_count;
+
+    ValueHandle loss = demo_loss(mlp, 4);
+    int tape_count = g_value_pool->value_count - persistent_count;
+    size_t tape_bytes = memory_tape_bytes(persistent_count, g_value_pool->value_count);
+
+    // the graph and the program only live while the plans are made
+    float reference_loss = 0.f;
+    std::vector<float> reference;
+    int register_count = 0;
+    size_t register_bytes = 0;
+    MemoryPlan inference;
+    MemoryPlan training;
+    {
+        Graph graph;
+        graph_capture(graph, loss);
+        BytecodeProgram program;
+        bytecode_compile(program, graph);
+
+        graph_zero_grad(graph);
+        bytecode_forward(program);
+        reference_loss = get_value(loss)->data;
+        bytecode_backward(program);
+        for (int i = 0; i < parameters.size(); i++)
+        {
+            reference.push_back(get_value(parameters[i])->gradient);
+        }
+        register_count = program.leaf_count + program.instruction_count;
+        register_bytes = (program.data.size() + program.gradient.size()) * sizeof(float) + program.code.size() * sizeof(uint32_t);
+
+        memory_plan(inference, program, false);
+        memory_plan(training, program, true);
+    }
+    fprintf(stdout, "tape %d values (%d KB), registers %d (%d KB with gradients and code)\n", tape_count,
+        (int)(tape_bytes / 1024), register_count, (int)(register_bytes / 1024));
+
+    get_value(loss)->data = 0.f;
+    memory_forward(inference);
+    float inference_loss = get_value(loss)->data;
+    fprintf(stdout, "inference plan: %d slots (%d temporaries), predicted peak %d KB, loss identical: %s\n",
+        inference.slot_count, inference.slot_count - inference.leaf_count, (int)(inference.peak_bytes / 1024),
+        memcmp(&inference_loss, &reference_loss, sizeof(float)) == 0 ? "yes" : "no");
+    assert(memcmp(&inference_loss, &reference_loss, sizeof(float)) == 0);
+
+    auto same_as_reference = [&](float training_loss) {
+        bool identical = memcmp(&training_loss, &reference_loss, sizeof(float)) == 0;
+        for (int i = 0; i < parameters.size(); i++)
+        {
+            float gradient = get_value(parameters[i])->gradient;
+            if (memcmp(&gradient, &reference[i], sizeof(float)) != 0) identical = false;
+        }
+        return identical;
+    };
+    mlp_zero_grad(mlp);
+    memory_forward(training);
+    memory_backward(training);
+    bool identical = same_as_reference(get_value(loss)->data);
+    fprintf(stdout, "training plan: %d slots (%d temporaries), %d gradient slots (%d temporaries), predicted peak %d KB, loss and gradients identical: %s\n",
+        training.slot_count, training.slot_count - training.leaf_count, training.gradient_slot_count,
+        training.gradient_slot_count - training.leaf_count, (int)(training.peak_bytes / 1024), identical ? "yes" : "no");
+    assert(identical);
+
+    // the batch inputs become constants of the plan and the tape goes back to the parameters,
+    // training steps from here on touch the plan and the persistent values only
+    memory_plan_detach(training, persistent_count);
+    g_value_pool->value_count = persistent_count;
+    mlp_zero_grad(mlp);
+    memory_forward(training);
+    memory_backward(training);
+    identical = same_as_reference(training.result);
+    assert(identical);
+
+    float first_loss = training.result;
+    const float learning_rate = 0.05f;
+    for (int step = 0; step < 20; step++)
+    {
+        mlp_zero_grad(mlp);
+        memory_forward(training);
+        memory_backward(training);
+        for (int i = 0; i < parameters.size(); i++)
+        {
+            Value* parameter = get_value(parameters[i]);
+            parameter->data -= learning_rate * parameter->gradient;
+        }
+    }
+    memory_forward(training);
+    fprintf(stdout, "without the tape: %d values kept, bytes per step %d KB on the tape, %d KB planned (%.1fx less), identical: %s, loss %.4f -> %.4f\n",
+        g_value_pool->value_count, (int)(tape_bytes / 1024), (int)(training.peak_bytes / 1024),
+        (double)tape_bytes / training.peak_bytes, identical ? "yes" : "no", first_loss, training.result);
+    assert(training.result < first_loss);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void tensor_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "tensor_test: \n");
+
+    // the same network twice, neuron layers and tensor layers holding the same weights
+    MLP tensor_mlp;
+    mlp_init_tensor(tensor_mlp, 3, { 16, 16, 1 });
+    std::vector<ValueHandle> tensor_parameters = mlp_parameters(tensor_mlp);
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 16, 16, 1 });
+    std::vector<float> initial = mlp_parameter_data(tensor_mlp);
+    mlp_set_parameter_data(mlp, initial);
+
+    const int batch_size = 64;
+    std::vector<float> x(batch_size * 3);
+    std::vector<float> y(batch_size);
+    for (int i = 0; i < batch_size; i++)
+    {
+        for (int j = 0; j < 3; j++)
+        {
+            x[i * 3 + j] = g_dis(g_gen);
+        }
+        y[i] = x[i * 3] * x[i * 3 + 1] + x[i * 3 + 2] > 0.f ? 1.f : -1.f;
+    }
+
+    // same loss and gradients through scalar nodes and through tensor nodes
+    float loss_data[2];
+    int node_count[2];
+    int parameter_count[2] = { (int)parameters.size(), (int)tensor_parameters.size() };
+    double ms[2];
+    std::vector<float> gradient[2];
+    for (int p = 0; p < 2; p++)
+    {
+        TEMP_VALUE_POOL_START;
+
+        int first = g_value_pool->value_count;
+        auto start = std::chrono::steady_clock::now();
+        ValueHandle loss;
+        if (p == 0)
+        {
+            mlp_zero_grad(mlp);
+            std::vector<ValueHandle> prediction_set;
+            std::vector<ValueHandle> expect_set;
+            for (int i = 0; i < batch_size; i++)
+            {
+                std::vector<ValueHandle> input = { create_value(x[i * 3]), create_value(x[i * 3 + 1]), create_value(x[i * 3 + 2]) };
+                prediction_set.push_back(mlp_forward(mlp, input).back());
+                expect_set.push_back(create_value(y[i]));
+            }
+            loss = mean_squared_error(prediction_set, expect_set);
+        }
+        else
+        {
+            mlp_zero_grad(tensor_mlp);
+            ValueHandle input = create_tensor({ batch_size, 3 }, x.data());
+            ValueHandle expect = create_tensor({ batch_size, 1 }, y.data());
+            loss = mean_squared_error_tensor(mlp_forward_tensor(tensor_mlp, input), expect);
+        }
+        backward(loss);
+        auto stop = std::chrono::steady_clock::now();
+
+        if (p == 1)
+        {
+            // captures are scalar, a tensor graph is turned down and leaves the root alone
+            Graph graph;
+            bool captured = graph_capture(graph, loss);
+            BytecodeProgram program;
+            bytecode_compile(program, graph);
+            assert(!captured && graph.level_nodes.size() == 1 && program.instruction_count == 0);
+        }
+
+        loss_data[p] = get_value(loss)->data;
+        node_count[p] = g_value_pool->value_count - first;
+        ms[p] = std::chrono::duration<double, std::milli>(stop - start).count();
+        gradient[p] = mlp_parameter_data(p == 0 ? mlp : tensor_mlp, true);
+
+        TEMP_VALUE_POOL_END;
+    }
+
+    float max_diff = 0.f;
+    for (int i = 0; i < gradient[0].size(); i++)
+    {
+        max_diff = fmaxf(max_diff, fabsf(gradient[0][i] - gradient[1][i]));
+    }
+    fprintf(stdout, "scalar path: %d parameter + %d graph nodes, loss %.5f, %.3f ms forward + backward\n", parameter_count[0], node_count[0], loss_data[0], ms[0]);
+    fprintf(stdout, "tensor path: %d parameter + %d graph nodes, loss %.5f, %.3f ms forward + backward\n", parameter_count[1], node_count[1], loss_data[1], ms[1]);
+    fprintf(stdout, "max parameter gradient diff %g\n", max_diff);
+    assert(max_diff < 1e-3f);
+
+    // training: the optimizer steps tensor parameters element by element like scalar ones, and
+    // rewinding the value pool alone takes back the tensor records of every step
+    const int step_count = 20;
+    Optimizer optimizer[2];
+    optimizer_init(optimizer[0], OptimizerType::SGD, parameters, 0.001f);
+    optimizer_init(optimizer[1], OptimizerType::SGD, tensor_parameters, 0.001f);
+    int tensor_count = -1;
+    for (int step = 0; step < step_count; step++)
+    {
+        TEMP_VALUE_POOL_START;
+        optimizer_zero_grad(optimizer[0]);
+        std::vector<ValueHandle> prediction_set;
+        std::vector<ValueHandle> expect_set;
+        for (int i = 0; i < batch_size; i++)
+        {
+            std::vector<ValueHandle> input = { create_value(x[i * 3]), create_value(x[i * 3 + 1]), create_value(x[i * 3 + 2]) };
+            prediction_set.push_back(mlp_forward(mlp, input).back());
+            expect_set.push_back(create_value(y[i]));
+        }
+        mlp_backward(mlp, mean_squared_error(prediction_set, expect_set), optimizer[0]);
+        TEMP_VALUE_POOL_END;
+
+        TEMP_VALUE_POOL_START;
+        optimizer_zero_grad(optimizer[1]);
+        ValueHandle input = create_tensor({ batch_size, 3 }, x.data());
+        ValueHandle expect = create_tensor({ batch_size, 1 }, y.data());
+        mlp_backward(tensor_mlp, mean_squared_error_tensor(mlp_forward_tensor(tensor_mlp, input), expect), optimizer[1]);
+        if (step == 0) tensor_count = g_tensor_pool.tensor_count;
+        assert(g_tensor_pool.tensor_count == tensor_count);
+        TEMP_VALUE_POOL_END;
+    }
+    std::vector<float> trained[2] = { mlp_parameter_data(mlp), mlp_parameter_data(tensor_mlp) };
+    max_diff = 0.f;
+    for (int i = 0; i < trained[0].size(); i++)
+    {
+        max_diff = fmaxf(max_diff, fabsf(trained[0][i] - trained[1][i]));
+    }
+    fprintf(stdout, "%d sgd steps: max parameter diff %g, %d tensor records in use every step\n", step_count, max_diff, tensor_count);
+    assert(max_diff < 1e-3f);
+
+    // 512 neurons wide, past MAX_NEURON_NUMBER, and 262k weights, past MAX_VALUE_NUMBER, as scalars
+    const int width = 512;
+    MLP wide_mlp;
+    mlp_init_tensor(wide_mlp, 3, { width, width, 1 });
+    Optimizer wide_optimizer;
+    optimizer_init(wide_optimizer, OptimizerType::ADAM, mlp_parameters(wide_mlp), 0.001f);
+    float wide_loss[2];
+    int wide_node_count = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int step = 0; step < step_count; step++)
+    {
+        TEMP_VALUE_POOL_START;
+        optimizer_zero_grad(wide_optimizer);
+        int first = g_value_pool->value_count;
+        ValueHandle input = create_tensor({ batch_size, 3 }, x.data());
+        ValueHandle expect = create_tensor({ batch_size, 1 }, y.data());
+        ValueHandle loss = mean_squared_error_tensor(mlp_forward_tensor(wide_mlp, input), expect);
+        mlp_backward(wide_mlp, loss, wide_optimizer);
+        if (step == 0) wide_loss[0] = get_value(loss)->data;
+        wide_loss[1] = get_value(loss)->data;
+        wide_node_count = g_value_pool->value_count - first;
+        TEMP_VALUE_POOL_END;
+    }
+    auto stop = std::chrono::steady_clock::now();
+    fprintf(stdout, "%d-%d-%d-1 tensor mlp: %d parameters in %d nodes + %d graph nodes, adam loss %.3f -> %.3f, %.3f ms per step\n",
+        3, width, width, (int)mlp_parameter_data(wide_mlp).size(), (int)wide_optimizer.slots.size(), wide_node_count, wide_loss[0], wide_loss[1],
+        std::chrono::duration<double, std::milli>(stop - start).count() / step_count);
+    assert(wide_loss[1] < wide_loss[0]);
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void tensor_view_test()
+{
+    TEMP_VALUE_POOL_START;
+
+    fprintf(stdout, "tensor_view_test: \n");
+
+    const int m = 4, k = 6, n = 5;
+    std::vector<float> a_data(m * k), b_data(m * n), bias_data(n);
+    for (int i = 0; i < a_data.size(); i++) a_data[i] = g_dis(g_gen);
+    for (int i = 0; i < b_data.size(); i++) b_data[i] = g_dis(g_gen);
+    for (int i = 0; i < bias_data.size(); i++) bias_data[i] = g_dis(g_gen);
+
+    // through views: a transposed operand, an explicit broadcast, a column slice and a
+    // reshape of that slice, which is not contiguous and gets copied
+    ValueHandle a = create_tensor({ m, k }, a_data.data());
+    ValueHandle b = create_tensor({ m, n }, b_data.data());
+    ValueHandle bias = create_tensor({ n }, bias_data.data());
+    ValueHandle at = tensor_transpose(a);
+    ValueHandle d = tensor_tanh(tensor_add(tensor_matmul(at, b), tensor_broadcast(bias, { k, n })));
+    ValueHandle slice = tensor_slice(a, 1, 2, 5);
+    ValueHandle flat = tensor_reshape(slice, { m * 3 });
+    ValueHandle loss = tensor_sum(d) + tensor_sum(tensor_pow(flat, 2.f));
+
+    // the same math on materialized copies
+    std::vector<float> at_data(k * m), slice_data(m * 3);
+    for (int i = 0; i < m; i++)
+    {
+        for (int j = 0; j < k; j++)
+        {
+            at_data[j * m + i] = a_data[i * k + j];
+            if (j >= 2 && j < 5) slice_data[i * 3 + j - 2] = a_data[i * k + j];
+        }
+    }
+    ValueHandle at_copy = create_tensor({ k, m }, at_data.data());
+    ValueHandle b_copy = create_tensor({ m, n }, b_data.data());
+    ValueHandle bias_copy = create_tensor({ n }, bias_data.data());
+    ValueHandle slice_copy = create_tensor({ m * 3 }, slice_data.data());
+    ValueHandle d_copy = tensor_tanh(tensor_add(tensor_matmul(at_copy, b_copy), bias_copy));
+    ValueHandle loss_copy = tensor_sum(d_copy) + tensor_sum(tensor_pow(slice_copy, 2.f));
+    // backward walks the whole tape, one pass covers both graphs
+    backward(loss + loss_copy);
+
+    float max_diff = fabsf(get_value(loss)->data - get_value(loss_copy)->data);
+    Tensor* ta = get_tensor(a);
+    Tensor* tat = get_tensor(at_copy);
+    Tensor* tslice = get_tensor(slice_copy);
+    for (int i = 0; i < m; i++)
+    {
+        for (int j = 0; j < k; j++)
+        {
+            float expect = tat->gradient[j * m + i] + (j >= 2 && j < 5 ? tslice->gradient[i * 3 + j - 2] : 0.f);
+            max_diff = fmaxf(max_diff, fabsf(ta->gradient[i * k + j] - expect));
+        }
+    }
+    for (int i = 0; i < m * n; i++)
+    {
+        max_diff = fmaxf(max_diff, fabsf(get_tensor(b)->gradient[i] - get_tensor(b_copy)->gradient[i]));
+    }
+    for (int i = 0; i < n; i++)
+    {
+        max_diff = fmaxf(max_diff, fabsf(get_tensor(bias)->gradient[i] - get_tensor(bias_copy)->gradient[i]));
+    }
+    fprintf(stdout, "transpose shares storage: %s, reshape of the slice copied: %s, reshape of a: %s\n",
+        get_tensor(at)->data == ta->data ? "yes" : "no",
+        get_tensor(g_value_pool->values[flat.idx].input[0])->op == TensorOperation::TENSOR_COPY ? "yes" : "no",
+        get_tensor(tensor_reshape(a, { k, m }))->op == TensorOperation::TENSOR_VIEW ? "view" : "copy");
+    fprintf(stdout, "loss %.5f, max diff against copies %g\n", get_value(loss)->data, max_diff);
+
+    // a view costs a node, a copy touches every element
+    const int size = 1024;
+    ValueHandle big = create_tensor({ size, size });
+    auto start = std::chrono::steady_clock::now();
+    ValueHandle big_t = tensor_transpose(big);
+    auto middle = std::chrono::steady_clock::now();
+    tensor_contiguous(big_t);
+    auto stop = std::chrono::steady_clock::now();
+    fprintf(stdout, "%dx%d transpose: view %.4f ms, contiguous copy %.4f ms\n", size, size,
+        std::chrono::duration<double, std::milli>(middle - start).count(),
+        std::chrono::duration<double, std::milli>(stop - middle).count());
+
+    TEMP_VALUE_POOL_END;
+}
+
+void gemm_test()
+{
+    fprintf(stdout, "gemm_test: \n");
+
+    int thread_count = (int)std::thread::hardware_concurrency();
+    if (thread_count < 1) thread_count = 1;
+    ThreadPool pool;
+    thread_pool_init(pool, thread_count);
+    GemmIsa detected = gemm_detect_isa();
+    fprintf(stdout, "detected isa %s, %d threads\n", g_gemm_kernels[detected].name, thread_count);
+
+    // ragged edges, more than one KC block, every transpose form through strides,
+    // accumulating into C, against a double reference
+    {
+        const int m = 131, n = 77, k = 300;
+        std::vector<float> a(m * k), b(k * n), c0(m * n), c(m * n);
+        for (int i = 0; i < a.size(); i++) a[i] = g_dis(g_gen);
+        for (int i = 0; i < b.size(); i++) b[i] = g_dis(g_gen);
+        for (int i = 0; i < c0.size(); i++) c0[i] = g_dis(g_gen);
+        for (int isa = 0; isa <= detected; isa++)
+        {
+            gemm_select_isa((GemmIsa)isa);
+            double max_error = 0.0;
+            for (int form = 0; form < 4; form++)
+            {
+                // A stored m x k or k x m, B stored k x n or n x k
+                int a_rs = form & 1 ? 1 : k, a_cs = form & 1 ? m : 1;
+                int b_rs = form & 2 ? 1 : n, b_cs = form & 2 ? k : 1;
+                c = c0;
+                gemm(m, n, k, a.data(), a_rs, a_cs, b.data(), b_rs, b_cs, c.data(), n, 1, true, &pool);
+                for (int i = 0; i < m; i++)
+                {
+                    for (int j = 0; j < n; j++)
+                    {
+                        double expect = c0[i * n + j];
+                        for (int p = 0; p < k; p++)
+                        {
+                            expect += (double)a[i * a_rs + p * a_cs] * b[p * b_rs + j * b_cs];
+                        }
+                        max_error = fmax(max_error, fabs(c[i * n + j] - expect) / (1.0 + fabs(expect)));
+                    }
+                }
+            }
+            fprintf(stdout, "%-9s max relative error over the transpose forms %g\n", g_gemm_kernels[isa].name, max_error);
+        }
+    }
+
+    // the loop tensor_matmul_forward used to run
+    auto naive = [](int m, int n, int k, const float* a, int a_rs, int a_cs, const float* b, float* c) {
+        for (int i = 0; i < m; i++)
+        {
+            float* row = c + i * n;
+            for (int j = 0; j < n; j++) row[j] = 0.f;
+            for (int p = 0; p < k; p++)
+            {
+                float x = a[i * a_rs + p * a_cs];
+                const float* w = b + p * n;
+                for (int j = 0; j < n; j++) row[j] += x * w[j];
+            }
+        }
+    };
+    // best of the runs that fit in about 0.1 s
+    auto gflops = [](int m, int n, int k, auto run) {
+        double best = 1e30;
+        double total = 0.0;
+        for (int r = 0; r < 50 && (r < 2 || total < 0.1); r++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            run();
+            auto stop = std::chrono::steady_clock::now();
+            double seconds = std::chrono::duration<double>(stop - start).count();
+            best = fmin(best, seconds);
+            total += seconds;
+        }
+        return 2.0 * m * n * k / best * 1e-9;
+    };
+
+    // square, skinny in each dimension, and the weight gradient dW = X^T * dY of a
+    // 2048 sample batch through a 512 x 512 layer, X read transposed through strides
+    struct GemmShape { const char* name; int m, n, k; bool transposed; };
+    GemmShape shapes[] = {
+        { "256^3", 256, 256, 256, false },
+        { "512^3", 512, 512, 512, false },
+        { "1024^3", 1024, 1024, 1024, false },
+        { "32x1024x1024", 32, 1024, 1024, false },
+        { "1024x32x1024", 1024, 32, 1024, false },
+        { "1024x1024x32", 1024, 1024, 32, false },
+        { "dW=X^T*dY", 512, 512, 2048, true },
+    };
+    fprintf(stdout, "GFLOP/s      %14s %9s", "shape", "naive");
+    for (int isa = 0; isa <= detected; isa++) fprintf(stdout, " %9s", g_gemm_kernels[isa].name);
+    fprintf(stdout, " %9s\n", "threaded");
+    for (int s = 0; s < sizeof(shapes) / sizeof(shapes[0]); s++)
+    {
+        GemmShape& shape = shapes[s];
+        int m = shape.m, n = shape.n, k = shape.k;
+        std::vector<float> a(m * k), b(k * n), c(m * n);
+        for (int i = 0; i < a.size(); i++) a[i] = g_dis(g_gen);
+        for (int i = 0; i < b.size(); i++) b[i] = g_dis(g_gen);
+        int a_rs = shape.transposed ? 1 : k, a_cs = shape.transposed ? m : 1;
+
+        fprintf(stdout, "             %14s %9.2f", shape.name, gflops(m, n, k, [&]() { naive(m, n, k, a.data(), a_rs, a_cs, b.data(), c.data()); }));
+        for (int isa = 0; isa <= detected; isa++)
+        {
+            gemm_select_isa((GemmIsa)isa);
+            fprintf(stdout, " %9.2f", gflops(m, n, k, [&]() { gemm(m, n, k, a.data(), a_rs, a_cs, b.data(), n, 1, c.data(), n, 1, false); }));
+        }
+        fprintf(stdout, " %9.2f\n", gflops(m, n, k, [&]() { gemm(m, n, k, a.data(), a_rs, a_cs, b.data(), n, 1, c.data(), n, 1, false, &pool); }));
+    }
+
+    gemm_select_isa(detected);
+    thread_pool_shutdown(pool);
+}
+
+void gradient_reduction_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "gradient_reduction_test: \n");
+
+    std::vector<std::vector<float>> input;
+    std::vector<std::vector<float>> expect;
+    demo_dataset(256, input, expect);
+
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 4, 4, 1 });
+
+    // learning rate 0, the step leaves the parameters alone and only the gradients are compared
+    Optimizer optimizer;
+    optimizer_init(optimizer, OptimizerType::SGD, parameters, 0.f);
+
+    const char* names[] = { "tree", "atomic" };
+    GradientReduction reductions[] = { GradientReduction::GRADIENT_REDUCE_TREE, GradientReduction::GRADIENT_REDUCE_ATOMIC };
+    std::vector<float> reference;
+    for (int r = 0; r < 2; r++)
+    {
+        for (int thread_count = 1; thread_count <= 4; thread_count++)
+        {
+            DataParallelTrainer trainer;
+            trainer_init(trainer, mlp, optimizer, thread_count);
+            trainer.reduction = reductions[r];
+            trainer_step(trainer, input, expect);
+            trainer_shutdown(trainer);
+
+            std::vector<float> gradient;
+            for (int i = 0; i < parameters.size(); i++)
+            {
+                gradient.push_back(get_value(parameters[i])->gradient);
+            }
+            if (reference.size() == 0) reference = gradient;
+
+            float max_diff = 0.f;
+            for (int i = 0; i < gradient.size(); i++)
+            {
+                float diff = fabsf(gradient[i] - reference[i]);
+                if (diff > max_diff) max_diff = diff;
+            }
+            bool identical = memcmp(gradient.data(), reference.data(), gradient.size() * sizeof(float)) == 0;
+            fprintf(stdout, "%-6s threads %d, bit identical to tree/1: %s, max diff: %g\n",
+                names[r], thread_count, identical ? "yes" : "no", max_diff);
+            if (reductions[r] == GradientReduction::GRADIENT_REDUCE_TREE) assert(identical);
+            else assert(max_diff < 1e-4f);
+        }
+    }
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+void pipeline_test()
+{
+    TEMP_VALUE_POOL_START;
+    TEMP_MLP_POOL_START;
+
+    fprintf(stdout, "pipeline_test: \n");
+
+    // every step gets its own deterministic batch, so all runs see the same data
+    BatchLoader loader = [](int step, std::vector<std::vector<float>>& input, std::vector<std::vector<float>>& expect) {
+        std::mt19937 gen(step);
+        demo_dataset(32, input, expect, gen);
+    };
+
+    MLP mlp;
+    std::vector<ValueHandle> parameters = demo_mlp(mlp, { 4, 4, 1 });
+    std::vector<float> initial_data = demo_parameter_data(parameters);
+
+    const int step_count = 40;
+    std::vector<float> sequential_loss;
+    std::vector<float> final_data[3];
+    for (int run = 0; run < 3; run++)
+    {
+        demo_set_parameter_data(parameters, initial_data);
+        Optimizer optimizer;
+        optimizer_init(optimizer, OptimizerType::ADAM, parameters, 0.01f);
+
+        std::vector<float> loss;
+        auto start = std::chrono::steady_clock::now();
+        if (run == 0)
+        {
+            for (int step = 0; step < step_count; step++)
+            {
+                std::vector<std::vector<float>> input;
+                std::vector<std::vector<float>> expect;
+                loader(step, input, expect);
+                optimizer_zero_grad(optimizer);
+                loss.push_back(mlp_accumulate_gradient(mlp, input, expect, 1));
+                optimizer_step(optimizer);
+            }
+            sequential_loss = loss;
+        }
+        else
+        {
+            TrainingPipeline pipeline;
+            pipeline_init(pipeline, mlp, optimizer, loader, NULL, run - 1);
+            loss = pipeline_run(pipeline, step_count);
+            pipeline_shutdown(pipeline);
+        }
+        auto stop = std::chrono::steady_clock::now();
+
+        for (int i = 0; i < parameters.size(); i++)
+        {
+            final_data[run].push_back(get_value(parameters[i])->data);
+        }
+        bool identical = memcmp(final_data[run].data(), final_data[0].data(), final_data[0].size() * sizeof(float)) == 0;
+
+        const char* names[] = { "sequential", "pipeline staleness 0", "pipeline staleness 1" };
+        fprintf(stdout, "%-22s loss first %.5f last %.5f, %.3f ms/step, parameters identical to sequential: %s\n",
+            names[run], loss.front() / 32, loss.back() / 32,
+            std::chrono::duration<double, std::milli>(stop - start).count() / step_count, identical ? "yes" : "no");
+        // staleness 1 steps on older gradients and is expected to drift
+        if (run < 2) assert(identical);
+    }
+
+    TEMP_MLP_POOL_END;
+    TEMP_VALUE_POOL_END;
+}
+
+int main()
+{
+    tensor_init();
+
+    engine_test_1();
+    fprintf(stdout, "\n\n");
+
+    engine_test_2();
+    fprintf(stdout, "\n\n");
+
+    engine_test_3();
+    fprintf(stdout, "\n\n");
+
+    mlp_test();
+    fprintf(stdout, "\n\n");
+
+    optimizer_test();
+    fprintf(stdout, "\n\n");
+
+    accumulate_test();
+    fprintf(stdout, "\n\n");
+
+    parallel_trainer_test();
+    fprintf(stdout, "\n\n");
+
+    hogwild_test();
+    fprintf(stdout, "\n\n");
+
+    gradient_reduction_test();
+    fprintf(stdout, "\n\n");
+
+    pipeline_test();
+    fprintf(stdout, "\n\n");
+
+    backward_parallel_test();
+    fprintf(stdout, "\n\n");
+
+    graph_replay_test();
+    fprintf(stdout, "\n\n");
+    bytecode_test();
+    fprintf(stdout, "\n\n");
+    codegen_test();
+    fprintf(stdout, "\n\n");
+    fixed_mlp_test();
+    fprintf(stdout, "\n\n");
+    passes_test();
+    fprintf(stdout, "\n\n");
+    cse_test();
+    fprintf(stdout, "\n\n");
+    batch_test();
+    fprintf(stdout, "\n\n");
+    lazy_test();
+    fprintf(stdout, "\n\n");
+    incremental_test();
+    fprintf(stdout, "\n\n");
+    bucketed_backward_test();
+    fprintf(stdout, "\n\n");
+    adjacency_test();
+    fprintf(stdout, "\n\n");
+    plan_cache_test();
+    fprintf(stdout, "\n\n");
+    memory_plan_test();
+    fprintf(stdout, "\n\n");
+    tensor_test();
+    fprintf(stdout, "\n\n");
+    tensor_view_test();
+    fprintf(stdout, "\n\n");
+    gemm_test();
 
     return 0;
 }
\ No newline at end of file
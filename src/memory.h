@@ -0,0 +1,314 @@
+#ifndef _MEMORY_H_
+#define _MEMORY_H_
+
+#include "engine.h"
+#include "bytecode.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// static storage plan for a compiled program. a program gives every instruction a register
+// of its own, a plan gives it a slot that goes back to a free list after its last reader
+// ran, so the data file only grows to the largest number of values live at once. live
+// ranges of a straight line program are intervals, taking slots greedily in stream order
+// colors them with that minimum. leaves keep slot == register. a training plan keeps the
+// slot of every value backward reads (operands of MULTIPLE, POW, RELU, results of EXP and
+// TANH), the rest of the intermediates are forward only temporaries. gradients of the
+// intermediates are colored the same way over the reverse stream: a gradient lives from
+// its last consumer, which backward visits first, down to its own instruction.
+// the plan copies what a run needs from the program, so the program, the graph and, after
+// memory_plan_detach, the tape the program was compiled from can all be dropped.
+struct MemoryPlan
+{
+    bool backward = false;
+    int leaf_count = 0;
+    int instruction_count = 0;
+    int root = -1;                      // pool index the result is stored to, -1 once detached from it
+    int root_slot = -1;
+    int root_gradient_slot = -1;
+    std::vector<int> leaves;            // pool index of every leaf register, -1 for a constant
+    std::vector<float> constants;
+    std::vector<uint32_t> code;         // three words per instruction: op | slot a, slot b (constant for POW), destination slot
+    std::vector<uint32_t> gradient_code; // three words per instruction: gradient slot of a, of b, of the destination
+    std::vector<float> data;            // slot_count values
+    std::vector<float> gradient;        // gradient_slot_count values, training plans only
+    int slot_count = 0;
+    int gradient_slot_count = 0;
+    float result = 0.f;                 // root data of the last memory_forward
+    size_t peak_bytes = 0;              // predicted size of data + gradient + both codes
+};
+
+void memory_keep_backward_operands(std::vector<bool>& kept, uint32_t op, uint32_t a, uint32_t b, int r)
+{
+    switch(op)
+    {
+    case MathOperation::MULTIPLE:
+        kept[a] = true;
+        kept[b] = true;
+        break;
+    case MathOperation::POW:
+    case MathOperation::RELU:
+        kept[a] = true;
+        break;
+    case MathOperation::EXP:
+    case MathOperation::TANH:
+        kept[r] = true;
+        break;
+    default:
+        break;
+    }
+}
+
+// plans storage for program, the program is not referenced afterwards. backward = false
+// plans for inference, every intermediate but the root is a temporary then.
+void memory_plan(MemoryPlan& plan, BytecodeProgram& program, bool backward)
+{
+    int leaf_count = program.leaf_count;
+    int n = program.instruction_count;
+    int register_count = leaf_count + n;
+    plan.backward = backward;
+    plan.leaf_count = leaf_count;
+    plan.instruction_count = n;
+    plan.root = program.root;
+    plan.leaves = program.leaves;
+    plan.constants = program.constants;
+
+    // liveness: the last instruction reading each register
+    std::vector<int> last_use(register_count, -1);
+    std::vector<bool> kept(register_count, false);
+    for (int k = 0; k < n; k++)
+    {
+        uint32_t op = program.code[2 * k] >> BYTECODE_OP_SHIFT;
+        uint32_t a = program.code[2 * k] & BYTECODE_OPERAND_MASK;
+        uint32_t b = program.code[2 * k + 1];
+        last_use[a] = k;
+        if (op == MathOperation::ADD || op == MathOperation::MULTIPLE) last_use[b] = k;
+        if (backward) memory_keep_backward_operands(kept, op, a, b, leaf_count + k);
+    }
+    kept[program.root_register] = true;
+
+    std::vector<int> slot_of(register_count, -1);
+    for (int r = 0; r < leaf_count; r++)
+    {
+        slot_of[r] = r;
+    }
+    plan.slot_count = leaf_count;
+    std::vector<int> free_slots;
+    plan.code.resize(3 * n);
+    for (int k = 0; k < n; k++)
+    {
+        uint32_t op = program.code[2 * k] >> BYTECODE_OP_SHIFT;
+        uint32_t a = program.code[2 * k] & BYTECODE_OPERAND_MASK;
+        uint32_t b = program.code[2 * k + 1];
+        bool binary = op == MathOperation::ADD || op == MathOperation::MULTIPLE;
+        int r = leaf_count + k;
+
+        plan.code[3 * k] = (op << BYTECODE_OP_SHIFT) | (uint32_t)slot_of[a];
+        plan.code[3 * k + 1] = binary ? (uint32_t)slot_of[b] : b;
+
+        // operands are read before the result is written, the result may reuse their slot
+        if (a >= leaf_count && !kept[a] && last_use[a] == k) free_slots.push_back(slot_of[a]);
+        if (binary && b != a && b >= leaf_count && !kept[b] && last_use[b] == k) free_slots.push_back(slot_of[b]);
+
+        int slot = plan.slot_count;
+        if (free_slots.size() > 0)
+        {
+            slot = free_slots.back();
+            free_slots.pop_back();
+        }
+        else
+        {
+            plan.slot_count++;
+        }
+        slot_of[r] = slot;
+        plan.code[3 * k + 2] = (uint32_t)slot;
+        if (last_use[r] < 0 && !kept[r]) free_slots.push_back(slot);
+    }
+    plan.root_slot = slot_of[program.root_register];
+
+    // gradient slots over the reverse stream. leaf gradients keep slot == register for the whole
+    // backward, an intermediate's slot is taken at its first accumulation (or at its own
+    // instruction when nothing consumes it) and freed once its instruction read it.
+    // memory_backward zeroes a slot as it frees it, so a slot is zero whenever it is taken.
+    plan.gradient_code.clear();
+    plan.gradient_slot_count = 0;
+    if (backward)
+    {
+        std::vector<int> gradient_slot_of(register_count, -1);
+        for (int r = 0; r < leaf_count; r++)
+        {
+            gradient_slot_of[r] = r;
+        }
+        plan.gradient_slot_count = leaf_count;
+        free_slots.clear();
+        auto take = [&](uint32_t r) {
+            if (gradient_slot_of[r] >= 0) return;
+            if (free_slots.size() > 0)
+            {
+                gradient_slot_of[r] = free_slots.back();
+                free_slots.pop_back();
+            }
+            else
+            {
+                gradient_slot_of[r] = plan.gradient_slot_count++;
+            }
+        };
+        take(program.root_register);
+        plan.root_gradient_slot = gradient_slot_of[program.root_register];
+        plan.gradient_code.resize(3 * n);
+        for (int k = n - 1; k >= 0; k--)
+        {
+            uint32_t op = program.code[2 * k] >> BYTECODE_OP_SHIFT;
+            uint32_t a = program.code[2 * k] & BYTECODE_OPERAND_MASK;
+            uint32_t b = program.code[2 * k + 1];
+            bool binary = op == MathOperation::ADD || op == MathOperation::MULTIPLE;
+            int r = leaf_count + k;
+
+            take(r);
+            plan.gradient_code[3 * k + 2] = (uint32_t)gradient_slot_of[r];
+            free_slots.push_back(gradient_slot_of[r]);
+            take(a);
+            plan.gradient_code[3 * k] = (uint32_t)gradient_slot_of[a];
+            if (binary) take(b);
+            plan.gradient_code[3 * k + 1] = binary ? (uint32_t)gradient_slot_of[b] : 0;
+        }
+    }
+
+    // constants a pass made live in the leaf registers of the program
+    plan.data.assign(plan.slot_count, 0.f);
+    for (int r = 0; r < leaf_count; r++)
+    {
+        if (program.leaves[r] < 0) plan.data[r] = program.data[r];
+    }
+    plan.gradient.assign(plan.gradient_slot_count, 0.f);
+    plan.peak_bytes = (plan.data.size() + plan.gradient.size()) * sizeof(float) +
+        (plan.code.size() + plan.gradient_code.size()) * sizeof(uint32_t);
+}
+
+// lets the pool be rewound to keep_count while the plan stays runnable: leaves at or past
+// keep_count (the inputs of a batch, usually) are read once more and become constants of
+// the plan, and a root past it is only kept in plan.result. their gradients are dropped.
+void memory_plan_detach(MemoryPlan& plan, int keep_count)
+{
+    for (int r = 0; r < plan.leaf_count; r++)
+    {
+        if (plan.leaves[r] < keep_count) continue;
+        plan.data[r] = get_value(ValueHandle{ .idx = plan.leaves[r] })->data;
+        plan.leaves[r] = -1;
+    }
+    if (plan.root >= keep_count) plan.root = -1;
+}
+
+// bytes the values [begin, end) hold on the tape, their records and their input lists
+size_t memory_tape_bytes(int begin, int end)
+{
+    size_t bytes = (size_t)(end - begin) * sizeof(Value);
+    for (int i = begin; i < end; i++)
+    {
+        bytes += g_value_pool->values[i].input.capacity() * sizeof(ValueHandle);
+    }
+    return bytes;
+}
+
+// bytecode_forward on the planned slots, same results bit for bit
+void memory_forward(MemoryPlan& plan)
+{
+    const uint32_t* code = plan.code.data();
+    const float* constants = plan.constants.data();
+    float* data = plan.data.data();
+    for (int r = 0; r < plan.leaf_count; r++)
+    {
+        if (plan.leaves[r] < 0) continue;
+        data[r] = g_value_pool->values[plan.leaves[r]].data;
+    }
+
+#define A (code[3 * k] & BYTECODE_OPERAND_MASK)
+#define B (code[3 * k + 1])
+#define OUT (code[3 * k + 2])
+    for (int k = 0; k < plan.instruction_count; k++)
+    {
+        switch(code[3 * k] >> BYTECODE_OP_SHIFT)
+        {
+        case MathOperation::ADD: data[OUT] = data[A] + data[B]; break;
+        case MathOperation::MULTIPLE: data[OUT] = data[A] * data[B]; break;
+        case MathOperation::POW: data[OUT] = powf(data[A], constants[B]); break;
+        case MathOperation::EXP: data[OUT] = expf(data[A]); break;
+        case MathOperation::TANH: data[OUT] = tanhf(data[A]); break;
+        case MathOperation::RELU: data[OUT] = data[A] < 0 ? 0 : data[A]; break;
+        default: break;
+        }
+    }
+#undef A
+#undef B
+#undef OUT
+
+    plan.result = data[plan.root_slot];
+    if (plan.root >= 0) g_value_pool->values[plan.root].data = plan.result;
+}
+
+// bytecode_backward after memory_forward on a training plan. data comes from the kept
+// slots, gradients from the planned gradient slots. every gradient is accumulated in the
+// same order as with one per register, so the results are the same bit for bit.
+void memory_backward(MemoryPlan& plan)
+{
+    assert(plan.backward);
+    const uint32_t* code = plan.code.data();
+    const uint32_t* gradient_code = plan.gradient_code.data();
+    const float* constants = plan.constants.data();
+    float* data = plan.data.data();
+    float* gradient = plan.gradient.data();
+    int leaf_count = plan.leaf_count;
+    for (int r = 0; r < leaf_count; r++)
+    {
+        gradient[r] = plan.leaves[r] < 0 ? 0.f : g_value_pool->values[plan.leaves[r]].gradient;
+    }
+    for (int s = leaf_count; s < plan.gradient_slot_count; s++)
+    {
+        gradient[s] = 0.f;
+    }
+    gradient[plan.root_gradient_slot] = 1.f;
+
+#define A (code[3 * k] & BYTECODE_OPERAND_MASK)
+#define B (code[3 * k + 1])
+#define OUT (code[3 * k + 2])
+#define GA (gradient_code[3 * k])
+#define GB (gradient_code[3 * k + 1])
+#define GOUT (gradient_code[3 * k + 2])
+    for (int k = plan.instruction_count - 1; k >= 0; k--)
+    {
+        float out_gradient = gradient[GOUT];
+        gradient[GOUT] = 0.f;
+        switch(code[3 * k] >> BYTECODE_OP_SHIFT)
+        {
+        case MathOperation::ADD:
+            gradient[GA] += 1.f * out_gradient;
+            gradient[GB] += 1.f * out_gradient;
+            break;
+        case MathOperation::MULTIPLE:
+            gradient[GA] += data[B] * out_gradient;
+            gradient[GB] += data[A] * out_gradient;
+            break;
+        case MathOperation::POW: gradient[GA] += constants[B] * powf(data[A], constants[B] - 1.f) * out_gradient; break;
+        case MathOperation::EXP: gradient[GA] += data[OUT] * out_gradient; break;
+        case MathOperation::TANH: gradient[GA] += (1.f - powf(data[OUT], 2)) * out_gradient; break;
+        case MathOperation::RELU: gradient[GA] += (data[A] < 0 ? 0 : 1) * out_gradient; break;
+        default: break;
+        }
+    }
+#undef A
+#undef B
+#undef OUT
+#undef GA
+#undef GB
+#undef GOUT
+
+    for (int r = 0; r < leaf_count; r++)
+    {
+        if (plan.leaves[r] < 0) continue;
+        g_value_pool->values[plan.leaves[r]].gradient = gradient[r];
+    }
+}
+
+#endif
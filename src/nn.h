@@ -2,8 +2,12 @@
 #define _NN_H_
 
 #include "engine.h"
+#include "optim.h"
+#include "tensor.h"
 
 #include <random>
+#include <stdint.h>
+#include <stdio.h>
 
 std::random_device g_rd;
 std::mt19937 g_gen(g_rd());
@@ -84,9 +88,13 @@ ValueHandle run_neuron(NeuronHandle h, std::vector<ValueHandle> input)
 }
 
 
+// a tensor layer has no neurons, its parameters are two tensor leaves, weight [input, output]
+// and bias [output], so its width is not bound by the neuron pool
 struct Layer
 {
     std::vector<NeuronHandle> neurons;
+    ValueHandle weight = { .idx = -1 };
+    ValueHandle bias = { .idx = -1 };
 };
 
 struct LayerHandle
@@ -102,6 +110,9 @@ struct LayerPool
 };
 LayerPool g_layer_pool = {};
 
+#define TEMP_MLP_POOL_START { int temp_neuron_count = g_neuron_pool.neuron_count; int temp_layer_count = g_layer_pool.layer_count;
+#define TEMP_MLP_POOL_END g_neuron_pool.neuron_count = temp_neuron_count; g_layer_pool.layer_count = temp_layer_count; }
+
 LayerHandle create_layer(int input, int output)
 {
     assert(g_layer_pool.layer_count < MAX_LAYER_NUMBER - 1);
@@ -117,6 +128,37 @@ LayerHandle create_layer(int input, int output)
     {
         layer.neurons[i] = create_neuron(input);
     }
+    layer.weight = ValueHandle{ .idx = -1 };
+    layer.bias = ValueHandle{ .idx = -1 };
+
+    return LayerHandle{
+        .idx = g_layer_pool.layer_count++
+    };
+}
+
+LayerHandle create_layer_tensor(int input, int output)
+{
+    assert(g_layer_pool.layer_count < MAX_LAYER_NUMBER - 1);
+    if (g_layer_pool.layer_count == MAX_LAYER_NUMBER - 1)
+    {
+        fprintf(stderr, "layer pool reach maximum capacity %d! create layer failed!", MAX_LAYER_NUMBER);
+        return LayerHandle{ .idx = -1 };
+    }
+
+    Layer& layer = g_layer_pool.layers[g_layer_pool.layer_count];
+    layer.neurons.clear();
+    layer.weight = create_tensor({ input, output });
+    layer.bias = create_tensor({ output });
+    Tensor& weight = tensor_of(layer.weight);
+    Tensor& bias = tensor_of(layer.bias);
+    for (int i = 0; i < weight.size; i++)
+    {
+        weight.data[i] = g_dis(g_gen);
+    }
+    for (int i = 0; i < bias.size; i++)
+    {
+        bias.data[i] = g_dis(g_gen);
+    }
 
     return LayerHandle{
         .idx = g_layer_pool.layer_count++
@@ -143,9 +185,27 @@ Layer* get_layer(LayerHandle h)
     return &g_layer_pool.layers[h.idx];
 }
 
+bool layer_is_tensor(Layer* layer)
+{
+    return layer->weight.idx >= 0;
+}
+
+int layer_input(Layer* layer)
+{
+    if (layer_is_tensor(layer)) return tensor_of(layer->weight).shape[0];
+    return (int)get_neuron(layer->neurons[0])->parameters.size() - 1;
+}
+
+int layer_output(Layer* layer)
+{
+    if (layer_is_tensor(layer)) return tensor_of(layer->weight).shape[1];
+    return (int)layer->neurons.size();
+}
+
 std::vector<ValueHandle> run_layer(LayerHandle h, std::vector<ValueHandle> input)
 {
     Layer* layer = get_layer(h);
+    assert(!layer_is_tensor(layer));
     std::vector<ValueHandle> output;
     for (int i = 0; i < layer->neurons.size(); i++)
     {
@@ -178,12 +238,37 @@ void mlp_init(MLP& mlp, int input, std::vector<int> layers)
     }
 }
 
+bool mlp_has_tensor_layer(MLP& mlp)
+{
+    for (int i = 0; i < mlp.layers.size(); i++)
+    {
+        if (layer_is_tensor(get_layer(mlp.layers[i]))) return true;
+    }
+    return false;
+}
+
+// an mlp of tensor layers, run it with mlp_forward_tensor
+void mlp_init_tensor(MLP& mlp, int input, std::vector<int> layers)
+{
+    mlp.layers.clear();
+    for (int i = 0; i < layers.size(); i++)
+    {
+        LayerHandle layer = create_layer_tensor(i == 0 ? input : layers[i - 1], layers[i]);
+        mlp.layers.push_back(layer);
+    }
+}
+
 std::vector<ValueHandle> mlp_parameters(MLP& mlp)
 {
     std::vector<ValueHandle> parameters;
     for (int i = 0; i < mlp.layers.size(); i++)
     {
         Layer* layer = get_layer(mlp.layers[i]);
+        if (layer_is_tensor(layer))
+        {
+            parameters.push_back(layer->weight);
+            parameters.push_back(layer->bias);
+        }
         for (int j = 0; j < layer->neurons.size(); j++)
         {
             Neuron* neuron = get_neuron(layer->neurons[j]);
@@ -201,6 +286,13 @@ void mlp_zero_grad(MLP& mlp)
     for (int i = 0; i < mlp.layers.size(); i++)
     {
         Layer* layer = get_layer(mlp.layers[i]);
+        if (layer_is_tensor(layer))
+        {
+            Tensor& weight = tensor_of(layer->weight);
+            Tensor& bias = tensor_of(layer->bias);
+            memset(weight.gradient, 0, weight.size * sizeof(float));
+            memset(bias.gradient, 0, bias.size * sizeof(float));
+        }
         for (int j = 0; j < layer->neurons.size(); j++)
         {
             Neuron* neuron = get_neuron(layer->neurons[j]);
@@ -222,6 +314,53 @@ std::vector<ValueHandle> mlp_forward(MLP& mlp, std::vector<ValueHandle> input)
     return input;
 }
 
+// the parameters of a layer as weight [input, output] and bias [output]. a tensor layer hands
+// out its leaves. a neuron layer, for mixing with scalar code, gets both packed over its
+// scalar parameters with neuron j in column j, gradients of the tensor path land in them.
+void layer_tensors(LayerHandle h, ValueHandle& weight, ValueHandle& bias)
+{
+    Layer* layer = get_layer(h);
+    if (layer_is_tensor(layer))
+    {
+        weight = layer->weight;
+        bias = layer->bias;
+        return;
+    }
+    int output = (int)layer->neurons.size();
+    int input = (int)get_neuron(layer->neurons[0])->parameters.size() - 1;
+    std::vector<ValueHandle> weights(input * output);
+    std::vector<ValueHandle> biases(output);
+    for (int j = 0; j < output; j++)
+    {
+        Neuron* neuron = get_neuron(layer->neurons[j]);
+        for (int i = 0; i < input; i++)
+        {
+            weights[i * output + j] = neuron->parameters[i];
+        }
+        biases[j] = neuron->parameters[input];
+    }
+    weight = tensor_pack(weights, { input, output });
+    bias = tensor_pack(biases, { output });
+}
+
+// tensor path of run_layer, a batch [batch, input] in, [batch, output] out
+ValueHandle run_layer_tensor(LayerHandle h, ValueHandle input)
+{
+    ValueHandle weight, bias;
+    layer_tensors(h, weight, bias);
+    return tensor_tanh(tensor_add(tensor_matmul(input, weight), bias));
+}
+
+// tensor path of mlp_forward, a tensor layer is three nodes whatever its width
+ValueHandle mlp_forward_tensor(MLP& mlp, ValueHandle input)
+{
+    for (int i = 0; i < mlp.layers.size(); i++)
+    {
+        input = run_layer_tensor(mlp.layers[i], input);
+    }
+    return input;
+}
+
 ValueHandle mean_squared_error(std::vector<ValueHandle> prediction, std::vector<ValueHandle> expect)
 {
     assert(prediction.size() == expect.size());
@@ -233,6 +372,12 @@ ValueHandle mean_squared_error(std::vector<ValueHandle> prediction, std::vector<
     return loss;
 }
 
+// summed like mean_squared_error, a rank 0 result
+ValueHandle mean_squared_error_tensor(ValueHandle prediction, ValueHandle expect)
+{
+    return tensor_sum(tensor_pow(tensor_sub(prediction, expect), 2.f));
+}
+
 void mlp_backward(MLP& mlp, ValueHandle loss, float learning_rate)
 {
     backward(loss);
@@ -248,8 +393,262 @@ void mlp_backward(MLP& mlp, ValueHandle loss, float learning_rate)
                 parameter->data += -learning_rate * parameter->gradient;
             }
         }
+        if (layer_is_tensor(layer))
+        {
+            ValueHandle parameters[2] = { layer->weight, layer->bias };
+            for (int j = 0; j < 2; j++)
+            {
+                Tensor& parameter = tensor_of(parameters[j]);
+                for (int k = 0; k < parameter.size; k++)
+                {
+                    parameter.data[k] += -learning_rate * parameter.gradient[k];
+                }
+            }
+        }
     }
 }
 
+void mlp_backward(MLP& mlp, ValueHandle loss, Optimizer& optimizer)
+{
+    if (optimizer.fused_backward)
+    {
+        backward_and_step(loss, optimizer);
+        return;
+    }
+    backward(loss);
+    optimizer_step(optimizer);
+}
+
+// forward and backward one microbatch at a time, rewinding the value pool after each one.
+// gradients keep adding into the parameters, so the result equals one backward over the
+// summed loss of the whole batch while the pool only ever holds a single microbatch graph.
+// only samples in [begin, end) are used, end < 0 means up to the last sample.
+// returns the summed loss.
+float mlp_accumulate_gradient(MLP& mlp, std::vector<std::vector<float>>& input, std::vector<std::vector<float>>& expect, int microbatch_size, int begin = 0, int end = -1)
+{
+    assert(input.size() == expect.size());
+    assert(microbatch_size > 0);
+    if (end < 0) end = (int)input.size();
+    assert(begin >= 0 && begin <= end && end <= input.size());
+
+    float total_loss = 0.f;
+    for (int start = begin; start < end; start += microbatch_size)
+    {
+        TEMP_VALUE_POOL_START;
+
+        int stop = start + microbatch_size < end ? start + microbatch_size : end;
+        std::vector<ValueHandle> prediction_set;
+        std::vector<ValueHandle> expect_set;
+        for (int i = start; i < stop; i++)
+        {
+            std::vector<ValueHandle> x;
+            for (int j = 0; j < input[i].size(); j++)
+            {
+                x.push_back(create_value(input[i][j]));
+            }
+            std::vector<ValueHandle> prediction = mlp_forward(mlp, x);
+            assert(prediction.size() == expect[i].size());
+            for (int j = 0; j < prediction.size(); j++)
+            {
+                prediction_set.push_back(prediction[j]);
+                expect_set.push_back(create_value(expect[i][j]));
+            }
+        }
+
+        ValueHandle loss = mean_squared_error(prediction_set, expect_set);
+        backward(loss);
+        total_loss += get_value(loss)->data;
+
+        TEMP_VALUE_POOL_END;
+    }
+    return total_loss;
+}
+
+// forward only, one sample per pool scope, returns the summed loss
+float mlp_loss(MLP& mlp, std::vector<std::vector<float>>& input, std::vector<std::vector<float>>& expect)
+{
+    assert(input.size() == expect.size());
+    float total_loss = 0.f;
+    for (int i = 0; i < input.size(); i++)
+    {
+        TEMP_VALUE_POOL_START;
+
+        std::vector<ValueHandle> x;
+        for (int j = 0; j < input[i].size(); j++)
+        {
+            x.push_back(create_value(input[i][j]));
+        }
+        std::vector<ValueHandle> prediction = mlp_forward(mlp, x);
+        std::vector<ValueHandle> expect_set;
+        for (int j = 0; j < expect[i].size(); j++)
+        {
+            expect_set.push_back(create_value(expect[i][j]));
+        }
+        total_loss += get_value(mean_squared_error(prediction, expect_set))->data;
+
+        TEMP_VALUE_POOL_END;
+    }
+    return total_loss;
+}
+
+// parameter file: magic, layer count n, the n + 1 sizes (input first), parameter count,
+// then the parameters in mlp_parameters order. shared by every MLP flavour (see fixed.h).
+#define MLP_FILE_MAGIC 0x31504c4d
+
+bool mlp_write_parameters(const char* path, std::vector<int>& shape, std::vector<float>& parameters)
+{
+    FILE* file = fopen(path, "wb");
+    if (!file)
+    {
+        fprintf(stderr, "can not open %s for writing!", path);
+        return false;
+    }
+    int32_t header[2] = { MLP_FILE_MAGIC, (int32_t)shape.size() - 1 };
+    int32_t parameter_count = (int32_t)parameters.size();
+    std::vector<int32_t> sizes(shape.begin(), shape.end());
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1
+        && fwrite(sizes.data(), sizeof(int32_t), sizes.size(), file) == sizes.size()
+        && fwrite(&parameter_count, sizeof(parameter_count), 1, file) == 1
+        && fwrite(parameters.data(), sizeof(float), parameters.size(), file) == parameters.size();
+    fclose(file);
+    if (!ok) fprintf(stderr, "writing %s failed!", path);
+    return ok;
+}
+
+// fails unless the file holds exactly the given shape
+bool mlp_read_parameters(const char* path, std::vector<int>& shape, std::vector<float>& parameters)
+{
+    FILE* file = fopen(path, "rb");
+    if (!file)
+    {
+        fprintf(stderr, "can not open %s for reading!", path);
+        return false;
+    }
+    int32_t header[2] = {};
+    bool ok = fread(header, sizeof(header), 1, file) == 1 && header[0] == MLP_FILE_MAGIC && header[1] == (int32_t)shape.size() - 1;
+    std::vector<int32_t> sizes(shape.size());
+    ok = ok && fread(sizes.data(), sizeof(int32_t), sizes.size(), file) == sizes.size();
+    for (int i = 0; ok && i < shape.size(); i++)
+    {
+        ok = sizes[i] == shape[i];
+    }
+    int32_t parameter_count = 0;
+    ok = ok && fread(&parameter_count, sizeof(parameter_count), 1, file) == 1 && parameter_count >= 0;
+    if (ok)
+    {
+        parameters.resize(parameter_count);
+        ok = fread(parameters.data(), sizeof(float), parameters.size(), file) == parameters.size();
+    }
+    fclose(file);
+    if (!ok) fprintf(stderr, "%s is not a parameter file of the expected shape!", path);
+    return ok;
+}
+
+// input size followed by the size of every layer, the same vector mlp_init takes
+std::vector<int> mlp_shape(MLP& mlp)
+{
+    std::vector<int> shape;
+    for (int i = 0; i < mlp.layers.size(); i++)
+    {
+        Layer* layer = get_layer(mlp.layers[i]);
+        if (i == 0) shape.push_back(layer_input(layer));
+        shape.push_back(layer_output(layer));
+    }
+    return shape;
+}
+
+// every parameter (or its gradient) in neuron order: the weights of neuron (column) j then
+// its bias, layer after layer. the same for neuron and tensor layers, so either loads what
+// the other saved.
+std::vector<float> mlp_parameter_data(MLP& mlp, bool gradient = false)
+{
+    std::vector<float> data;
+    for (int i = 0; i < mlp.layers.size(); i++)
+    {
+        Layer* layer = get_layer(mlp.layers[i]);
+        int input = layer_input(layer);
+        int output = layer_output(layer);
+        for (int j = 0; j < output; j++)
+        {
+            if (!layer_is_tensor(layer))
+            {
+                Neuron* neuron = get_neuron(layer->neurons[j]);
+                for (int k = 0; k < input + 1; k++)
+                {
+                    Value* parameter = get_value(neuron->parameters[k]);
+                    data.push_back(gradient ? parameter->gradient : parameter->data);
+                }
+                continue;
+            }
+            Tensor& weight = tensor_of(layer->weight);
+            Tensor& bias = tensor_of(layer->bias);
+            for (int k = 0; k < input; k++)
+            {
+                data.push_back(gradient ? weight.gradient[k * output + j] : weight.data[k * output + j]);
+            }
+            data.push_back(gradient ? bias.gradient[j] : bias.data[j]);
+        }
+    }
+    return data;
+}
+
+bool mlp_set_parameter_data(MLP& mlp, std::vector<float>& data)
+{
+    int count = 0;
+    for (int i = 0; i < mlp.layers.size(); i++)
+    {
+        Layer* layer = get_layer(mlp.layers[i]);
+        count += (layer_input(layer) + 1) * layer_output(layer);
+    }
+    assert(count == data.size());
+    if (count != data.size())
+    {
+        fprintf(stderr, "%d parameters, expected %d! set parameters failed!", (int)data.size(), count);
+        return false;
+    }
+
+    int p = 0;
+    for (int i = 0; i < mlp.layers.size(); i++)
+    {
+        Layer* layer = get_layer(mlp.layers[i]);
+        int input = layer_input(layer);
+        int output = layer_output(layer);
+        for (int j = 0; j < output; j++)
+        {
+            if (!layer_is_tensor(layer))
+            {
+                Neuron* neuron = get_neuron(layer->neurons[j]);
+                for (int k = 0; k < input + 1; k++)
+                {
+                    get_value(neuron->parameters[k])->data = data[p++];
+                }
+                continue;
+            }
+            Tensor& weight = tensor_of(layer->weight);
+            for (int k = 0; k < input; k++)
+            {
+                weight.data[k * output + j] = data[p++];
+            }
+            tensor_of(layer->bias).data[j] = data[p++];
+        }
+    }
+    return true;
+}
+
+bool mlp_save(MLP& mlp, const char* path)
+{
+    std::vector<int> shape = mlp_shape(mlp);
+    std::vector<float> parameters = mlp_parameter_data(mlp);
+    return mlp_write_parameters(path, shape, parameters);
+}
+
+// the mlp has to be initialized with the shape that was saved
+bool mlp_load(MLP& mlp, const char* path)
+{
+    std::vector<int> shape = mlp_shape(mlp);
+    std::vector<float> parameters;
+    if (!mlp_read_parameters(path, shape, parameters)) return false;
+    return mlp_set_parameter_data(mlp, parameters);
+}
 
 #endif
\ No newline at end of file
@@ -0,0 +1,289 @@
+#ifndef _OPTIM_H_
+#define _OPTIM_H_
+
+#include "engine.h"
+#include "tensor.h"
+
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+enum OptimizerType
+{
+    SGD = 0,
+    MOMENTUM,
+    NESTEROV,
+    ADAM,
+    ADAMW,
+};
+
+// optimizer state lives in the same slot as the parameter handle,
+// so one step walks a single array instead of three
+struct OptimizerSlot
+{
+    ValueHandle parameter;
+    float m = 0.f; // velocity for MOMENTUM/NESTEROV, first moment for ADAM/ADAMW
+    float v = 0.f; // second moment for ADAM/ADAMW
+    std::vector<float> moments; // a tensor parameter's m then v, one per element
+};
+
+struct Optimizer
+{
+    OptimizerType type = OptimizerType::SGD;
+    float learning_rate = 0.01f;
+    float momentum = 0.9f;
+    float beta1 = 0.9f;
+    float beta2 = 0.999f;
+    float epsilon = 1e-8f;
+    float weight_decay = 0.f;
+    float max_grad_norm = 0.f; // <= 0 disables global norm clipping
+    bool fused_backward = false; // apply updates inside the backward sweep, see backward_and_step
+    int step = 0;
+    std::vector<OptimizerSlot> slots;
+};
+
+void optimizer_init(Optimizer& opt, OptimizerType type, std::vector<ValueHandle> parameters, float learning_rate)
+{
+    opt.type = type;
+    opt.learning_rate = learning_rate;
+    opt.step = 0;
+    opt.slots.resize(parameters.size());
+    for (int i = 0; i < parameters.size(); i++)
+    {
+        assert(valid_value(parameters[i]));
+        opt.slots[i] = OptimizerSlot{ .parameter = parameters[i] };
+        Value* p = get_value(parameters[i]);
+        if (p->op == MathOperation::TENSOR)
+        {
+            // updated in place, so a leaf owning its storage
+            Tensor& tensor = tensor_of(parameters[i]);
+            assert(tensor.op == TensorOperation::TENSOR_LEAF && tensor_is_contiguous(tensor));
+            opt.slots[i].moments.assign(2 * tensor.size, 0.f);
+        }
+    }
+}
+
+void optimizer_reset(Optimizer& opt)
+{
+    opt.step = 0;
+    for (int i = 0; i < opt.slots.size(); i++)
+    {
+        opt.slots[i].m = 0.f;
+        opt.slots[i].v = 0.f;
+        std::fill(opt.slots[i].moments.begin(), opt.slots[i].moments.end(), 0.f);
+    }
+}
+
+float optimizer_grad_norm(Optimizer& opt)
+{
+    float sum = 0.f;
+    for (int i = 0; i < opt.slots.size(); i++)
+    {
+        Value* p = get_value(opt.slots[i].parameter);
+        if (p->op == MathOperation::TENSOR)
+        {
+            Tensor& tensor = tensor_of(opt.slots[i].parameter);
+            for (int j = 0; j < tensor.size; j++)
+            {
+                sum += tensor.gradient[j] * tensor.gradient[j];
+            }
+            continue;
+        }
+        float g = p->gradient;
+        sum += g * g;
+    }
+    return sqrtf(sum);
+}
+
+// per-step constants shared by every slot update
+struct OptimizerStepInfo
+{
+    float grad_scale;
+    float bias_correction1;
+    float bias_correction2;
+};
+
+OptimizerStepInfo optimizer_begin_step(Optimizer& opt, float grad_scale = 1.f)
+{
+    opt.step++;
+    OptimizerStepInfo info;
+    info.grad_scale = grad_scale;
+    info.bias_correction1 = 1.f - powf(opt.beta1, (float)opt.step);
+    info.bias_correction2 = 1.f - powf(opt.beta2, (float)opt.step);
+    return info;
+}
+
+// one element of a parameter, m and v are its state
+inline void optimizer_update_element(Optimizer& opt, OptimizerStepInfo& info, float& data, float gradient, float& m, float& v)
+{
+    float g = gradient * info.grad_scale;
+    switch(opt.type)
+    {
+    case OptimizerType::SGD:
+        {
+            g += opt.weight_decay * data;
+            data -= opt.learning_rate * g;
+        }
+        break;
+    case OptimizerType::MOMENTUM:
+        {
+            g += opt.weight_decay * data;
+            m = opt.momentum * m + g;
+            data -= opt.learning_rate * m;
+        }
+        break;
+    case OptimizerType::NESTEROV:
+        {
+            g += opt.weight_decay * data;
+            m = opt.momentum * m + g;
+            data -= opt.learning_rate * (g + opt.momentum * m);
+        }
+        break;
+    case OptimizerType::ADAM:
+    case OptimizerType::ADAMW:
+        {
+            if (opt.type == OptimizerType::ADAM)
+            {
+                g += opt.weight_decay * data;
+            }
+            else
+            {
+                data -= opt.learning_rate * opt.weight_decay * data;
+            }
+            m = opt.beta1 * m + (1.f - opt.beta1) * g;
+            v = opt.beta2 * v + (1.f - opt.beta2) * g * g;
+            float m_hat = m / info.bias_correction1;
+            float v_hat = v / info.bias_correction2;
+            data -= opt.learning_rate * m_hat / (sqrtf(v_hat) + opt.epsilon);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void optimizer_update(Optimizer& opt, OptimizerStepInfo& info, OptimizerSlot& slot)
+{
+    Value* p = get_value(slot.parameter);
+    if (p->op == MathOperation::TENSOR)
+    {
+        Tensor& tensor = tensor_of(slot.parameter);
+        float* m = slot.moments.data();
+        float* v = m + tensor.size;
+        for (int i = 0; i < tensor.size; i++)
+        {
+            optimizer_update_element(opt, info, tensor.data[i], tensor.gradient[i], m[i], v[i]);
+        }
+        return;
+    }
+    optimizer_update_element(opt, info, p->data, p->gradient, slot.m, slot.v);
+}
+
+float optimizer_clip_scale(Optimizer& opt)
+{
+    if (opt.max_grad_norm <= 0.f) return 1.f;
+    float norm = optimizer_grad_norm(opt);
+    if (norm <= opt.max_grad_norm) return 1.f;
+    return opt.max_grad_norm / (norm + 1e-6f);
+}
+
+void optimizer_step(Optimizer& opt)
+{
+    // clipping needs the norm of every gradient before any update,
+    // so it is the only extra pass, everything else is one sweep over the slots
+    OptimizerStepInfo info = optimizer_begin_step(opt, optimizer_clip_scale(opt));
+    for (int i = 0; i < opt.slots.size(); i++)
+    {
+        optimizer_update(opt, info, opt.slots[i]);
+    }
+}
+
+void optimizer_zero_grad(Optimizer& opt)
+{
+    for (int i = 0; i < opt.slots.size(); i++)
+    {
+        Value* p = get_value(opt.slots[i].parameter);
+        if (p->op == MathOperation::TENSOR)
+        {
+            Tensor& tensor = tensor_of(opt.slots[i].parameter);
+            memset(tensor.gradient, 0, tensor.size * sizeof(float));
+            continue;
+        }
+        p->gradient = 0.f;
+    }
+}
+
+// values are only ever created after their inputs, so pool order is a topological order
+// and a reverse sweep from the root is a valid backward. a parameter's gradient is final
+// once the sweep passes its lowest indexed consumer, so it is updated right there
+// instead of in a second pass over every parameter after backward.
+void backward_and_step(ValueHandle hroot, Optimizer& opt)
+{
+    if (opt.max_grad_norm > 0.f)
+    {
+        // clipping needs every gradient before the first update, no fusion possible
+        backward(hroot);
+        optimizer_step(opt);
+        return;
+    }
+
+    assert(valid_value(hroot));
+    int count = hroot.idx + 1;
+
+    std::vector<int> slot_of(count, -1);
+    for (int i = 0; i < opt.slots.size(); i++)
+    {
+        int idx = opt.slots[i].parameter.idx;
+        if (idx < count) slot_of[idx] = i;
+    }
+
+    std::vector<int> last_consumer(opt.slots.size(), -1);
+    for (int i = 0; i < count; i++)
+    {
+        Value& value = g_value_pool->values[i];
+        for (int j = 0; j < value.input.size(); j++)
+        {
+            int idx = value.input[j].idx;
+            assert(idx < i);
+            if (slot_of[idx] >= 0 && last_consumer[slot_of[idx]] < 0)
+            {
+                last_consumer[slot_of[idx]] = i;
+            }
+        }
+    }
+
+    OptimizerStepInfo info = optimizer_begin_step(opt);
+    std::vector<bool> updated(opt.slots.size(), false);
+    std::vector<bool> reachable(count, false);
+    reachable[hroot.idx] = true;
+    get_value(hroot)->gradient = 1.f;
+
+    for (int i = count - 1; i >= 0; i--)
+    {
+        Value& value = g_value_pool->values[i];
+        if (reachable[i])
+        {
+            calc_gradient(ValueHandle{ .idx = i });
+        }
+        for (int j = 0; j < value.input.size(); j++)
+        {
+            int idx = value.input[j].idx;
+            if (reachable[i]) reachable[idx] = true;
+
+            int slot = slot_of[idx];
+            if (slot >= 0 && last_consumer[slot] == i && !updated[slot])
+            {
+                optimizer_update(opt, info, opt.slots[slot]);
+                updated[slot] = true;
+            }
+        }
+    }
+
+    // parameters outside this graph still get their (zero gradient) step
+    for (int i = 0; i < opt.slots.size(); i++)
+    {
+        if (!updated[i]) optimizer_update(opt, info, opt.slots[i]);
+    }
+}
+
+#endif
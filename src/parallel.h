@@ -0,0 +1,220 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <assert.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// how many times an idle worker retries stealing before it goes to sleep
+#define THREAD_POOL_SPIN_COUNT 256
+
+typedef std::function<void(int worker)> ThreadTask;
+
+struct TaskQueue
+{
+    std::mutex mutex;
+    std::deque<ThreadTask> tasks;
+};
+
+// work stealing pool of persistent worker threads. every worker owns a deque, it pops
+// its own newest task first (still hot in cache) and steals the oldest task of another
+// worker when it runs dry. the calling thread joins in as worker 0, so a pool created
+// with thread_count n runs n tasks at once with n - 1 extra threads.
+struct ThreadPool
+{
+    std::vector<std::thread> threads;
+    std::vector<TaskQueue*> queues;
+    std::mutex mutex;
+    std::condition_variable wake_cv;
+    std::atomic<int> queued_count = 0;
+    bool quit = false;
+};
+
+int thread_pool_worker_count(ThreadPool& pool)
+{
+    return (int)pool.queues.size();
+}
+
+void thread_pool_push(ThreadPool& pool, int worker, ThreadTask task)
+{
+    TaskQueue* queue = pool.queues[worker];
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        queue->tasks.push_back(std::move(task));
+    }
+    pool.queued_count.fetch_add(1);
+    if (pool.threads.size() > 0)
+    {
+        // taking the lock orders this push against a worker checking queued_count before it sleeps
+        std::lock_guard<std::mutex> lock(pool.mutex);
+    }
+    pool.wake_cv.notify_one();
+}
+
+bool thread_pool_pop(ThreadPool& pool, int worker, ThreadTask& task)
+{
+    int worker_count = thread_pool_worker_count(pool);
+    for (int k = 0; k < worker_count; k++)
+    {
+        TaskQueue* queue = pool.queues[(worker + k) % worker_count];
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        if (queue->tasks.empty()) continue;
+        if (k == 0)
+        {
+            task = std::move(queue->tasks.back());
+            queue->tasks.pop_back();
+        }
+        else
+        {
+            task = std::move(queue->tasks.front());
+            queue->tasks.pop_front();
+        }
+        pool.queued_count.fetch_sub(1);
+        return true;
+    }
+    return false;
+}
+
+void thread_pool_worker_main(ThreadPool* pool, int worker)
+{
+    ThreadTask task;
+    int idle = 0;
+    for (;;)
+    {
+        if (thread_pool_pop(*pool, worker, task))
+        {
+            task(worker);
+            task = NULL;
+            idle = 0;
+            continue;
+        }
+
+        if (++idle < THREAD_POOL_SPIN_COUNT)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        idle = 0;
+        std::unique_lock<std::mutex> lock(pool->mutex);
+        pool->wake_cv.wait(lock, [&] { return pool->quit || pool->queued_count > 0; });
+        if (pool->quit) return;
+    }
+}
+
+void thread_pool_pin(std::thread& thread, int cpu)
+{
+#if defined(_WIN32)
+    SetThreadAffinityMask((HANDLE)thread.native_handle(), (DWORD_PTR)1 << (cpu % (8 * sizeof(DWORD_PTR))));
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+#endif
+}
+
+// pin_threads binds worker i to cpu i, worker 0 (the calling thread) is left alone
+void thread_pool_init(ThreadPool& pool, int thread_count, bool pin_threads = false)
+{
+    assert(thread_count >= 1);
+    assert(pool.queues.size() == 0);
+    pool.quit = false;
+    for (int i = 0; i < thread_count; i++)
+    {
+        pool.queues.push_back(new TaskQueue);
+    }
+
+    int cpu_count = (int)std::thread::hardware_concurrency();
+    for (int i = 1; i < thread_count; i++)
+    {
+        pool.threads.push_back(std::thread(thread_pool_worker_main, &pool, i));
+        if (pin_threads && cpu_count > 0)
+        {
+            thread_pool_pin(pool.threads.back(), i % cpu_count);
+        }
+    }
+}
+
+void thread_pool_shutdown(ThreadPool& pool)
+{
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.quit = true;
+    }
+    pool.wake_cv.notify_all();
+    for (int i = 0; i < pool.threads.size(); i++)
+    {
+        pool.threads[i].join();
+    }
+    pool.threads.clear();
+    for (int i = 0; i < pool.queues.size(); i++)
+    {
+        delete pool.queues[i];
+    }
+    pool.queues.clear();
+}
+
+// the calling worker keeps running and stealing tasks until remaining drops to zero
+void thread_pool_wait(ThreadPool& pool, int worker, std::atomic<int>& remaining)
+{
+    ThreadTask task;
+    while (remaining.load() > 0)
+    {
+        if (thread_pool_pop(pool, worker, task))
+        {
+            task(worker);
+            task = NULL;
+        }
+        else
+        {
+            std::this_thread::yield();
+        }
+    }
+}
+
+// runs job(task, worker) for every task in [0, task_count) and returns once all are done.
+// must be called from outside the pool, the caller works as worker 0 while it waits.
+void thread_pool_run(ThreadPool& pool, int task_count, std::function<void(int task, int worker)> job)
+{
+    if (task_count <= 0) return;
+    if (pool.threads.size() == 0 || task_count == 1)
+    {
+        for (int i = 0; i < task_count; i++)
+        {
+            job(i, 0);
+        }
+        return;
+    }
+
+    std::atomic<int> remaining = task_count;
+    int worker_count = thread_pool_worker_count(pool);
+    for (int i = 0; i < task_count; i++)
+    {
+        thread_pool_push(pool, i % worker_count, [&job, &remaining, i](int worker) {
+            job(i, worker);
+            remaining.fetch_sub(1);
+        });
+    }
+    thread_pool_wait(pool, 0, remaining);
+}
+
+#endif
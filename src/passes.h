@@ -0,0 +1,514 @@
+#ifndef _PASSES_H_
+#define _PASSES_H_
+
+#include "engine.h"
+#include "graph.h"
+#include "bytecode.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unordered_map>
+#include <vector>
+
+// how often the pipeline is repeated at most while passes keep finding rewrites
+#define PASS_MAX_ITERATIONS 8
+
+// one node of the rewritable copy of a captured graph. leaves have op NONE, a leaf is either
+// a variable read from the pool on every replay or a constant frozen into the program.
+// a node that a pass turned into another one points there through replaced_by.
+struct PassNode
+{
+    MathOperation op = MathOperation::NONE;
+    int input[2] = { -1, -1 };
+    float exponent = 0.f;
+    float data = 0.f;
+    int source = -1;        // pool index the node came from, -1 if a pass made it up
+    bool constant = false;
+    int replaced_by = -1;
+};
+
+// the nodes stay topologically sorted except for constants, which a pass may append
+// anywhere since they have no inputs. node_of maps every pool index of the captured
+// graph to the node now computing its value, -1 once it is dead.
+struct PassGraph
+{
+    std::vector<PassNode> nodes;
+    std::vector<int> node_of;
+    int root = -1;
+    int root_source = -1;
+};
+
+int pass_resolve(PassGraph& graph, int node)
+{
+    while (graph.nodes[node].replaced_by >= 0)
+    {
+        node = graph.nodes[node].replaced_by;
+    }
+    return node;
+}
+
+bool pass_is_constant(PassGraph& graph, int node, float value)
+{
+    PassNode& n = graph.nodes[node];
+    return n.constant && n.data == value;
+}
+
+int pass_input_count(MathOperation op)
+{
+    if (op == MathOperation::NONE) return 0;
+    if (op == MathOperation::ADD || op == MathOperation::MULTIPLE) return 2;
+    return 1;
+}
+
+int pass_add_constant(PassGraph& graph, float value)
+{
+    PassNode node;
+    node.constant = true;
+    node.data = value;
+    graph.nodes.push_back(node);
+    return (int)graph.nodes.size() - 1;
+}
+
+// the same arithmetic as calc_data
+float pass_compute(PassGraph& graph, PassNode& node)
+{
+    float a = graph.nodes[node.input[0]].data;
+    switch(node.op)
+    {
+    case MathOperation::ADD: return a + graph.nodes[node.input[1]].data;
+    case MathOperation::MULTIPLE: return a * graph.nodes[node.input[1]].data;
+    case MathOperation::POW: return powf(a, node.exponent);
+    case MathOperation::EXP: return expf(a);
+    case MathOperation::TANH: return tanhf(a);
+    case MathOperation::RELU: return a < 0 ? 0 : a;
+    default: return node.data;
+    }
+}
+
+// copies the graph into pass form. variables are the leaves that may change between
+// replays (parameters, inputs), every other leaf is treated as a constant.
+void pass_capture(PassGraph& graph, Graph& captured, std::vector<ValueHandle>& variables)
+{
+    int count = (int)captured.reachable.size();
+    std::vector<bool> variable(count, false);
+    for (int i = 0; i < variables.size(); i++)
+    {
+        if (variables[i].idx < count) variable[variables[i].idx] = true;
+    }
+
+    graph.nodes.clear();
+    graph.node_of.assign(count, -1);
+    for (int i = 0; i < count; i++)
+    {
+        if (!captured.reachable[i]) continue;
+        Value& value = g_value_pool->values[i];
+        PassNode node;
+        node.op = value.op;
+        node.exponent = value.exponent;
+        node.data = value.data;
+        node.source = i;
+        int producer_count = graph_producer_count(captured.adjacency, i);
+        for (int j = 0; j < producer_count; j++)
+        {
+            node.input[j] = graph.node_of[captured.adjacency.producers[captured.adjacency.producer_offsets[i] + j]];
+        }
+        node.constant = producer_count == 0 && !variable[i];
+        graph.node_of[i] = (int)graph.nodes.size();
+        graph.nodes.push_back(node);
+    }
+    graph.root = graph.node_of[captured.root.idx];
+    graph.root_source = captured.root.idx;
+}
+
+// drops replaced nodes and everything the root no longer reaches, renumbers the rest
+// and returns how many nodes went away
+int pass_eliminate_dead(PassGraph& graph)
+{
+    int count = (int)graph.nodes.size();
+    for (int k = 0; k < count; k++)
+    {
+        PassNode& node = graph.nodes[k];
+        for (int j = 0; j < pass_input_count(node.op); j++)
+        {
+            node.input[j] = pass_resolve(graph, node.input[j]);
+        }
+    }
+    graph.root = pass_resolve(graph, graph.root);
+
+    // inputs can sit behind their consumer only when they are constants, which have no inputs
+    std::vector<bool> live(count, false);
+    live[graph.root] = true;
+    for (int k = count - 1; k >= 0; k--)
+    {
+        if (!live[k]) continue;
+        PassNode& node = graph.nodes[k];
+        for (int j = 0; j < pass_input_count(node.op); j++)
+        {
+            live[node.input[j]] = true;
+        }
+    }
+
+    std::vector<int> remap(count, -1);
+    std::vector<PassNode> nodes;
+    for (int k = 0; k < count; k++)
+    {
+        if (!live[k]) continue;
+        remap[k] = (int)nodes.size();
+        nodes.push_back(graph.nodes[k]);
+    }
+    for (int k = 0; k < nodes.size(); k++)
+    {
+        for (int j = 0; j < pass_input_count(nodes[k].op); j++)
+        {
+            nodes[k].input[j] = remap[nodes[k].input[j]];
+        }
+    }
+    for (int i = 0; i < graph.node_of.size(); i++)
+    {
+        if (graph.node_of[i] >= 0) graph.node_of[i] = remap[pass_resolve(graph, graph.node_of[i])];
+    }
+    graph.root = remap[graph.root];
+    int removed = count - (int)nodes.size();
+    graph.nodes.swap(nodes);
+    return removed;
+}
+
+// nodes whose inputs are all constants become constants
+int pass_fold_constants(PassGraph& graph)
+{
+    int rewrites = 0;
+    for (int k = 0; k < graph.nodes.size(); k++)
+    {
+        PassNode& node = graph.nodes[k];
+        if (node.op == MathOperation::NONE || node.replaced_by >= 0) continue;
+        bool constant = true;
+        for (int j = 0; j < pass_input_count(node.op); j++)
+        {
+            node.input[j] = pass_resolve(graph, node.input[j]);
+            constant = constant && graph.nodes[node.input[j]].constant;
+        }
+        if (!constant) continue;
+        node.data = pass_compute(graph, node);
+        node.op = MathOperation::NONE;
+        node.input[0] = node.input[1] = -1;
+        node.constant = true;
+        rewrites++;
+    }
+    return rewrites;
+}
+
+// x * 1, 1 * x, x + 0, 0 + x, pow(x, 1) -> x and pow(x, 0) -> 1
+int pass_simplify_identities(PassGraph& graph)
+{
+    int rewrites = 0;
+    for (int k = 0; k < graph.nodes.size(); k++)
+    {
+        PassNode& node = graph.nodes[k];
+        if (node.op == MathOperation::NONE || node.replaced_by >= 0) continue;
+        for (int j = 0; j < pass_input_count(node.op); j++)
+        {
+            node.input[j] = pass_resolve(graph, node.input[j]);
+        }
+        float identity = node.op == MathOperation::MULTIPLE ? 1.f : 0.f;
+        if (node.op == MathOperation::ADD || node.op == MathOperation::MULTIPLE)
+        {
+            if (pass_is_constant(graph, node.input[1], identity)) node.replaced_by = node.input[0];
+            else if (pass_is_constant(graph, node.input[0], identity)) node.replaced_by = node.input[1];
+        }
+        else if (node.op == MathOperation::POW && node.exponent == 1.f)
+        {
+            node.replaced_by = node.input[0];
+        }
+        else if (node.op == MathOperation::POW && node.exponent == 0.f)
+        {
+            node.op = MathOperation::NONE;
+            node.input[0] = -1;
+            node.data = 1.f;
+            node.constant = true;
+            rewrites++;
+        }
+        if (node.replaced_by >= 0) rewrites++;
+    }
+    return rewrites;
+}
+
+// pow(x, 2) -> x * x, a multiply instead of a powf call both ways
+int pass_reduce_strength(PassGraph& graph)
+{
+    int rewrites = 0;
+    for (int k = 0; k < graph.nodes.size(); k++)
+    {
+        PassNode& node = graph.nodes[k];
+        if (node.op != MathOperation::POW || node.replaced_by >= 0 || node.exponent != 2.f) continue;
+        node.op = MathOperation::MULTIPLE;
+        node.input[1] = node.input[0];
+        node.exponent = 0.f;
+        rewrites++;
+    }
+    return rewrites;
+}
+
+// (x * c1) * c2 -> x * (c1 * c2), the inner multiply dies unless someone else uses it.
+// reassociating rounds differently, which is what verify is there to bound.
+int pass_merge_constant_multiplies(PassGraph& graph)
+{
+    int rewrites = 0;
+    for (int k = 0; k < graph.nodes.size(); k++)
+    {
+        if (graph.nodes[k].op != MathOperation::MULTIPLE || graph.nodes[k].replaced_by >= 0) continue;
+        int a = pass_resolve(graph, graph.nodes[k].input[0]);
+        int b = pass_resolve(graph, graph.nodes[k].input[1]);
+        if (graph.nodes[a].constant) std::swap(a, b);
+        if (!graph.nodes[b].constant) continue;
+
+        PassNode& inner = graph.nodes[a];
+        if (inner.op != MathOperation::MULTIPLE) continue;
+        int x = pass_resolve(graph, inner.input[0]);
+        int c = pass_resolve(graph, inner.input[1]);
+        if (graph.nodes[x].constant) std::swap(x, c);
+        if (!graph.nodes[c].constant || graph.nodes[x].constant) continue;
+
+        // push_back may move the nodes, no references past this point
+        int merged = pass_add_constant(graph, graph.nodes[c].data * graph.nodes[b].data);
+        graph.nodes[k].input[0] = x;
+        graph.nodes[k].input[1] = merged;
+        rewrites++;
+    }
+    return rewrites;
+}
+
+// what makes two nodes interchangeable: op, resolved inputs (sorted for the commutative
+// ops) and the exponent of a POW or the value of a constant, compared bitwise
+struct PassNodeKey
+{
+    int op;
+    int input[2];
+    uint32_t bits;
+
+    bool operator==(const PassNodeKey& other) const
+    {
+        return op == other.op && input[0] == other.input[0] && input[1] == other.input[1] && bits == other.bits;
+    }
+};
+
+struct PassNodeKeyHash
+{
+    size_t operator()(const PassNodeKey& key) const
+    {
+        uint64_t h = (uint64_t)key.op * 0x9e3779b97f4a7c15ull;
+        h = (h ^ (uint32_t)key.input[0]) * 0xff51afd7ed558ccdull;
+        h = (h ^ (uint32_t)key.input[1]) * 0xc4ceb9fe1a85ec53ull;
+        h = (h ^ key.bits) * 0x9e3779b97f4a7c15ull;
+        return (size_t)(h ^ (h >> 32));
+    }
+};
+
+// hash consing: every node that repeats an earlier (op, inputs) tuple is replaced by the
+// earlier one, so its consumers share it and their gradients add up in a single node.
+// variable leaves are never merged, they are distinct by definition.
+int pass_eliminate_common_subexpressions(PassGraph& graph)
+{
+    int rewrites = 0;
+    std::unordered_map<PassNodeKey, int, PassNodeKeyHash> seen;
+    seen.reserve(graph.nodes.size());
+    for (int k = 0; k < graph.nodes.size(); k++)
+    {
+        PassNode& node = graph.nodes[k];
+        if (node.replaced_by >= 0 || (node.op == MathOperation::NONE && !node.constant)) continue;
+
+        PassNodeKey key = { (int)node.op, { -1, -1 }, 0 };
+        for (int j = 0; j < pass_input_count(node.op); j++)
+        {
+            node.input[j] = pass_resolve(graph, node.input[j]);
+            key.input[j] = node.input[j];
+        }
+        if ((node.op == MathOperation::ADD || node.op == MathOperation::MULTIPLE) && key.input[0] > key.input[1])
+        {
+            std::swap(key.input[0], key.input[1]);
+        }
+        if (node.op == MathOperation::POW) memcpy(&key.bits, &node.exponent, sizeof(key.bits));
+        if (node.constant) memcpy(&key.bits, &node.data, sizeof(key.bits));
+
+        auto found = seen.find(key);
+        if (found == seen.end())
+        {
+            seen.emplace(key, k);
+            continue;
+        }
+        node.replaced_by = found->second;
+        rewrites++;
+    }
+    return rewrites;
+}
+
+// lowers the pass graph to a program for bytecode_forward / bytecode_backward. pool
+// nodes a pass replaced read the register of their replacement, constants get leaves[r] = -1.
+void pass_lower(PassGraph& graph, BytecodeProgram& program)
+{
+    pass_eliminate_dead(graph);
+
+    int count = (int)graph.nodes.size();
+    std::vector<int> register_of_node(count, -1);
+    program.leaves.clear();
+    program.nodes.clear();
+    program.constants.clear();
+    for (int k = 0; k < count; k++)
+    {
+        if (graph.nodes[k].op != MathOperation::NONE) continue;
+        register_of_node[k] = (int)program.leaves.size();
+        program.leaves.push_back(graph.nodes[k].constant ? -1 : graph.nodes[k].source);
+    }
+    program.leaf_count = (int)program.leaves.size();
+    for (int k = 0; k < count; k++)
+    {
+        if (graph.nodes[k].op == MathOperation::NONE) continue;
+        register_of_node[k] = program.leaf_count + (int)program.nodes.size();
+        program.nodes.push_back(graph.nodes[k].source);
+    }
+    program.instruction_count = (int)program.nodes.size();
+    assert(program.leaf_count + program.instruction_count <= (int)BYTECODE_OPERAND_MASK);
+
+    program.code.resize(2 * program.instruction_count);
+    program.data.assign(program.leaf_count + program.instruction_count, 0.f);
+    program.gradient.assign(program.leaf_count + program.instruction_count, 0.f);
+    for (int k = 0; k < count; k++)
+    {
+        PassNode& node = graph.nodes[k];
+        int r = register_of_node[k];
+        if (node.op == MathOperation::NONE)
+        {
+            program.data[r] = node.data;
+            continue;
+        }
+        int i = r - program.leaf_count;
+        uint32_t a = (uint32_t)register_of_node[node.input[0]];
+        uint32_t b = 0;
+        if (node.op == MathOperation::ADD || node.op == MathOperation::MULTIPLE)
+        {
+            b = (uint32_t)register_of_node[node.input[1]];
+        }
+        else if (node.op == MathOperation::POW)
+        {
+            b = (uint32_t)program.constants.size();
+            program.constants.push_back(node.exponent);
+        }
+        program.code[2 * i] = ((uint32_t)node.op << BYTECODE_OP_SHIFT) | a;
+        program.code[2 * i + 1] = b;
+    }
+
+    program.register_of.assign(graph.node_of.size(), -1);
+    for (int i = 0; i < graph.node_of.size(); i++)
+    {
+        if (graph.node_of[i] >= 0) program.register_of[i] = register_of_node[graph.node_of[i]];
+    }
+    program.root = graph.root_source;
+    program.root_register = register_of_node[graph.root];
+    program.forward_kernel = NULL;
+    program.backward_kernel = NULL;
+}
+
+// runs the graph on its captured leaf values without touching the pool. returns the root
+// value and the gradient of every variable leaf, indexed by pool index.
+float pass_evaluate(PassGraph& graph, std::vector<float>& gradient)
+{
+    PassGraph copy = graph;
+    BytecodeProgram program;
+    pass_lower(copy, program);
+    bytecode_run_forward(program);
+    program.gradient[program.root_register] = 1.f;
+    bytecode_run_backward(program);
+    gradient.assign(graph.node_of.size(), 0.f);
+    for (int r = 0; r < program.leaf_count; r++)
+    {
+        if (program.leaves[r] >= 0) gradient[program.leaves[r]] = program.gradient[r];
+    }
+    return program.data[program.root_register];
+}
+
+typedef int (*GraphPassFunction)(PassGraph& graph);
+
+struct GraphPass
+{
+    const char* name;
+    GraphPassFunction run;
+    int rewrite_count = 0;
+    int removed_count = 0;
+};
+
+// runs its passes in order, over and over until none of them rewrites anything. with
+// verify on, every pass is checked against the graph as it was before the first pass:
+// the root value and every variable gradient have to agree within tolerance (relative
+// to magnitudes above 1), a pass that fails is rolled back and the run stops.
+struct PassManager
+{
+    std::vector<GraphPass> passes;
+    bool verify = false;
+    float tolerance = 1e-4f;
+};
+
+void pass_manager_add(PassManager& manager, const char* name, GraphPassFunction run)
+{
+    GraphPass pass;
+    pass.name = name;
+    pass.run = run;
+    manager.passes.push_back(pass);
+}
+
+void pass_manager_init(PassManager& manager, bool verify = false)
+{
+    manager.passes.clear();
+    manager.verify = verify;
+    pass_manager_add(manager, "fold constants", pass_fold_constants);
+    pass_manager_add(manager, "simplify identities", pass_simplify_identities);
+    pass_manager_add(manager, "reduce strength", pass_reduce_strength);
+    pass_manager_add(manager, "merge constant multiplies", pass_merge_constant_multiplies);
+    pass_manager_add(manager, "eliminate common subexpressions", pass_eliminate_common_subexpressions);
+}
+
+bool pass_manager_verify(PassManager& manager, PassGraph& graph, float reference_root, std::vector<float>& reference_gradient, GraphPass& pass)
+{
+    std::vector<float> gradient;
+    float root = pass_evaluate(graph, gradient);
+    float max_error = fabsf(root - reference_root) / fmaxf(1.f, fabsf(reference_root));
+    for (int i = 0; i < gradient.size(); i++)
+    {
+        float error = fabsf(gradient[i] - reference_gradient[i]) / fmaxf(1.f, fabsf(reference_gradient[i]));
+        if (error > max_error || error != error) max_error = error;
+    }
+    if (max_error <= manager.tolerance) return true;
+    fprintf(stderr, "pass %s changed the results, relative error %g!", pass.name, max_error);
+    return false;
+}
+
+bool pass_manager_run(PassManager& manager, PassGraph& graph)
+{
+    std::vector<float> reference_gradient;
+    float reference_root = manager.verify ? pass_evaluate(graph, reference_gradient) : 0.f;
+
+    for (int iteration = 0; iteration < PASS_MAX_ITERATIONS; iteration++)
+    {
+        int rewrites = 0;
+        for (int p = 0; p < manager.passes.size(); p++)
+        {
+            GraphPass& pass = manager.passes[p];
+            PassGraph before;
+            if (manager.verify) before = graph;
+
+            int count = pass.run(graph);
+            int removed = pass_eliminate_dead(graph);
+            if (manager.verify && count > 0 && !pass_manager_verify(manager, graph, reference_root, reference_gradient, pass))
+            {
+                graph = before;
+                return false;
+            }
+            pass.rewrite_count += count;
+            pass.removed_count += removed;
+            rewrites += count;
+        }
+        if (rewrites == 0) break;
+    }
+    return true;
+}
+
+#endif
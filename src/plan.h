@@ -0,0 +1,197 @@
+#ifndef _PLAN_H_
+#define _PLAN_H_
+
+#include "engine.h"
+#include "graph.h"
+#include "bytecode.h"
+#include "passes.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+
+// plans kept by default, training and inference usually cycle through a handful of shapes
+#define PLAN_CACHE_CAPACITY 8
+
+// everything needed to replay one graph shape: the capture with its schedules for
+// graph_forward / graph_backward and the optimized program for bytecode_forward /
+// bytecode_backward. both only hold pool indices, so they stay valid for any tape
+// rebuilt with the same structure at the same indices. signature holds the words the key
+// was hashed from, a hit compares them so a hash collision can not replay a wrong plan.
+struct ExecutionPlan
+{
+    uint64_t key = 0;
+    int value_count = 0;
+    std::vector<uint32_t> signature;
+    uint64_t last_used = 0;
+    Graph graph;
+    BytecodeProgram program;
+};
+
+// execution plans by structural hash, least recently used plan goes first when full.
+// an empty pass manager lowers the capture as is.
+struct PlanCache
+{
+    int capacity = PLAN_CACHE_CAPACITY;
+    std::vector<ExecutionPlan*> plans;
+    PassManager passes;
+    uint64_t clock = 0;
+    int hit_count = 0;
+    int miss_count = 0;
+    int eviction_count = 0;
+    int collision_count = 0;
+    std::vector<unsigned char> mark;
+    std::vector<uint32_t> signature;    // of the last plan_hash
+};
+
+void plan_cache_init(PlanCache& cache, int capacity = PLAN_CACHE_CAPACITY, bool optimize = true)
+{
+    assert(capacity > 0);
+    cache.capacity = capacity;
+    cache.passes.passes.clear();
+    if (optimize) pass_manager_init(cache.passes);
+    cache.clock = 0;
+    cache.hit_count = 0;
+    cache.miss_count = 0;
+    cache.eviction_count = 0;
+    cache.collision_count = 0;
+}
+
+void plan_cache_clear(PlanCache& cache)
+{
+    for (int i = 0; i < cache.plans.size(); i++)
+    {
+        delete cache.plans[i];
+    }
+    cache.plans.clear();
+}
+
+// murmur3's 64 bit finalizer over the running hash and the next word
+uint64_t plan_mix(uint64_t h, uint64_t v)
+{
+    h ^= v;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t plan_word(PlanCache& cache, uint64_t h, uint32_t word)
+{
+    cache.signature.push_back(word);
+    return plan_mix(h, word);
+}
+
+// hash of the graph below root over op codes, exponents and edges (as pool indices), plus
+// which leaves are variables and the values of the other leaves, since the pass pipeline
+// folds those into the program. only the reachability walk of a capture, nothing else.
+// the hashed words are left in cache.signature.
+uint64_t plan_hash(PlanCache& cache, ValueHandle hroot, std::vector<ValueHandle>& variables)
+{
+    assert(valid_value(hroot));
+    Value* values = g_value_pool->values;
+    int count = hroot.idx + 1;
+    const unsigned char REACHABLE = 1;
+    const unsigned char VARIABLE = 2;
+    cache.mark.assign(count, 0);
+    for (int i = 0; i < variables.size(); i++)
+    {
+        if (variables[i].idx < count) cache.mark[variables[i].idx] |= VARIABLE;
+    }
+
+    cache.mark[hroot.idx] |= REACHABLE;
+    cache.signature.clear();
+    uint64_t h = plan_word(cache, 0x9e3779b97f4a7c15ull, (uint32_t)count);
+    for (int i = count - 1; i >= 0; i--)
+    {
+        if (!(cache.mark[i] & REACHABLE)) continue;
+        Value& value = values[i];
+        h = plan_word(cache, h, ((uint32_t)i << 8) | (uint32_t)value.op);
+        if (value.op == MathOperation::POW)
+        {
+            uint32_t bits;
+            memcpy(&bits, &value.exponent, sizeof(bits));
+            h = plan_word(cache, h, bits);
+        }
+        if (value.input.size() == 0)
+        {
+            uint32_t bits = 0xffffffffu;
+            if (!(cache.mark[i] & VARIABLE)) memcpy(&bits, &value.data, sizeof(bits));
+            h = plan_word(cache, h, cache.mark[i] & VARIABLE);
+            h = plan_word(cache, h, bits);
+        }
+        for (int j = 0; j < value.input.size(); j++)
+        {
+            cache.mark[value.input[j].idx] |= REACHABLE;
+            h = plan_word(cache, h, (uint32_t)value.input[j].idx);
+        }
+    }
+    return h;
+}
+
+// capture, optimize and lower, the work a cache hit skips
+void plan_build(PlanCache& cache, ExecutionPlan& plan, ValueHandle hroot, std::vector<ValueHandle>& variables)
+{
+    graph_capture(plan.graph, hroot);
+    if (cache.passes.passes.size() == 0)
+    {
+        bytecode_compile(plan.program, plan.graph);
+        return;
+    }
+    PassGraph pass_graph;
+    pass_capture(pass_graph, plan.graph, variables);
+    pass_manager_run(cache.passes, pass_graph);
+    pass_lower(pass_graph, plan.program);
+}
+
+// the plan for the graph below root, built on a miss. variables are the leaves that change
+// between replays (parameters, inputs, targets), every other leaf is part of the key.
+// the plan stays owned by the cache and valid until it is evicted.
+ExecutionPlan* plan_cache_get(PlanCache& cache, ValueHandle hroot, std::vector<ValueHandle>& variables)
+{
+    evaluate_pending();
+    uint64_t key = plan_hash(cache, hroot, variables);
+    cache.clock++;
+    for (int i = 0; i < cache.plans.size(); i++)
+    {
+        ExecutionPlan* plan = cache.plans[i];
+        if (plan->key != key || plan->value_count != hroot.idx + 1) continue;
+        if (plan->signature != cache.signature)
+        {
+            cache.collision_count++;
+            continue;
+        }
+        plan->last_used = cache.clock;
+        cache.hit_count++;
+        return plan;
+    }
+
+    cache.miss_count++;
+    ExecutionPlan* plan = NULL;
+    if (cache.plans.size() < cache.capacity)
+    {
+        plan = new ExecutionPlan();
+        cache.plans.push_back(plan);
+    }
+    else
+    {
+        int oldest = 0;
+        for (int i = 1; i < cache.plans.size(); i++)
+        {
+            if (cache.plans[i]->last_used < cache.plans[oldest]->last_used) oldest = i;
+        }
+        plan = cache.plans[oldest];
+        *plan = ExecutionPlan();
+        cache.eviction_count++;
+    }
+    plan->key = key;
+    plan->value_count = hroot.idx + 1;
+    plan->signature = cache.signature;
+    plan->last_used = cache.clock;
+    plan_build(cache, *plan, hroot, variables);
+    return plan;
+}
+
+#endif
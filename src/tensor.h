@@ -0,0 +1,716 @@
+#ifndef _TENSOR_H_
+#define _TENSOR_H_
+
+#include "engine.h"
+#include "gemm.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#if defined(_WIN32)
+#include <malloc.h>
+#endif
+
+#define TENSOR_MAX_RANK 4
+// bytes, a buffer starts on a cache line and fits the widest vector loads
+#define TENSOR_ALIGNMENT 64
+
+enum TensorOperation
+{
+    TENSOR_LEAF = 0,
+    TENSOR_PACK,        // gathers scalar values, one per element
+    TENSOR_ADD,
+    TENSOR_SUB,
+    TENSOR_MUL,
+    TENSOR_POW,
+    TENSOR_EXP,
+    TENSOR_TANH,
+    TENSOR_RELU,
+    TENSOR_MATMUL,
+    TENSOR_SUM,
+    TENSOR_MEAN,
+    TENSOR_VIEW,        // shares the storage of its input, see tensor_view
+    TENSOR_COPY,        // contiguous copy of its input, for layouts a view can not express
+};
+
+// the payload of a node with op TENSOR. elements are addressed through stride (in elements),
+// data and gradient share one layout. a view points both into its parent's buffer. a rank 0 tensor (sum, mean) lives in the data and
+// gradient of its Value, so scalar ops take it as is. everything else owns an aligned
+// buffer holding data and gradient, kept when the record is reused and grown on demand.
+struct Tensor
+{
+    TensorOperation op = TensorOperation::TENSOR_LEAF;
+    int rank = 0;
+    int shape[TENSOR_MAX_RANK] = {};
+    int stride[TENSOR_MAX_RANK] = {};
+    int size = 1;
+    float* data = NULL;
+    float* gradient = NULL;
+    float* storage = NULL;
+    int capacity = 0;
+    // the node holding this record, stale once its pool is rewound below it
+    ValuePool* pool = NULL;
+    int value = -1;
+};
+
+float* tensor_aligned_alloc(int count)
+{
+    size_t bytes = ((size_t)count * sizeof(float) + TENSOR_ALIGNMENT - 1) / TENSOR_ALIGNMENT * TENSOR_ALIGNMENT;
+#if defined(_WIN32)
+    return (float*)_aligned_malloc(bytes, TENSOR_ALIGNMENT);
+#else
+    return (float*)aligned_alloc(TENSOR_ALIGNMENT, bytes);
+#endif
+}
+
+void tensor_aligned_free(float* p)
+{
+#if defined(_WIN32)
+    _aligned_free(p);
+#else
+    free(p);
+#endif
+}
+
+#ifndef MAX_TENSOR_NUMBER
+#define MAX_TENSOR_NUMBER 1024
+#endif
+struct TensorPool
+{
+    int tensor_count = 0;
+    Tensor tensors[MAX_TENSOR_NUMBER];
+
+    ~TensorPool()
+    {
+        for (int i = 0; i < MAX_TENSOR_NUMBER; i++)
+        {
+            if (tensors[i].storage) tensor_aligned_free(tensors[i].storage);
+        }
+    }
+};
+// one per thread like the value pool. there is no scope of its own: records are handed out
+// in tape order, so the ones whose nodes a TEMP_VALUE_POOL_END (or any rewind) dropped sit
+// on top and are taken back by the next tensor_value.
+thread_local TensorPool g_tensor_pool;
+
+// matmuls split their blocks over this pool when set, the calling thread joins in. per
+// thread like the records and g_graph_lazy_pool, so a task on that pool never sees it set
+// and runs its matmuls inline instead of waiting on its own pool.
+thread_local ThreadPool* g_tensor_thread_pool = NULL;
+
+Tensor* get_tensor(ValueHandle h)
+{
+    Value* value = get_value(h);
+    assert(value->op == MathOperation::TENSOR && value->tensor >= 0);
+    return &g_tensor_pool.tensors[value->tensor];
+}
+
+// the tensor of a node without evaluating it, for shapes and for operands while their
+// consumer is computed
+Tensor& tensor_of(ValueHandle h)
+{
+    assert(h.idx >= 0 && h.idx < g_value_pool->value_count);
+    Value& value = g_value_pool->values[h.idx];
+    assert(value.op == MathOperation::TENSOR);
+    return g_tensor_pool.tensors[value.tensor];
+}
+
+bool tensor_is_contiguous(Tensor& tensor)
+{
+    int expected = 1;
+    for (int d = tensor.rank - 1; d >= 0; d--)
+    {
+        if (tensor.shape[d] != 1 && tensor.stride[d] != expected) return false;
+        expected *= tensor.shape[d];
+    }
+    return true;
+}
+
+// a TENSOR value with the next record, after taking back the records of rewound nodes
+ValueHandle tensor_value()
+{
+    assert(g_tensor_calc_data != NULL);
+    if (g_tensor_calc_data == NULL)
+    {
+        fprintf(stderr, "tensor hooks are not installed, call tensor_init! create tensor failed!");
+        return ValueHandle{ .idx = -1 };
+    }
+    TensorPool& pool = g_tensor_pool;
+    while (pool.tensor_count > 0)
+    {
+        Tensor& top = pool.tensors[pool.tensor_count - 1];
+        if (top.pool != g_value_pool) break;
+        if (top.value < g_value_pool->value_count && g_value_pool->values[top.value].tensor == pool.tensor_count - 1) break;
+        pool.tensor_count--;
+    }
+    assert(pool.tensor_count < MAX_TENSOR_NUMBER - 1);
+    if (pool.tensor_count == MAX_TENSOR_NUMBER - 1)
+    {
+        fprintf(stderr, "tensor pool reach maximum capacity %d! create tensor failed!", MAX_TENSOR_NUMBER);
+        return ValueHandle{ .idx = -1 };
+    }
+
+    ValueHandle h = create_value(0.f, MathOperation::TENSOR);
+    if (h.idx < 0) return h;
+    g_value_pool->values[h.idx].tensor = pool.tensor_count;
+    Tensor& tensor = pool.tensors[pool.tensor_count++];
+    tensor.pool = g_value_pool;
+    tensor.value = h.idx;
+    return h;
+}
+
+// a new tensor node with contiguous storage, gradient zeroed, data left as is
+ValueHandle tensor_node(TensorOperation op, int rank, const int* shape)
+{
+    assert(rank >= 0 && rank <= TENSOR_MAX_RANK);
+
+    ValueHandle h = tensor_value();
+    if (h.idx < 0) return h;
+    Value& value = g_value_pool->values[h.idx];
+    Tensor& tensor = g_tensor_pool.tensors[value.tensor];
+    tensor.op = op;
+    tensor.rank = rank;
+    tensor.size = 1;
+    for (int d = rank - 1; d >= 0; d--)
+    {
+        assert(shape[d] > 0);
+        tensor.shape[d] = shape[d];
+        tensor.stride[d] = tensor.size;
+        tensor.size *= shape[d];
+    }
+
+    if (rank == 0)
+    {
+        tensor.data = &value.data;
+        tensor.gradient = &value.gradient;
+        return h;
+    }
+    // gradient starts on its own cache line
+    int padded = (tensor.size + TENSOR_ALIGNMENT / sizeof(float) - 1) / (TENSOR_ALIGNMENT / sizeof(float)) * (TENSOR_ALIGNMENT / sizeof(float));
+    if (tensor.capacity < 2 * padded)
+    {
+        if (tensor.storage) tensor_aligned_free(tensor.storage);
+        tensor.storage = tensor_aligned_alloc(2 * padded);
+        tensor.capacity = 2 * padded;
+    }
+    tensor.data = tensor.storage;
+    tensor.gradient = tensor.storage + padded;
+    memset(tensor.gradient, 0, tensor.size * sizeof(float));
+    return h;
+}
+
+// leaf tensor, row major data or zeros
+ValueHandle create_tensor(std::vector<int> shape, const float* data = NULL)
+{
+    ValueHandle h = tensor_node(TensorOperation::TENSOR_LEAF, (int)shape.size(), shape.data());
+    Tensor& tensor = tensor_of(h);
+    if (data) memcpy(tensor.data, data, tensor.size * sizeof(float));
+    else memset(tensor.data, 0, tensor.size * sizeof(float));
+    return h;
+}
+
+void tensor_zero_grad(ValueHandle h)
+{
+    Tensor* tensor = get_tensor(h);
+    if (tensor_is_contiguous(*tensor))
+    {
+        memset(tensor->gradient, 0, tensor->size * sizeof(float));
+        return;
+    }
+    for (int i = 0; i < tensor->size; i++)
+    {
+        int offset = 0;
+        for (int d = tensor->rank - 1, rest = i; d >= 0; rest /= tensor->shape[d], d--)
+        {
+            offset += rest % tensor->shape[d] * tensor->stride[d];
+        }
+        tensor->gradient[offset] = 0.f;
+    }
+}
+
+// strides of t when read as a tensor of shape[TENSOR_MAX_RANK]: dims are aligned to the
+// right and a dim of size 1 is broadcast with stride 0
+void tensor_broadcast_strides(Tensor& t, const int* shape, int* stride)
+{
+    int pad = TENSOR_MAX_RANK - t.rank;
+    for (int d = 0; d < TENSOR_MAX_RANK; d++)
+    {
+        int size = d < pad ? 1 : t.shape[d - pad];
+        assert(size == shape[d] || size == 1);
+        stride[d] = size == 1 ? 0 : t.stride[d - pad];
+    }
+}
+
+// calls fn(o, a, b) with the element offsets of every position of shape, row major
+template <typename F>
+void tensor_for_each(const int* shape, const int* so, const int* sa, const int* sb, F fn)
+{
+    for (int i0 = 0; i0 < shape[0]; i0++)
+    {
+        for (int i1 = 0; i1 < shape[1]; i1++)
+        {
+            for (int i2 = 0; i2 < shape[2]; i2++)
+            {
+                int o = i0 * so[0] + i1 * so[1] + i2 * so[2];
+                int a = i0 * sa[0] + i1 * sa[1] + i2 * sa[2];
+                int b = i0 * sb[0] + i1 * sb[1] + i2 * sb[2];
+                for (int i3 = 0; i3 < shape[3]; i3++)
+                {
+                    fn(o + i3 * so[3], a + i3 * sa[3], b + i3 * sb[3]);
+                }
+            }
+        }
+    }
+}
+
+// output shape and operand strides of an elementwise node, in TENSOR_MAX_RANK dims
+void tensor_elementwise_layout(Value* out, int* shape, int* so, int* sa, int* sb)
+{
+    Tensor& o = g_tensor_pool.tensors[out->tensor];
+    int pad = TENSOR_MAX_RANK - o.rank;
+    for (int d = 0; d < TENSOR_MAX_RANK; d++)
+    {
+        shape[d] = d < pad ? 1 : o.shape[d - pad];
+    }
+    tensor_broadcast_strides(o, shape, so);
+    tensor_broadcast_strides(tensor_of(out->input[0]), shape, sa);
+    if (out->input.size() > 1) tensor_broadcast_strides(tensor_of(out->input[1]), shape, sb);
+    else memcpy(sb, sa, sizeof(int) * TENSOR_MAX_RANK);
+}
+
+// operands may be strided views (a transpose is just swapped strides), the result is contiguous
+void tensor_matmul_forward(Tensor& a, Tensor& b, Tensor& c)
+{
+    int m = a.shape[0];
+    int k = a.shape[1];
+    int n = b.shape[1];
+    gemm(m, n, k, a.data, a.stride[0], a.stride[1], b.data, b.stride[0], b.stride[1], c.data, n, 1, false, g_tensor_thread_pool);
+}
+
+// dA += dC * B^T, dB += A^T * dC, the transposes are swapped strides
+void tensor_matmul_backward(Tensor& a, Tensor& b, Tensor& c)
+{
+    int m = a.shape[0];
+    int k = a.shape[1];
+    int n = b.shape[1];
+    int a0 = a.stride[0], a1 = a.stride[1];
+    int b0 = b.stride[0], b1 = b.stride[1];
+    gemm(m, k, n, c.gradient, n, 1, b.data, b1, b0, a.gradient, a0, a1, true, g_tensor_thread_pool);
+    gemm(k, n, m, a.data, a1, a0, c.gradient, n, 1, b.gradient, b0, b1, true, g_tensor_thread_pool);
+}
+
+// row major strides of a shape, padded to TENSOR_MAX_RANK dims like tensor_broadcast_strides
+void tensor_padded_layout(Tensor& t, int* shape, int* stride, int* contiguous)
+{
+    int pad = TENSOR_MAX_RANK - t.rank;
+    int size = 1;
+    for (int d = TENSOR_MAX_RANK - 1; d >= 0; d--)
+    {
+        shape[d] = d < pad ? 1 : t.shape[d - pad];
+        stride[d] = d < pad ? 0 : t.stride[d - pad];
+        contiguous[d] = size;
+        size *= shape[d];
+    }
+}
+
+void tensor_calc_data(Value* out)
+{
+    Tensor& o = g_tensor_pool.tensors[out->tensor];
+    int shape[TENSOR_MAX_RANK], so[TENSOR_MAX_RANK], sa[TENSOR_MAX_RANK], sb[TENSOR_MAX_RANK];
+    float* od = o.data;
+    switch(o.op)
+    {
+    case TensorOperation::TENSOR_PACK:
+        for (int i = 0; i < o.size; i++)
+        {
+            od[i] = g_value_pool->values[out->input[i].idx].data;
+        }
+        break;
+    case TensorOperation::TENSOR_ADD:
+    case TensorOperation::TENSOR_SUB:
+    case TensorOperation::TENSOR_MUL:
+        {
+            const float* ad = tensor_of(out->input[0]).data;
+            const float* bd = tensor_of(out->input[1]).data;
+            tensor_elementwise_layout(out, shape, so, sa, sb);
+            if (o.op == TensorOperation::TENSOR_ADD) tensor_for_each(shape, so, sa, sb, [&](int i, int x, int y) { od[i] = ad[x] + bd[y]; });
+            else if (o.op == TensorOperation::TENSOR_SUB) tensor_for_each(shape, so, sa, sb, [&](int i, int x, int y) { od[i] = ad[x] - bd[y]; });
+            else tensor_for_each(shape, so, sa, sb, [&](int i, int x, int y) { od[i] = ad[x] * bd[y]; });
+        }
+        break;
+    case TensorOperation::TENSOR_POW:
+    case TensorOperation::TENSOR_EXP:
+    case TensorOperation::TENSOR_TANH:
+    case TensorOperation::TENSOR_RELU:
+        {
+            const float* ad = tensor_of(out->input[0]).data;
+            float e = out->exponent;
+            tensor_elementwise_layout(out, shape, so, sa, sb);
+            switch(o.op)
+            {
+            case TensorOperation::TENSOR_POW: tensor_for_each(shape, so, sa, sb, [&](int i, int x, int) { od[i] = powf(ad[x], e); }); break;
+            case TensorOperation::TENSOR_EXP: tensor_for_each(shape, so, sa, sb, [&](int i, int x, int) { od[i] = expf(ad[x]); }); break;
+            case TensorOperation::TENSOR_TANH: tensor_for_each(shape, so, sa, sb, [&](int i, int x, int) { od[i] = tanhf(ad[x]); }); break;
+            default: tensor_for_each(shape, so, sa, sb, [&](int i, int x, int) { od[i] = ad[x] < 0 ? 0 : ad[x]; }); break;
+            }
+        }
+        break;
+    case TensorOperation::TENSOR_MATMUL:
+        tensor_matmul_forward(tensor_of(out->input[0]), tensor_of(out->input[1]), o);
+        break;
+    case TensorOperation::TENSOR_COPY:
+        {
+            // the input in row major order, whatever its strides
+            Tensor& a = tensor_of(out->input[0]);
+            int contiguous[TENSOR_MAX_RANK];
+            tensor_padded_layout(a, shape, sa, contiguous);
+            tensor_for_each(shape, contiguous, sa, sa, [&](int i, int x, int) { od[i] = a.data[x]; });
+        }
+        break;
+    case TensorOperation::TENSOR_SUM:
+    case TensorOperation::TENSOR_MEAN:
+        {
+            Tensor& a = tensor_of(out->input[0]);
+            for (int d = 0; d < TENSOR_MAX_RANK; d++)
+            {
+                shape[d] = d < TENSOR_MAX_RANK - a.rank ? 1 : a.shape[d - (TENSOR_MAX_RANK - a.rank)];
+            }
+            tensor_broadcast_strides(a, shape, sa);
+            float sum = 0.f;
+            tensor_for_each(shape, sa, sa, sa, [&](int i, int, int) { sum += a.data[i]; });
+            *od = o.op == TensorOperation::TENSOR_SUM ? sum : sum / a.size;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void tensor_calc_gradient(Value* out)
+{
+    Tensor& o = g_tensor_pool.tensors[out->tensor];
+    int shape[TENSOR_MAX_RANK], so[TENSOR_MAX_RANK], sa[TENSOR_MAX_RANK], sb[TENSOR_MAX_RANK];
+    const float* od = o.data;
+    const float* og = o.gradient;
+    switch(o.op)
+    {
+    case TensorOperation::TENSOR_PACK:
+        for (int i = 0; i < o.size; i++)
+        {
+            g_value_pool->values[out->input[i].idx].gradient += og[i];
+        }
+        break;
+    case TensorOperation::TENSOR_ADD:
+    case TensorOperation::TENSOR_SUB:
+    case TensorOperation::TENSOR_MUL:
+        {
+            Tensor& a = tensor_of(out->input[0]);
+            Tensor& b = tensor_of(out->input[1]);
+            float* ag = a.gradient;
+            float* bg = b.gradient;
+            tensor_elementwise_layout(out, shape, so, sa, sb);
+            // a broadcast operand has stride 0 along the broadcast dims, its pushes add up there
+            if (o.op == TensorOperation::TENSOR_ADD)
+            {
+                tensor_for_each(shape, so, sa, sb, [&](int i, int x, int y) { ag[x] += 1.f * og[i]; bg[y] += 1.f * og[i]; });
+            }
+            else if (o.op == TensorOperation::TENSOR_SUB)
+            {
+                tensor_for_each(shape, so, sa, sb, [&](int i, int x, int y) { ag[x] += 1.f * og[i]; bg[y] += -1.f * og[i]; });
+            }
+            else
+            {
+                const float* ad = a.data;
+                const float* bd = b.data;
+                tensor_for_each(shape, so, sa, sb, [&](int i, int x, int y) { ag[x] += bd[y] * og[i]; bg[y] += ad[x] * og[i]; });
+            }
+        }
+        break;
+    case TensorOperation::TENSOR_POW:
+    case TensorOperation::TENSOR_EXP:
+    case TensorOperation::TENSOR_TANH:
+    case TensorOperation::TENSOR_RELU:
+        {
+            Tensor& a = tensor_of(out->input[0]);
+            const float* ad = a.data;
+            float* ag = a.gradient;
+            float e = out->exponent;
+            tensor_elementwise_layout(out, shape, so, sa, sb);
+            switch(o.op)
+            {
+            case TensorOperation::TENSOR_POW:
+                tensor_for_each(shape, so, sa, sb, [&](int i, int x, int) { ag[x] += e * powf(ad[x], e - 1.f) * og[i]; });
+                break;
+            case TensorOperation::TENSOR_EXP:
+                tensor_for_each(shape, so, sa, sb, [&](int i, int x, int) { ag[x] += od[i] * og[i]; });
+                break;
+            case TensorOperation::TENSOR_TANH:
+                tensor_for_each(shape, so, sa, sb, [&](int i, int x, int) { ag[x] += (1.f - powf(od[i], 2)) * og[i]; });
+                break;
+            default:
+                tensor_for_each(shape, so, sa, sb, [&](int i, int x, int) { ag[x] += (ad[x] < 0 ? 0 : 1) * og[i]; });
+                break;
+            }
+        }
+        break;
+    case TensorOperation::TENSOR_MATMUL:
+        tensor_matmul_backward(tensor_of(out->input[0]), tensor_of(out->input[1]), o);
+        break;
+    case TensorOperation::TENSOR_COPY:
+        {
+            Tensor& a = tensor_of(out->input[0]);
+            int contiguous[TENSOR_MAX_RANK];
+            tensor_padded_layout(a, shape, sa, contiguous);
+            tensor_for_each(shape, contiguous, sa, sa, [&](int i, int x, int) { a.gradient[x] += og[i]; });
+        }
+        break;
+    case TensorOperation::TENSOR_SUM:
+    case TensorOperation::TENSOR_MEAN:
+        {
+            Tensor& a = tensor_of(out->input[0]);
+            for (int d = 0; d < TENSOR_MAX_RANK; d++)
+            {
+                shape[d] = d < TENSOR_MAX_RANK - a.rank ? 1 : a.shape[d - (TENSOR_MAX_RANK - a.rank)];
+            }
+            tensor_broadcast_strides(a, shape, sa);
+            float g = o.op == TensorOperation::TENSOR_SUM ? *og : *og / a.size;
+            tensor_for_each(shape, sa, sa, sa, [&](int i, int, int) { a.gradient[i] += g; });
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+// hooks tensor nodes into calc_data and backward, call once before creating tensors
+void tensor_init()
+{
+    g_tensor_calc_data = tensor_calc_data;
+    g_tensor_calc_gradient = tensor_calc_gradient;
+}
+
+// shape of the elementwise result of a and b, numpy style broadcasting
+void tensor_broadcast_shape(Tensor& a, Tensor& b, int& rank, int* shape)
+{
+    rank = a.rank > b.rank ? a.rank : b.rank;
+    for (int d = 0; d < rank; d++)
+    {
+        int da = d - (rank - a.rank);
+        int db = d - (rank - b.rank);
+        int sa = da >= 0 ? a.shape[da] : 1;
+        int sb = db >= 0 ? b.shape[db] : 1;
+        assert(sa == sb || sa == 1 || sb == 1);
+        shape[d] = sa > sb ? sa : sb;
+    }
+}
+
+ValueHandle tensor_binary(TensorOperation op, ValueHandle ha, ValueHandle hb)
+{
+    int rank;
+    int shape[TENSOR_MAX_RANK];
+    tensor_broadcast_shape(tensor_of(ha), tensor_of(hb), rank, shape);
+    ValueHandle ho = tensor_node(op, rank, shape);
+    Value* out = &g_value_pool->values[ho.idx];
+    out->input.push_back(ha);
+    out->input.push_back(hb);
+    record_value(ho);
+    return ho;
+}
+
+ValueHandle tensor_unary(TensorOperation op, ValueHandle ha, float exponent = 0.f)
+{
+    Tensor& a = tensor_of(ha);
+    ValueHandle ho = tensor_node(op, a.rank, a.shape);
+    Value* out = &g_value_pool->values[ho.idx];
+    out->exponent = exponent;
+    out->input.push_back(ha);
+    record_value(ho);
+    return ho;
+}
+
+ValueHandle tensor_add(ValueHandle ha, ValueHandle hb)
+{
+    return tensor_binary(TensorOperation::TENSOR_ADD, ha, hb);
+}
+
+ValueHandle tensor_sub(ValueHandle ha, ValueHandle hb)
+{
+    return tensor_binary(TensorOperation::TENSOR_SUB, ha, hb);
+}
+
+ValueHandle tensor_mul(ValueHandle ha, ValueHandle hb)
+{
+    return tensor_binary(TensorOperation::TENSOR_MUL, ha, hb);
+}
+
+ValueHandle tensor_pow(ValueHandle ha, float s)
+{
+    return tensor_unary(TensorOperation::TENSOR_POW, ha, s);
+}
+
+ValueHandle tensor_exp(ValueHandle ha)
+{
+    return tensor_unary(TensorOperation::TENSOR_EXP, ha);
+}
+
+ValueHandle tensor_tanh(ValueHandle ha)
+{
+    return tensor_unary(TensorOperation::TENSOR_TANH, ha);
+}
+
+ValueHandle tensor_relu(ValueHandle ha)
+{
+    return tensor_unary(TensorOperation::TENSOR_RELU, ha);
+}
+
+// [m, k] x [k, n] -> [m, n]
+ValueHandle tensor_matmul(ValueHandle ha, ValueHandle hb)
+{
+    Tensor& a = tensor_of(ha);
+    Tensor& b = tensor_of(hb);
+    assert(a.rank == 2 && b.rank == 2 && a.shape[1] == b.shape[0]);
+    int shape[2] = { a.shape[0], b.shape[1] };
+    ValueHandle ho = tensor_node(TensorOperation::TENSOR_MATMUL, 2, shape);
+    Value* out = &g_value_pool->values[ho.idx];
+    out->input.push_back(ha);
+    out->input.push_back(hb);
+    record_value(ho);
+    return ho;
+}
+
+// sum and mean of all elements, rank 0 results that scalar ops take directly
+ValueHandle tensor_sum(ValueHandle ha)
+{
+    tensor_of(ha);
+    ValueHandle ho = tensor_node(TensorOperation::TENSOR_SUM, 0, NULL);
+    g_value_pool->values[ho.idx].input.push_back(ha);
+    record_value(ho);
+    return ho;
+}
+
+ValueHandle tensor_mean(ValueHandle ha)
+{
+    tensor_of(ha);
+    ValueHandle ho = tensor_node(TensorOperation::TENSOR_MEAN, 0, NULL);
+    g_value_pool->values[ho.idx].input.push_back(ha);
+    record_value(ho);
+    return ho;
+}
+
+// a tensor over existing scalar values, row major. gradients flow back into the values.
+ValueHandle tensor_pack(std::vector<ValueHandle>& values, std::vector<int> shape)
+{
+    ValueHandle ho = tensor_node(TensorOperation::TENSOR_PACK, (int)shape.size(), shape.data());
+    assert(g_tensor_pool.tensors[g_value_pool->values[ho.idx].tensor].size == values.size());
+    Value* out = &g_value_pool->values[ho.idx];
+    out->input = values;
+    record_value(ho);
+    return ho;
+}
+
+// a node over the storage of parent: data and gradient point into the parent's buffers at
+// offset, read through shape and stride. nothing is computed or pushed for a view, its
+// consumers write their gradients straight into the parent, stride 0 dims add up there.
+ValueHandle tensor_view(ValueHandle parent, int rank, const int* shape, const int* stride, int offset)
+{
+    assert(rank >= 0 && rank <= TENSOR_MAX_RANK);
+
+    ValueHandle h = tensor_value();
+    if (h.idx < 0) return h;
+    Tensor& p = tensor_of(parent);
+    Value& value = g_value_pool->values[h.idx];
+    value.input.push_back(parent);
+    Tensor& tensor = g_tensor_pool.tensors[value.tensor];
+    tensor.op = TensorOperation::TENSOR_VIEW;
+    tensor.rank = rank;
+    tensor.size = 1;
+    for (int d = 0; d < rank; d++)
+    {
+        assert(shape[d] > 0);
+        tensor.shape[d] = shape[d];
+        tensor.stride[d] = stride[d];
+        tensor.size *= shape[d];
+    }
+    tensor.data = p.data + offset;
+    tensor.gradient = p.gradient + offset;
+    record_value(h);
+    return h;
+}
+
+// elements [begin, end) along dim
+ValueHandle tensor_slice(ValueHandle h, int dim, int begin, int end)
+{
+    Tensor& t = tensor_of(h);
+    assert(dim >= 0 && dim < t.rank && 0 <= begin && begin < end && end <= t.shape[dim]);
+    int shape[TENSOR_MAX_RANK];
+    memcpy(shape, t.shape, sizeof(shape));
+    shape[dim] = end - begin;
+    return tensor_view(h, t.rank, shape, t.stride, begin * t.stride[dim]);
+}
+
+ValueHandle tensor_transpose(ValueHandle h, int dim0 = 0, int dim1 = 1)
+{
+    Tensor& t = tensor_of(h);
+    assert(dim0 >= 0 && dim0 < t.rank && dim1 >= 0 && dim1 < t.rank);
+    int shape[TENSOR_MAX_RANK];
+    int stride[TENSOR_MAX_RANK];
+    memcpy(shape, t.shape, sizeof(shape));
+    memcpy(stride, t.stride, sizeof(stride));
+    shape[dim0] = t.shape[dim1];
+    shape[dim1] = t.shape[dim0];
+    stride[dim0] = t.stride[dim1];
+    stride[dim1] = t.stride[dim0];
+    return tensor_view(h, t.rank, shape, stride, 0);
+}
+
+// h itself when contiguous, otherwise a copy in row major order that scatters its gradient back
+ValueHandle tensor_contiguous(ValueHandle h)
+{
+    Tensor& t = tensor_of(h);
+    if (tensor_is_contiguous(t)) return h;
+    ValueHandle copy = tensor_node(TensorOperation::TENSOR_COPY, t.rank, t.shape);
+    g_value_pool->values[copy.idx].input.push_back(h);
+    record_value(copy);
+    return copy;
+}
+
+// the same elements in row major order under a new shape. a view when the input is
+// contiguous, otherwise the elements are copied once and the copy is viewed.
+ValueHandle tensor_reshape(ValueHandle h, std::vector<int> shape)
+{
+    Tensor& t = tensor_of(h);
+    int rank = (int)shape.size();
+    assert(rank <= TENSOR_MAX_RANK);
+    int stride[TENSOR_MAX_RANK];
+    int size = 1;
+    for (int d = rank - 1; d >= 0; d--)
+    {
+        stride[d] = size;
+        size *= shape[d];
+    }
+    assert(size == t.size);
+    return tensor_view(tensor_contiguous(h), rank, shape.data(), stride, 0);
+}
+
+// repeats the tensor along new leading dims and along dims of size 1, numpy style
+ValueHandle tensor_broadcast(ValueHandle h, std::vector<int> shape)
+{
+    Tensor& t = tensor_of(h);
+    int rank = (int)shape.size();
+    assert(rank >= t.rank && rank <= TENSOR_MAX_RANK);
+    int stride[TENSOR_MAX_RANK];
+    int pad = rank - t.rank;
+    for (int d = 0; d < rank; d++)
+    {
+        int size = d < pad ? 1 : t.shape[d - pad];
+        assert(size == shape[d] || size == 1);
+        stride[d] = size == 1 ? 0 : t.stride[d - pad];
+    }
+    return tensor_view(h, rank, shape.data(), stride, 0);
+}
+
+#endif
@@ -0,0 +1,444 @@
+#ifndef _TRAIN_H_
+#define _TRAIN_H_
+
+#include "engine.h"
+#include "nn.h"
+#include "optim.h"
+#include "parallel.h"
+
+#include <atomic>
+#include <vector>
+
+#define TRAINER_REDUCE_CHUNK 4096
+// samples per gradient shard, fixed so the reduction tree does not depend on the thread count
+#define TRAINER_SHARD_SIZE 8
+
+enum GradientReduction
+{
+    GRADIENT_REDUCE_TREE = 0, // per shard buffers summed in a fixed pairwise tree, bit identical for any thread count
+    GRADIENT_REDUCE_ATOMIC,   // every shard fetch_adds into one buffer, order (and rounding) depends on scheduling
+};
+
+// splits every minibatch into shards of shard_size samples. a shard is built and
+// backpropagated in the private value pool of whichever worker runs it, that pool
+// starts as a copy of the main pool (so parameter handles stay valid). the per shard
+// gradients are then summed and the optimizer runs once on the main pool.
+struct DataParallelTrainer
+{
+    MLP* mlp = NULL;
+    Optimizer* optimizer = NULL;
+    ThreadPool pool;
+    int thread_count = 0;
+    int shard_size = TRAINER_SHARD_SIZE;
+    GradientReduction reduction = GradientReduction::GRADIENT_REDUCE_TREE;
+    std::vector<ValueHandle> parameters;
+    std::vector<ValuePool*> value_pools;       // one per worker
+    std::vector<std::vector<float>> gradients; // one per shard
+    std::vector<float> losses;                 // one per shard
+};
+
+// workers run the scalar forward on copies of the main value pool and reduce one gradient
+// per parameter handle, a tensor layer fits neither: its records live in the creating
+// thread's tensor pool and its handles are whole tensors
+bool trainer_init(DataParallelTrainer& trainer, MLP& mlp, Optimizer& optimizer, int thread_count)
+{
+    assert(thread_count >= 1);
+    assert(!mlp_has_tensor_layer(mlp));
+    if (mlp_has_tensor_layer(mlp))
+    {
+        fprintf(stderr, "mlp has tensor layers, trainer workers run scalar layers only! trainer init failed!");
+        return false;
+    }
+    trainer.mlp = &mlp;
+    trainer.optimizer = &optimizer;
+    trainer.thread_count = thread_count;
+    trainer.parameters = mlp_parameters(mlp);
+    thread_pool_init(trainer.pool, thread_count);
+
+    // everything that exists now (parameters included) is copied into the worker pools,
+    // values created later on the main pool are not visible to the workers
+    evaluate_pending();
+    int persistent_count = g_value_pool->value_count;
+    for (int i = 0; i < trainer.parameters.size(); i++)
+    {
+        assert(trainer.parameters[i].idx < persistent_count);
+    }
+
+    trainer.value_pools.resize(trainer.thread_count);
+    for (int i = 0; i < trainer.thread_count; i++)
+    {
+        ValuePool* value_pool = new ValuePool;
+        for (int j = 0; j < persistent_count; j++)
+        {
+            value_pool->values[j] = g_value_pool->values[j];
+        }
+        value_pool->value_count = persistent_count;
+        value_pool->peak_value_count = persistent_count;
+        value_pool->evaluated_count = persistent_count;
+        trainer.value_pools[i] = value_pool;
+    }
+    return true;
+}
+
+void trainer_shutdown(DataParallelTrainer& trainer)
+{
+    thread_pool_shutdown(trainer.pool);
+    for (int i = 0; i < trainer.value_pools.size(); i++)
+    {
+        delete trainer.value_pools[i];
+    }
+    trainer.value_pools.clear();
+    trainer.gradients.clear();
+}
+
+// sums gradients[i + stride] into gradients[i] for every pair of the level,
+// split in chunks so a single pair of large shards still spreads over the workers.
+// the pairing only depends on the shard count, never on which thread ran what.
+void trainer_reduce_gradients(DataParallelTrainer& trainer, int shard_count)
+{
+    int parameter_count = (int)trainer.parameters.size();
+    int chunk_count = (parameter_count + TRAINER_REDUCE_CHUNK - 1) / TRAINER_REDUCE_CHUNK;
+    for (int stride = 1; stride < shard_count; stride *= 2)
+    {
+        std::vector<int> pairs;
+        for (int i = 0; i + stride < shard_count; i += 2 * stride)
+        {
+            pairs.push_back(i);
+        }
+
+        thread_pool_run(trainer.pool, (int)pairs.size() * chunk_count, [&](int task, int worker) {
+            int dst = pairs[task / chunk_count];
+            int begin = (task % chunk_count) * TRAINER_REDUCE_CHUNK;
+            int end = begin + TRAINER_REDUCE_CHUNK < parameter_count ? begin + TRAINER_REDUCE_CHUNK : parameter_count;
+            float* a = trainer.gradients[dst].data();
+            float* b = trainer.gradients[dst + stride].data();
+            for (int k = begin; k < end; k++)
+            {
+                a[k] += b[k];
+            }
+        });
+    }
+}
+
+// one synchronous step over the minibatch, returns the summed loss
+float trainer_step(DataParallelTrainer& trainer, std::vector<std::vector<float>>& input, std::vector<std::vector<float>>& expect)
+{
+    assert(input.size() == expect.size());
+    assert(trainer.shard_size > 0);
+    int sample_count = (int)input.size();
+    int parameter_count = (int)trainer.parameters.size();
+    int shard_count = (sample_count + trainer.shard_size - 1) / trainer.shard_size;
+    bool atomic = trainer.reduction == GradientReduction::GRADIENT_REDUCE_ATOMIC;
+
+    int buffer_count = atomic ? 1 : shard_count;
+    if (trainer.gradients.size() < buffer_count) trainer.gradients.resize(buffer_count);
+    for (int i = 0; i < buffer_count; i++)
+    {
+        trainer.gradients[i].assign(parameter_count, 0.f);
+    }
+    trainer.losses.assign(shard_count, 0.f);
+
+    thread_pool_run(trainer.pool, shard_count, [&](int shard, int worker) {
+        ValuePool* saved_value_pool = g_value_pool;
+        g_value_pool = trainer.value_pools[worker];
+
+        for (int i = 0; i < parameter_count; i++)
+        {
+            Value* parameter = get_value(trainer.parameters[i]);
+            parameter->data = g_main_value_pool.values[trainer.parameters[i].idx].data;
+            parameter->gradient = 0.f;
+        }
+
+        int begin = shard * trainer.shard_size;
+        int end = begin + trainer.shard_size < sample_count ? begin + trainer.shard_size : sample_count;
+        trainer.losses[shard] = mlp_accumulate_gradient(*trainer.mlp, input, expect, 1, begin, end);
+
+        if (atomic)
+        {
+            for (int i = 0; i < parameter_count; i++)
+            {
+                std::atomic_ref<float> sum(trainer.gradients[0][i]);
+                sum.fetch_add(get_value(trainer.parameters[i])->gradient, std::memory_order_relaxed);
+            }
+        }
+        else
+        {
+            for (int i = 0; i < parameter_count; i++)
+            {
+                trainer.gradients[shard][i] = get_value(trainer.parameters[i])->gradient;
+            }
+        }
+
+        g_value_pool = saved_value_pool;
+    });
+
+    if (!atomic) trainer_reduce_gradients(trainer, shard_count);
+
+    float loss = 0.f;
+    for (int i = 0; i < shard_count; i++)
+    {
+        loss += trainer.losses[i];
+    }
+
+    for (int i = 0; i < parameter_count; i++)
+    {
+        get_value(trainer.parameters[i])->gradient = trainer.gradients[0][i];
+    }
+    optimizer_step(*trainer.optimizer);
+
+    return loss;
+}
+
+enum HogwildUpdate
+{
+    HOGWILD_RACY = 0, // relaxed load + store, concurrent updates to one parameter may be lost
+    HOGWILD_ATOMIC,   // relaxed fetch_add, every update lands but still no ordering or barrier
+};
+
+// lock free asynchronous sgd over one epoch. the samples are split in one part per thread,
+// for every sample a worker reads the shared parameters from the main pool, backprops it
+// in its private pool and writes the sgd update straight back. zero gradients are skipped, so sparse samples only
+// touch the parameters they actually use. the trainer optimizer is not used here.
+// returns the summed loss seen by the workers while training.
+float trainer_hogwild_epoch(DataParallelTrainer& trainer, std::vector<std::vector<float>>& input, std::vector<std::vector<float>>& expect,
+    float learning_rate, HogwildUpdate update = HogwildUpdate::HOGWILD_RACY)
+{
+    assert(input.size() == expect.size());
+    int sample_count = (int)input.size();
+
+    trainer.losses.assign(trainer.thread_count, 0.f);
+    thread_pool_run(trainer.pool, trainer.thread_count, [&](int part, int worker) {
+        ValuePool* saved_value_pool = g_value_pool;
+        g_value_pool = trainer.value_pools[worker];
+
+        int begin = (int)((long long)sample_count * part / trainer.thread_count);
+        int end = (int)((long long)sample_count * (part + 1) / trainer.thread_count);
+        float loss = 0.f;
+        for (int s = begin; s < end; s++)
+        {
+            for (int i = 0; i < trainer.parameters.size(); i++)
+            {
+                std::atomic_ref<float> shared(g_main_value_pool.values[trainer.parameters[i].idx].data);
+                Value* parameter = get_value(trainer.parameters[i]);
+                parameter->data = shared.load(std::memory_order_relaxed);
+                parameter->gradient = 0.f;
+            }
+
+            loss += mlp_accumulate_gradient(*trainer.mlp, input, expect, 1, s, s + 1);
+
+            for (int i = 0; i < trainer.parameters.size(); i++)
+            {
+                float gradient = get_value(trainer.parameters[i])->gradient;
+                if (gradient == 0.f) continue;
+
+                std::atomic_ref<float> shared(g_main_value_pool.values[trainer.parameters[i].idx].data);
+                if (update == HogwildUpdate::HOGWILD_ATOMIC)
+                {
+                    shared.fetch_add(-learning_rate * gradient, std::memory_order_relaxed);
+                }
+                else
+                {
+                    float data = shared.load(std::memory_order_relaxed);
+                    shared.store(data - learning_rate * gradient, std::memory_order_relaxed);
+                }
+            }
+        }
+        trainer.losses[part] = loss;
+
+        g_value_pool = saved_value_pool;
+    });
+
+    float loss = 0.f;
+    for (int i = 0; i < trainer.thread_count; i++)
+    {
+        loss += trainer.losses[i];
+    }
+    return loss;
+}
+
+typedef std::function<void(int step, std::vector<std::vector<float>>& input, std::vector<std::vector<float>>& expect)> BatchLoader;
+typedef std::function<void(int step, float loss)> StepLogger;
+
+struct PipelineBatch
+{
+    std::vector<std::vector<float>> input;
+    std::vector<std::vector<float>> expect;
+};
+
+// overlaps consecutive training steps. steps run in rounds of staleness + 1 lanes:
+// every lane computes the gradient of one step on the same parameter snapshot, lane 0
+// on the main thread and the others in private value pools, then the updates are
+// applied in step order. meanwhile a spare worker loads the batches of the next round
+// and logs the previous one.
+//   staleness 0: one lane, only loading and logging overlap, bit identical to the sequential loop
+//   staleness s: the gradient of a step is computed on parameters at most s updates old
+struct TrainingPipeline
+{
+    MLP* mlp = NULL;
+    Optimizer* optimizer = NULL;
+    BatchLoader loader;
+    StepLogger logger;
+    int staleness = 0;
+    int version = 0; // number of updates applied to the main parameters
+    ThreadPool pool;
+    std::vector<ValueHandle> parameters;
+    std::vector<ValuePool*> value_pools;      // lane 0 uses the main pool and has none
+    std::vector<PipelineBatch> batches;       // two rounds worth, current and next
+    std::vector<std::vector<float>> gradients;
+    std::vector<float> losses;
+    std::vector<int> snapshot_versions;       // parameter version each lane computed on
+};
+
+// scalar layers only, like trainer_init
+bool pipeline_init(TrainingPipeline& pipeline, MLP& mlp, Optimizer& optimizer, BatchLoader loader, StepLogger logger, int staleness)
+{
+    assert(staleness >= 0);
+    assert(!mlp_has_tensor_layer(mlp));
+    if (mlp_has_tensor_layer(mlp))
+    {
+        fprintf(stderr, "mlp has tensor layers, pipeline lanes run scalar layers only! pipeline init failed!");
+        return false;
+    }
+    pipeline.mlp = &mlp;
+    pipeline.optimizer = &optimizer;
+    pipeline.loader = loader;
+    pipeline.logger = logger;
+    pipeline.staleness = staleness;
+    pipeline.version = 0;
+    pipeline.parameters = mlp_parameters(mlp);
+
+    int lane_count = staleness + 1;
+    thread_pool_init(pipeline.pool, lane_count + 1);
+
+    evaluate_pending();
+    int persistent_count = g_value_pool->value_count;
+    pipeline.value_pools.assign(lane_count, NULL);
+    for (int l = 1; l < lane_count; l++)
+    {
+        ValuePool* value_pool = new ValuePool;
+        for (int j = 0; j < persistent_count; j++)
+        {
+            value_pool->values[j] = g_value_pool->values[j];
+        }
+        value_pool->value_count = persistent_count;
+        value_pool->peak_value_count = persistent_count;
+        value_pool->evaluated_count = persistent_count;
+        pipeline.value_pools[l] = value_pool;
+    }
+    pipeline.batches.resize(2 * lane_count);
+    pipeline.gradients.assign(lane_count, std::vector<float>(pipeline.parameters.size(), 0.f));
+    pipeline.losses.assign(2 * lane_count, 0.f);
+    pipeline.snapshot_versions.assign(lane_count, 0);
+    return true;
+}
+
+void pipeline_shutdown(TrainingPipeline& pipeline)
+{
+    thread_pool_shutdown(pipeline.pool);
+    for (int l = 0; l < pipeline.value_pools.size(); l++)
+    {
+        delete pipeline.value_pools[l];
+    }
+    pipeline.value_pools.clear();
+}
+
+void pipeline_compute_lane(TrainingPipeline& pipeline, int lane, PipelineBatch& batch, float& loss)
+{
+    ValuePool* saved_value_pool = g_value_pool;
+    if (lane > 0)
+    {
+        // snapshot the main parameters, nothing writes them until every lane of the round is done
+        g_value_pool = pipeline.value_pools[lane];
+        for (int i = 0; i < pipeline.parameters.size(); i++)
+        {
+            get_value(pipeline.parameters[i])->data = g_main_value_pool.values[pipeline.parameters[i].idx].data;
+        }
+    }
+    pipeline.snapshot_versions[lane] = pipeline.version;
+
+    for (int i = 0; i < pipeline.parameters.size(); i++)
+    {
+        get_value(pipeline.parameters[i])->gradient = 0.f;
+    }
+    loss = mlp_accumulate_gradient(*pipeline.mlp, batch.input, batch.expect, 1);
+    for (int i = 0; i < pipeline.parameters.size(); i++)
+    {
+        pipeline.gradients[lane][i] = get_value(pipeline.parameters[i])->gradient;
+    }
+
+    g_value_pool = saved_value_pool;
+}
+
+// runs step_count training steps, returns the loss of every step
+std::vector<float> pipeline_run(TrainingPipeline& pipeline, int step_count)
+{
+    int lane_count = pipeline.staleness + 1;
+    int round_count = (step_count + lane_count - 1) / lane_count;
+    std::vector<float> step_loss(step_count, 0.f);
+
+    for (int l = 0; l < lane_count && l < step_count; l++)
+    {
+        pipeline.loader(l, pipeline.batches[l].input, pipeline.batches[l].expect);
+    }
+
+    for (int r = 0; r < round_count; r++)
+    {
+        int base = r * lane_count;
+        int lanes = step_count - base < lane_count ? step_count - base : lane_count;
+        int current = (r % 2) * lane_count;
+        int next = ((r + 1) % 2) * lane_count;
+
+        // lanes 1.. plus the load / log task
+        std::atomic<int> remaining = lanes;
+        for (int l = 1; l < lanes; l++)
+        {
+            thread_pool_push(pipeline.pool, l, [&, l](int worker) {
+                pipeline_compute_lane(pipeline, l, pipeline.batches[current + l], pipeline.losses[current + l]);
+                remaining.fetch_sub(1);
+            });
+        }
+
+        // load the next round and log the previous one while the gradients are computed
+        thread_pool_push(pipeline.pool, lane_count, [&](int worker) {
+            for (int l = 0; l < lane_count && base + lane_count + l < step_count; l++)
+            {
+                pipeline.loader(base + lane_count + l, pipeline.batches[next + l].input, pipeline.batches[next + l].expect);
+            }
+            if (r > 0 && pipeline.logger)
+            {
+                for (int l = 0; l < lane_count; l++)
+                {
+                    pipeline.logger(base - lane_count + l, step_loss[base - lane_count + l]);
+                }
+            }
+            remaining.fetch_sub(1);
+        });
+
+        pipeline_compute_lane(pipeline, 0, pipeline.batches[current], pipeline.losses[current]);
+        thread_pool_wait(pipeline.pool, 0, remaining);
+
+        for (int l = 0; l < lanes; l++)
+        {
+            assert(pipeline.version - pipeline.snapshot_versions[l] <= pipeline.staleness);
+            for (int i = 0; i < pipeline.parameters.size(); i++)
+            {
+                get_value(pipeline.parameters[i])->gradient = pipeline.gradients[l][i];
+            }
+            optimizer_step(*pipeline.optimizer);
+            pipeline.version++;
+            step_loss[base + l] = pipeline.losses[current + l];
+        }
+    }
+
+    if (pipeline.logger)
+    {
+        int last_base = (round_count - 1) * lane_count;
+        for (int step = last_base > 0 ? last_base : 0; step < step_count; step++)
+        {
+            pipeline.logger(step, step_loss[step]);
+        }
+    }
+    return step_loss;
+}
+
+#endif